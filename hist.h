@@ -0,0 +1,99 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <sys/param.h>
+
+#include <stdint.h>
+
+/*
+ * Latency histograms in the style of HdrHistogram: values below
+ * 2 * HIST_SUB get a bucket each, and every power of two above that is split
+ * into HIST_SUB buckets, so any value is known to within 1 / HIST_SUB of
+ * itself. Histograms must start out zeroed, with min at UINT64_MAX.
+ */
+#define	HIST_SUB_BITS	5
+#define	HIST_SUB	(1U << HIST_SUB_BITS)
+#define	HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	buckets[HIST_BUCKETS];
+};
+
+static inline unsigned int
+hist_index(uint64_t v)
+{
+	unsigned int shift;
+
+	if (v < 2 * HIST_SUB) {
+		return v;
+	}
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (v >> shift);
+}
+
+/* The largest value that lands in bucket i. */
+static inline uint64_t
+hist_value(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < 2 * HIST_SUB) {
+		return i;
+	}
+
+	shift = i / HIST_SUB - 1;
+	return ((uint64_t)(i - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+static inline void
+hist_add(struct hist *h, uint64_t v)
+{
+
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	h->min = MIN(h->min, v);
+	h->max = MAX(h->max, v);
+}
+
+static inline void
+hist_merge(struct hist *to, const struct hist *from)
+{
+
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		to->buckets[i] += from->buckets[i];
+	}
+	to->count += from->count;
+	to->sum += from->sum;
+	to->min = MIN(to->min, from->min);
+	to->max = MAX(to->max, from->max);
+}
+
+/*
+ * The value at quantile q: the top of the first bucket by which at least
+ * q of the samples have been seen, but never more than the largest sample.
+ */
+static inline uint64_t
+hist_quantile(const struct hist *h, double q)
+{
+	uint64_t want, seen;
+
+	want = (uint64_t)(q * h->count + 0.5);
+	want = MAX(want, 1);
+	seen = 0;
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) {
+			return MIN(hist_value(i), h->max);
+		}
+	}
+
+	return h->max;
+}
+
+#endif
@@ -16,4 +16,22 @@ rdtscp(void)
 	return (((uint64_t)edx << 32) | eax);
 }
 
+/* The least cost of reading the TSC twice in a row. */
+static inline uint64_t
+rdtscp_overhead(void)
+{
+	uint64_t st, et, best;
+
+	best = UINT64_MAX;
+	for (int i = 0; i < 10000; i++) {
+		st = rdtscp();
+		et = rdtscp();
+		if (et - st < best) {
+			best = et - st;
+		}
+	}
+
+	return best;
+}
+
 #endif
@@ -18,370 +18,4986 @@
  * allocating.
  */
 
+#define	_GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/user.h>
 
+#include <linux/mempolicy.h>
+
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <ck_pr.h>
 
+/*
+ * Restartable sequences need a little assembly per architecture, and a
+ * double-width CAS for the remote freelists.
+ */
+#if defined(__x86_64__) && defined(CK_F_PR_CAS_PTR_2_VALUE) && \
+    defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define	USLAB_HAVE_RSEQ
+#endif
+#endif
+
 #include "uslab.h"
 
-struct uslab *
-uslab_create_heap(size_t size_class, uint64_t nelem, uint64_t npt_slabs)
-{
-	char *cur_slab, *cur_base;
-	struct uslab *a;
-	uint64_t i;
+#ifdef USLAB_HAVE_RSEQ
+static inline bool uslab_rseq_registered(void);
+#endif
 
-	if (((size_class * nelem) / npt_slabs) == 0) {
-		return NULL;
-	}
+__thread struct uslab_pt *uslab_pt __attribute__((weak));
 
-	a = calloc(1, (2 * PAGE_SIZE) + (size_class * nelem));
-	if (a == NULL) {
-		return NULL;
-	}
+/*
+ * Per-thread magazines. Each thread has a small number of them, and a slab
+ * claims one the first time the thread touches it. A magazine is only ever
+ * accessed by its thread, so filling it from and draining it to the slab is
+ * the only time we need to touch shared state.
+ *
+ * Slabs are identified by address and by a process-wide serial number, so
+ * that a new slab mapped at the address of a destroyed one never sees stale
+ * objects. We never dereference the slab a magazine points at unless it is
+ * the slab we were called with.
+ */
+#define	USLAB_MAGAZINES	4
 
-	cur_slab = ((char *)a) + PAGE_SIZE;
-	a->slab0_base = cur_base = ((char *)a) + (2 * PAGE_SIZE);
+struct uslab_magazine {
+	struct uslab	*slab;
+	uint64_t	serial;
+	uint64_t	n;
+	void		*objs[USLAB_MAGAZINE_SIZE];
+};
 
-	a->pt_base = (struct uslab_pt *)cur_slab;
-	a->pt_size = (size_class * nelem) / npt_slabs;
-	a->pt_slabs = npt_slabs;
-	a->size_class = size_class;
-	a->slab_len = size_class * nelem;
+static __thread struct uslab_magazine uslab_magazines[USLAB_MAGAZINES];
+static uint64_t uslab_serial;
 
-	for (i = 0; i < npt_slabs; i++) {
-		struct uslab_pt *pt;
+/*
+ * Per-thread statistics for USLAB_STATS slabs. A thread gets a block of
+ * counters for each slab it uses, which only it ever writes, so counting
+ * costs no atomic operations and no shared cachelines. Every block is also
+ * on a process-wide list, which uslab_stats walks to sum them. Blocks are
+ * never freed: those of exited threads keep their counts, and are handed to
+ * the next thread to use the same slab, and those of destroyed slabs are
+ * handed to anyone.
+ *
+ * Failed CASes and steals happen deep in the allocator, on paths that are
+ * slow anyway, so they're counted in the thread-local counters below, and
+ * charged to a slab by the difference across a call.
+ */
+#define	USLAB_STATS_SLOTS	4
 
-		pt = (struct uslab_pt *)cur_slab;
-		pt->base = pt->first_free = cur_base;
-		pt->size = a->pt_size;
-		pt->offset = i;
+struct uslab_tstats {
+	struct uslab		*slab;
+	uint64_t		serial;
+	uint64_t		live;
+	uint64_t		allocs;
+	uint64_t		frees;
+	uint64_t		retries;
+	uint64_t		steals;
+	uint64_t		ooms;
+	struct uslab_tstats	*next;		/* Every block */
+	struct uslab_tstats	*next_mine;	/* The owning thread's blocks */
+};
 
-		cur_slab += sizeof (*pt);
-		cur_base += a->pt_size;
-	}
+static __thread struct uslab_tstats *uslab_tstats_slots[USLAB_STATS_SLOTS];
+static __thread struct uslab_tstats *uslab_tstats_mine;
+static __thread uint64_t uslab_retries;
+static __thread uint64_t uslab_steals;
+static struct uslab_tstats *uslab_tstats_all;
+static pthread_once_t uslab_tstats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uslab_tstats_key;
 
-	return a;
-}
+/*
+ * Allocation tracing. One slab at a time may be traced. Each thread that
+ * calls into it appends records to a ring of its own, with no locks and no
+ * shared writes, and only takes uslab_trace_lock to write its ring out to the
+ * trace file when the ring fills or the thread exits. Stopping the trace
+ * writes out every ring. uslab_trace_cur is the trace being taken, or NULL,
+ * and is all that calls into untraced slabs look at.
+ *
+ * Rings belong to a trace by its session number. A ring left over from an
+ * earlier trace is emptied and numbered anew the first time its thread
+ * records into the next one.
+ */
+#define	USLAB_TRACE_RING	4096
 
-struct uslab *
-uslab_create_anonymous(void *base, size_t size_class, uint64_t nelem,
-    uint64_t npt_slabs)
+struct uslab_trace_ring {
+	uint64_t		session;
+	uint64_t		tid;
+	uint64_t		n;		/* Records appended */
+	uint64_t		written;	/* Records written out */
+	struct uslab_trace_ring	*next;
+	struct uslab_trace_ring	*prev;
+	struct uslab_trace_rec	recs[USLAB_TRACE_RING];
+};
+
+struct uslab_trace {
+	struct uslab		*slab;
+	uint64_t		serial;
+	uint64_t		session;
+	int			fd;
+	int			error;
+	off_t			off;
+	struct uslab_trace_hdr	hdr;
+};
+
+static struct uslab_trace uslab_tracer;
+static struct uslab_trace *uslab_trace_cur;
+static struct uslab_trace_ring *uslab_trace_rings;
+static pthread_mutex_t uslab_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t uslab_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uslab_trace_key;
+static __thread struct uslab_trace_ring *uslab_trace_ring;
+
+/*
+ * The region index the calling thread was assigned by the slab it first
+ * allocated from. Threads reuse it for every other slab they touch, so that
+ * they don't need a uslab_pt per slab.
+ */
+static __thread uint64_t uslab_pt_index;
+
+/*
+ * The NUMA node the calling thread runs on, looked up the first time it
+ * touches a NUMA slab.
+ */
+static __thread int uslab_node = -1;
+
+/*
+ * Identifies a slab header, and the version of its layout. Reopening a
+ * ramdisk slab with a different magic fails.
+ */
+#define	USLAB_MAGIC		0x75736c616200000cULL
+
+/* Flags that change the layout of a slab, and must match when reopening. */
+#define	USLAB_LAYOUT_FLAGS	(USLAB_TAGGED | USLAB_PERCPU | USLAB_HUGE_FLAGS | \
+				 USLAB_RELOCATABLE | USLAB_REMOTE | USLAB_QUEUE_FLAGS | \
+				 USLAB_DEBUG | USLAB_LINK_MASK | USLAB_COLOR | \
+				 USLAB_ALIGN_MASK)
+
+/* Bits in the node masks we exchange with the kernel. */
+#define	USLAB_NODEMASK_BITS	1024
+
+/*
+ * Without a double-width CAS, the tagged single-word head is the only format
+ * we can offer.
+ */
+#ifdef CK_F_PR_CAS_PTR_2_VALUE
+#define	USLAB_FORCED_FLAGS	0
+#else
+#define	USLAB_FORCED_FLAGS	USLAB_TAGGED
+#endif
+
+/*
+ * Number of bits needed to store every valid offset into a region, including
+ * the end-of-region offset that marks it as full.
+ */
+static unsigned int
+uslab_tag_shift(size_t pt_size)
 {
-	int mflags = MAP_ANONYMOUS | MAP_PRIVATE;
-	char *cur_slab, *cur_base;
-	struct uslab *a;
-	uint64_t i;
-	void *map;
 
-	if (((size_class * nelem) / npt_slabs) == 0) {
-		return NULL;
-	}
+	return 64 - __builtin_clzll(pt_size);
+}
 
-	if (base != NULL) {
-		mflags |= MAP_FIXED;
-	}
+static uint64_t
+uslab_ncpus(void)
+{
+	long n;
 
-	map = mmap(base, (2 * PAGE_SIZE) + (nelem * size_class),
-	    PROT_READ | PROT_WRITE, mflags, -1, 0);
-	if (map == MAP_FAILED) {
-		perror("mmap");
-		return NULL;
-	}
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	return (n > 0) ? (uint64_t)n : 1;
+}
 
-	a = map;
-	cur_slab = ((char *)a) + PAGE_SIZE;
-	a->slab0_base = cur_base = ((char *)a) + (2 * PAGE_SIZE);
+#define	USLAB_ALIGN_DOWN(x, a)	((uintptr_t)(x) & ~(uintptr_t)((a) - 1))
+#define	USLAB_ALIGN_UP(x, a)	USLAB_ALIGN_DOWN((uintptr_t)(x) + (a) - 1, (a))
 
-	a->pt_base = (struct uslab_pt *)cur_slab;
-	a->pt_size = (size_class * nelem) / npt_slabs;
-	a->pt_slabs = npt_slabs;
-	a->size_class = size_class;
-	a->slab_len = size_class * nelem;
+/*
+ * Addresses stored in the slab, that is the region bases, freelist heads and
+ * links, are the address minus the bias: the address of the slab header for
+ * relocatable slabs, and zero otherwise. The mask saves a branch on every
+ * translation. Freelists are walked and bounds-checked on stored values, and
+ * only translated to dereference them or hand them out.
+ */
+static inline uintptr_t
+uslab_bias(struct uslab *a)
+{
 
-	for (i = 0; i < npt_slabs; i++) {
-		struct uslab_pt *pt;
+	return (uintptr_t)a & a->reloc_mask;
+}
 
-		pt = (struct uslab_pt *)cur_slab;
-		pt->base = pt->first_free = cur_base;
-		pt->size = a->pt_size;
-		pt->offset = i;
+static inline char *
+uslab_addr(struct uslab *a, const void *x)
+{
 
-		cur_slab += sizeof (*pt);
-		cur_base += a->pt_size;
-	}
+	return (char *)x + uslab_bias(a);
+}
 
-	return a;
+static inline char *
+uslab_stored(struct uslab *a, const void *p)
+{
+
+	return (char *)p - uslab_bias(a);
 }
 
-static void
-uslab_close_fd(int fd)
+/*
+ * The freelist link of the free object at address p, which is link_offset
+ * bytes into it; see USLAB_LINK.
+ */
+static inline struct uslab_entry *
+uslab_link(struct uslab *a, const void *p)
 {
-	int r;
 
-	do {
-		r = close(fd);
-	} while (r == -1 && errno == EINTR);
+	return (struct uslab_entry *)((char *)p + a->link_offset);
 }
 
-struct uslab *
-uslab_create_ramdisk(const char *path, void *base, size_t size_class,
-    uint64_t nelem, uint64_t npt_slabs)
+/* The region headers. */
+static inline struct uslab_pt *
+uslab_pts(struct uslab *a)
 {
-	int fd, r, mflags = MAP_SHARED;
-	char *cur_slab, *cur_base;
-	struct uslab *a;
-	struct stat sb;
-	bool opened;
-	uint64_t i;
-	void *map;
 
-	if (((size_class * nelem) / npt_slabs) == 0) {
-		return NULL;
-	}
+	return (struct uslab_pt *)uslab_addr(a, a->pt_base);
+}
 
-	opened = false;
-	r = stat(path, &sb);
-	if (r == -1 && errno == ENOENT) {
-		const char z = 0;
-		ssize_t s;
-		off_t o;
-		int e;
+/* How far into its stride region i starts; see USLAB_COLOR. */
+static inline size_t
+uslab_pt_offset(struct uslab *a, uint64_t i)
+{
 
-		if ((fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
-			return NULL;
-		}
+	return (i * a->pt_color) % USLAB_COLOR_SPAN;
+}
 
-		o = lseek(fd, (2 * PAGE_SIZE) + (nelem * size_class) - 1, SEEK_SET);
-		if (o == -1) {
-			e = errno;
-			uslab_close_fd(fd);
-			errno = e;
-			return NULL;
-		}
+/* The base of region i, as stored. */
+static inline char *
+uslab_pt_base(struct uslab *a, uint64_t i)
+{
 
-		do {
-			s = write(fd, &z, 1);
-		} while (s == -1 && errno == EINTR);
+	return a->slab0_base + i * a->pt_stride + uslab_pt_offset(a, i);
+}
 
-		if (s == -1) {
-			e = errno;
-			uslab_close_fd(fd);
-			errno = e;
-			return NULL;
-		}
+/* The bitmap of regions that may have free objects, after the headers. */
+static inline uint64_t *
+uslab_avail(struct uslab *a)
+{
 
-		o = lseek(fd, 0, SEEK_SET);
-		if (o == -1) {
-			e = errno;
-			uslab_close_fd(fd);
-			errno = e;
-			return NULL;
-		}
+	return (uint64_t *)(uslab_pts(a) + a->pt_max);
+}
 
-		sb.st_size = (2 * PAGE_SIZE) + (nelem * size_class);
-	} else {
-		if ((fd = open(path, O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
-			return NULL;
+/*
+ * The index of the object at x, as stored, counting by region and then by
+ * position in the region, or UINT64_MAX if x isn't the start of an object of
+ * one of the slab's regions.
+ */
+static inline uint64_t
+uslab_index(struct uslab *a, const char *x)
+{
+	uint64_t off, per, region, within, i;
+
+	off = (uintptr_t)x - (uintptr_t)a->slab0_base;
+	if (a->pt_stride == a->pt_size) {
+		i = uslab_div(&a->size_div, off);
+		if (off >= ck_pr_load_64(&a->pt_slabs) * a->pt_size ||
+		    i * a->size_class != off) {
+			return UINT64_MAX;
 		}
 
-		opened = true;
+		return i;
 	}
 
-	if (base != NULL) {
-		mflags |= MAP_FIXED;
+	region = uslab_div(&a->pt_div, off);
+	within = off - region * a->pt_stride - uslab_pt_offset(a, region);
+	i = uslab_div(&a->size_div, within);
+	if (region >= ck_pr_load_64(&a->pt_slabs) || within >= a->pt_size ||
+	    i * a->size_class != within) {
+		return UINT64_MAX;
 	}
 
-	map = mmap(base, sb.st_size, PROT_READ | PROT_WRITE, mflags, fd, 0);
-	uslab_close_fd(fd);
-
-	if (map == MAP_FAILED) {
-		return NULL;
-	}
+	per = uslab_div(&a->size_div, a->pt_size);
+	return region * per + i;
+}
 
-	a = map;
+/* The allocated object map of a USLAB_DEBUG slab. */
+static inline uint8_t *
+uslab_debug_map(struct uslab *a)
+{
 
-	cur_slab = ((char *)a) + PAGE_SIZE;
+	return (uint8_t *)uslab_addr(a, a->debug_map);
+}
 
-	a->slab0_base = cur_base = ((char *)a) + (2 * PAGE_SIZE);
-	a->pt_base = (struct uslab_pt *)cur_slab;
-	a->pt_size = (size_class * nelem) / npt_slabs;
-	a->pt_slabs = npt_slabs;
-	a->size_class = size_class;
-	a->slab_len = size_class * nelem;
+/*
+ * Mark objects i to i + n - 1 of a USLAB_DEBUG slab allocated or free. Only
+ * for objects nobody else can be handing out or freeing.
+ */
+static void
+uslab_debug_mark(struct uslab *a, uint64_t i, uint64_t n, bool allocated)
+{
 
-	for (i = 0; i < npt_slabs; i++) {
-		struct uslab_pt *pt;
+	memset(uslab_debug_map(a) + i, allocated, n);
+}
 
-		pt = (struct uslab_pt *)cur_slab;
-		pt->base = cur_base;
-		if (opened == false) {
-			pt->first_free = cur_base;
-		}
-		pt->size = a->pt_size;
-		pt->offset = i;
+/*
+ * The size of the pages backing a slab. Transparent huge pages are assumed
+ * to be PMD-sized, which is 2 MiB on every architecture we care about.
+ */
+static size_t
+uslab_page_size(unsigned int flags)
+{
 
-		cur_slab += sizeof (*pt);
-		cur_base += a->pt_size;
+	if (flags & USLAB_HUGE_1GB) {
+		return 1ULL << 30;
+	} else if (flags & (USLAB_HUGE_2MB | USLAB_THP)) {
+		return 1ULL << 21;
 	}
 
-	return a;
+	return PAGE_SIZE;
 }
 
-void
-uslab_destroy_heap(struct uslab *a)
+/*
+ * The slab header is a page holding struct uslab, followed by as many pages
+ * as the region headers and the bitmap of regions with free objects need.
+ * Huge page slabs pad it out to a whole huge page, so that objects start on
+ * a huge page boundary.
+ */
+static size_t
+uslab_hdr_len(uint64_t npt_slabs, unsigned int flags)
 {
 
-	free(a);
+	return USLAB_ALIGN_UP(PAGE_SIZE + npt_slabs * sizeof (struct uslab_pt) +
+	    (npt_slabs + 63) / 64 * sizeof (uint64_t), uslab_page_size(flags));
 }
 
-void
-uslab_destroy_map(struct uslab *a)
+/*
+ * Regions hold a whole number of objects, so that no object straddles two
+ * regions.
+ */
+static size_t
+uslab_pt_size(size_t size_class, uint64_t nelem, uint64_t npt_slabs)
+{
+
+	return ((size_class * nelem) / npt_slabs) / size_class * size_class;
+}
+
+/* Objects are their size rounded up to the USLAB_ALIGN alignment apart. */
+static size_t
+uslab_stride(size_t size_class, unsigned int flags)
 {
 
-	munmap(a, a->slab_len);
+	return USLAB_ALIGN_UP(size_class, USLAB_ALIGNMENT(flags));
 }
 
 /*
- * When we begin, our slab is sparse and zeroed. Effectively, this means that
- * we obtain our memory either with mmap(2) and MAP_ANONYMOUS, by using
- * shm_open(3), ftruncate(2), and mmap(2), or the mmap(2)-backed file comes
- * from a RAM-backed storage that initializes to 0 on access.
- *
- * Our approach is to find the first free block. We then figure out what the
- * next free block will be. If the next free block is NULL, we know that the
- * block immediately following the block we've chosen is the next logically
- * free block.
- *
- * We are prone to ABA. If we read first_free, load the next_free from it, and
- * are subsequently pre-empted, another concurrent process could allocate and
- * then free our target. Additional allocations may have occurred which alter
- * the target's next_free member by the time it was freed. In this case, we
- * would end up in an inconsistent state. We solve this problem by doing a
- * CAS2 on our slab to update both the free block and a generation counter.
+ * The step between the colors of successive regions: a cacheline, or as
+ * much as keeps objects aligned. Zero if the slab isn't colored, or if no
+ * two colors would fit in USLAB_COLOR_SPAN.
  */
-void *
-uslab_alloc(struct uslab *a)
+static size_t
+uslab_pt_color(unsigned int flags)
+{
+	size_t color;
+
+	color = MAX(USLAB_ALIGNMENT(flags), 64);
+	return ((flags & USLAB_COLOR) && color < USLAB_COLOR_SPAN) ? color : 0;
+}
+
+/*
+ * Regions are packed back to back, except on huge page slabs, where each
+ * one starts on a huge page boundary so that no huge page is shared by two
+ * regions, and on colored slabs, where each is followed by room for its
+ * color.
+ */
+static size_t
+uslab_pt_stride(size_t size_class, uint64_t nelem, uint64_t npt_slabs,
+    unsigned int flags)
 {
-	struct uslab_pt update, original, *slab, *oa;
-	struct uslab_entry *target;
-	char *next_free;
+	size_t pt_size;
 
-	if (uslab_pt == NULL) {
-		uslab_pt = &a->pt_base[ck_pr_faa_64(&a->pt_ctr, 1) % a->pt_slabs];
+	pt_size = uslab_pt_size(size_class, nelem, npt_slabs);
+	if (uslab_pt_color(flags) != 0) {
+		pt_size += USLAB_COLOR_SPAN;
 	}
 
-	slab = uslab_pt;
+	if ((flags & USLAB_HUGE_FLAGS) == 0) {
+		return pt_size;
+	}
 
-retry:
-	/* If we're out of space, try to steal some memory from elsewhere */
-	if (slab->first_free >= slab->base + slab->size) {
-		uint64_t i = 1;
+	return USLAB_ALIGN_UP(pt_size, uslab_page_size(flags));
+}
 
-		oa = slab;
-		slab = &a->pt_base[(oa->offset + i) % a->pt_slabs];
-		while (slab != oa && slab->first_free >= slab->base + slab->size) {
-			slab = &a->pt_base[(oa->offset + i++) % a->pt_slabs];
-		}
+/*
+ * Queue slabs keep a ring after their last region, with a slot for every
+ * object they can hold, so that enqueueing an object of the slab that isn't
+ * already queued never fails. The ring starts out zeroed: the head and tail
+ * are zero, and slot sequence numbers are stored relative to the slot index,
+ * so every slot is free for the first lap.
+ */
+struct uslab_queue {
+	uint64_t	tail;
+	uint64_t	seen_head;
+	char		pad_tail[64 - 16];
 
-		/* OOM. */
-		if (slab == oa) {
-			return NULL;
-		}
+	uint64_t	head;
+	uint64_t	seen_tail;
+	char		pad_head[64 - 16];
+};
+
+struct uslab_queue_slot {
+	uint64_t	seq;
+	char		*obj;
+};
 
-		goto retry;
+static uint64_t
+uslab_queue_slots(size_t size_class, size_t pt_size, uint64_t pt_max)
+{
+	uint64_t n;
+
+	n = pt_max * (pt_size / size_class);
+	return (n <= 1) ? 1 : 1ULL << (64 - __builtin_clzll(n - 1));
+}
+
+/* Where the regions, and the queue if there is one, end. */
+static size_t
+uslab_queue_end(size_t size_class, size_t pt_size, size_t pt_stride,
+    uint64_t pt_max, unsigned int flags)
+{
+	size_t slot;
+
+	if ((flags & USLAB_QUEUE_FLAGS) == 0) {
+		return pt_max * pt_stride;
 	}
 
-	original.generation = ck_pr_load_ptr(&slab->generation);
-	ck_pr_fence_load();
-	original.first_free = ck_pr_load_ptr(&slab->first_free);
-	target = (struct uslab_entry *)original.first_free;
-	ck_pr_fence_load();
+	slot = (flags & USLAB_QUEUE) ?
+	    sizeof (struct uslab_queue_slot) : sizeof (char *);
+	return USLAB_ALIGN_UP(pt_max * pt_stride, 64) +
+	    sizeof (struct uslab_queue) +
+	    uslab_queue_slots(size_class, pt_size, pt_max) * slot;
+}
 
-	if (target->next_free == 0) {
-		/*
-		 * When this is the last block, this will put an address
-		 * outside the bounds of the slab into the first_free member.
-		 * If we succeed, no other threads could win the bad value as
-		 * first_free is ABA protected and checked to be within bounds.
-		 */
-		next_free = original.first_free + a->size_class;
-	} else {
-		next_free = target->next_free;
+/*
+ * Debug slabs keep a map of allocated objects after the regions and the
+ * queue, with a byte for every object they can hold.
+ */
+static size_t
+uslab_debug_end(size_t size_class, size_t pt_size, size_t pt_stride,
+    uint64_t pt_max, unsigned int flags)
+{
+	size_t end;
+
+	end = uslab_queue_end(size_class, pt_size, pt_stride, pt_max, flags);
+	if ((flags & USLAB_DEBUG) == 0) {
+		return end;
 	}
 
-	update.generation = original.generation + 1;
-	update.first_free = next_free;
+	return USLAB_ALIGN_UP(end, 64) + pt_max * (pt_size / size_class);
+}
 
-	while (ck_pr_cas_ptr_2_value(slab, &original, &update, &original) == false) {
-		/*
-		 * We failed to get the optimistic allocation, and our new
-		 * first_free block is outside the bounds of this slab.
-		 * Revert to trying to steal one from elsewhere.
-		 */
-		if (slab->first_free >= slab->base + slab->size) {
-			slab = &a->pt_base[(slab->offset + 1) % a->pt_slabs];
-			goto retry;
-		}
+/* The length of the whole mapping, header included. */
+static size_t
+uslab_map_len(size_t size_class, uint64_t nelem, uint64_t npt_slabs,
+    unsigned int flags)
+{
 
-		update.generation = original.generation + 1;
-		target = (struct uslab_entry *)original.first_free;
-		ck_pr_fence_load();
-		if (target->next_free == 0) {
-			next_free = original.first_free + a->size_class;
-		} else {
-			next_free = target->next_free;
-		}
+	if (flags & (USLAB_QUEUE_FLAGS | USLAB_DEBUG)) {
+		return USLAB_ALIGN_UP(uslab_hdr_len(npt_slabs, flags) +
+		    uslab_debug_end(size_class,
+		    uslab_pt_size(size_class, nelem, npt_slabs),
+		    uslab_pt_stride(size_class, nelem, npt_slabs, flags),
+		    npt_slabs, flags), uslab_page_size(flags));
+	}
 
-		update.first_free = next_free;
+	if ((flags & USLAB_HUGE_FLAGS) == 0 && uslab_pt_color(flags) == 0) {
+		return uslab_hdr_len(npt_slabs, flags) + size_class * nelem;
 	}
-	ck_pr_add_64(&slab->used, a->size_class);
 
-	return target;
+	return uslab_hdr_len(npt_slabs, flags) +
+	    npt_slabs * uslab_pt_stride(size_class, nelem, npt_slabs, flags);
 }
 
-/*
- * An slab free routine that is safe with one or more concurrent unique
- * freeing processes in the face of many concurrent allocating processes. We
- * don't need any CAS2 voodoo here because we do not rely on the value of
- * next_free for the entry we are attempting to replace at the head of our
- * stack. Additionally, it is impossible for us to observe the same value
- * at the time we read target and the time we try to write to it because
- * no other concurrent processes know about target.
- */
-void
-uslab_free(struct uslab *a, void *p)
+static bool
+uslab_valid(size_t size_class, uint64_t nelem, uint64_t npt_slabs,
+    unsigned int flags)
 {
-	struct uslab_pt *allocated_slab;
-	struct uslab_entry *e;
-	char *target;
+	size_t pt_size;
 
-	/* Stupid. */
-	if (p == NULL) return;
+	if (npt_slabs == 0 || npt_slabs > nelem ||
+	    size_class < USLAB_LINK_OFFSET(flags) + sizeof (struct uslab_entry)) {
+		errno = EINVAL;
+		return false;
+	}
 
 	/*
-	 * We want to free these into the same section of the pool from which
-	 * they were allocated.
+	 * At most one kind of huge page, and of queue, and no alignment
+	 * beyond a page.
 	 */
-	allocated_slab = &a->pt_base[(((char *)p) - a->slab0_base) / a->pt_size];
+	if (__builtin_popcount(flags & USLAB_HUGE_FLAGS) > 1 ||
+	    USLAB_ALIGNMENT(flags) > PAGE_SIZE ||
+	    __builtin_popcount(flags & USLAB_QUEUE_FLAGS) > 1 ||
+	    (flags & (USLAB_POISON | USLAB_DEBUG)) == USLAB_POISON) {
+		errno = EINVAL;
+		return false;
+	}
 
-	do {
-		e = p;
-		target = ck_pr_load_ptr(&allocated_slab->first_free);
+	/*
+	 * Per-CPU slabs need a region for every CPU, place regions by CPU
+	 * rather than by node, and have remote lists of their own.
+	 */
+	if ((flags & USLAB_PERCPU) && ((flags & (USLAB_NUMA | USLAB_REMOTE)) ||
+	    npt_slabs < uslab_ncpus())) {
+		errno = EINVAL;
+		return false;
+	}
+
+	pt_size = uslab_pt_size(size_class, nelem, npt_slabs);
+	if (pt_size == 0) {
+		errno = EINVAL;
+		return false;
+	}
+
+	flags |= USLAB_FORCED_FLAGS;
+	if ((flags & USLAB_TAGGED) &&
+	    64 - uslab_tag_shift(pt_size) < USLAB_TAG_MIN_BITS) {
+		errno = EINVAL;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Spread the regions of a NUMA slab round-robin over the nodes we're allowed
+ * to allocate from, and ask the kernel to place each region's pages on its
+ * node. We use MPOL_PREFERRED so that a full node spills over rather than
+ * failing page faults. Placement is best-effort: if the kernel doesn't
+ * support it, the regions are still assigned to nodes for thread placement
+ * and stealing.
+ */
+#define	USLAB_NODEMASK_LONGS	(USLAB_NODEMASK_BITS / (8 * sizeof (unsigned long)))
+
+/* Assign region i to its node and ask for its pages to be placed there. */
+static void
+uslab_numa_place(struct uslab *a, uint64_t i)
+{
+	unsigned long mask[USLAB_NODEMASK_LONGS];
+	const size_t bpl = 8 * sizeof (unsigned long);
+	struct uslab_pt *pt;
+	uintptr_t lo, hi;
+
+	pt = &uslab_pts(a)[i];
+	pt->node = a->numa_nodes[i % a->numa_nnodes];
+
+	lo = USLAB_ALIGN_UP(uslab_addr(a, pt->base), a->page_size);
+	hi = USLAB_ALIGN_DOWN(uslab_addr(a, pt->base + pt->size),
+	    a->page_size);
+	if (hi <= lo) {
+		return;
+	}
+
+	memset(mask, 0, sizeof (mask));
+	mask[pt->node / bpl] = 1UL << (pt->node % bpl);
+	(void)syscall(SYS_mbind, (void *)lo, hi - lo, MPOL_PREFERRED,
+	    mask, USLAB_NODEMASK_BITS + 1, 0);
+}
+
+static void
+uslab_numa_init(struct uslab *a)
+{
+	unsigned long mask[USLAB_NODEMASK_LONGS];
+	const size_t bpl = 8 * sizeof (unsigned long);
+	unsigned int n, nn;
+	uint64_t i;
+
+	memset(mask, 0, sizeof (mask));
+	if (syscall(SYS_get_mempolicy, NULL, mask, USLAB_NODEMASK_BITS, NULL,
+	    MPOL_F_MEMS_ALLOWED) == -1) {
+		mask[0] = 1;
+	}
+
+	nn = 0;
+	for (n = 0; n < USLAB_NODEMASK_BITS && nn < USLAB_MAX_NODES; n++) {
+		if (mask[n / bpl] & (1UL << (n % bpl))) {
+			a->numa_nodes[nn++] = n;
+		}
+	}
+
+	if (nn == 0) {
+		a->numa_nodes[nn++] = 0;
+	}
+	a->numa_nnodes = nn;
+
+	for (i = 0; i < a->pt_slabs; i++) {
+		uslab_numa_place(a, i);
+	}
+}
+
+/*
+ * Prepare to divide by d. Powers of two shift; otherwise, with l the floor of
+ * log2(d), the magic number is 2^(64 + l) / d rounded up, which gives exact
+ * quotients for every 64-bit dividend when the rounding error is small
+ * enough. When it isn't, we use twice that, a 65-bit number whose top bit
+ * uslab_div adds back in.
+ */
+void
+uslab_div_init(struct uslab_div *v, uint64_t d)
+{
+	unsigned __int128 num;
+	uint64_t m, rem, twice;
+	uint32_t l;
+
+	l = 63 - __builtin_clzll(d);
+	v->d = d;
+	v->shift = l;
+	v->add = 0;
+	if ((d & (d - 1)) == 0) {
+		v->magic = 0;
+		return;
+	}
+
+	num = (unsigned __int128)1 << (64 + l);
+	m = (uint64_t)(num / d);
+	rem = (uint64_t)(num - (unsigned __int128)m * d);
+	if (d - rem >= (1ULL << l)) {
+		twice = rem + rem;
+		m += m;
+		if (twice >= d || twice < rem) {
+			m++;
+		}
+		v->add = 1;
+	}
+	v->magic = m + 1;
+}
+
+/*
+ * Lay out the slab header and per-thread regions. The header has room for
+ * pt_max regions, of which growable slabs start with npt_slabs. When fresh
+ * is false, we're attaching to an existing persistent slab and must leave
+ * its freelist heads alone.
+ */
+static void
+uslab_init(struct uslab *a, size_t size_class, uint64_t nelem,
+    uint64_t npt_slabs, uint64_t pt_max, unsigned int flags, bool fresh)
+{
+	char *cur_slab;
+	uint64_t i;
+
+	flags |= USLAB_FORCED_FLAGS;
+
+	a->magic = USLAB_MAGIC;
+	a->reloc_mask = (flags & USLAB_RELOCATABLE) ? ~(uintptr_t)0 : 0;
+
+	cur_slab = ((char *)a) + PAGE_SIZE;
+	a->slab0_base = uslab_stored(a,
+	    ((char *)a) + uslab_hdr_len(pt_max, flags));
+	a->pt_base = (struct uslab_pt *)uslab_stored(a, cur_slab);
+	a->pt_size = uslab_pt_size(size_class, nelem, npt_slabs);
+	a->pt_stride = uslab_pt_stride(size_class, nelem, npt_slabs, flags);
+	a->pt_color = uslab_pt_color(flags);
+	uslab_div_init(&a->pt_div, a->pt_stride);
+	uslab_div_init(&a->size_div, size_class);
+	a->pt_slabs = npt_slabs;
+	a->pt_max = pt_max;
+	a->page_size = uslab_page_size(flags);
+	a->size_class = size_class;
+	a->link_offset = USLAB_LINK_OFFSET(flags);
+	a->slab_len = MAX(uslab_map_len(size_class, nelem, npt_slabs, flags) -
+	    uslab_hdr_len(npt_slabs, flags), uslab_debug_end(size_class,
+	    a->pt_size, a->pt_stride, pt_max, flags));
+	a->flags = flags;
+	a->serial = ck_pr_faa_64(&uslab_serial, 1) + 1;
+	a->tag_shift = uslab_tag_shift(a->pt_size);
+	a->tag_mask = (1ULL << a->tag_shift) - 1;
+	a->queue = a->slab0_base + USLAB_ALIGN_UP(pt_max * a->pt_stride, 64);
+	a->queue_mask = uslab_queue_slots(size_class, a->pt_size, pt_max) - 1;
+	a->debug_map = (uint8_t *)(a->slab0_base +
+	    USLAB_ALIGN_UP(uslab_queue_end(size_class, a->pt_size, a->pt_stride,
+	    pt_max, flags), 64));
+
+	for (i = 0; i < npt_slabs; i++) {
+		struct uslab_pt *pt;
+
+		pt = (struct uslab_pt *)cur_slab;
+		pt->base = uslab_pt_base(a, i);
+
+		/*
+		 * A zeroed tagged head already refers to offset 0 with a zero
+		 * generation.
+		 */
+		if (fresh == true && (flags & USLAB_TAGGED) == 0) {
+			pt->first_free = pt->base;
+		}
+		if (fresh == true) {
+			pt->remote = pt->base + a->pt_size;
+		}
+		pt->size = a->pt_size;
+		pt->offset = i;
+		uslab_avail(a)[i / 64] |= 1ULL << (i % 64);
+
+		cur_slab += sizeof (*pt);
+	}
+
+	if (flags & USLAB_NUMA) {
+		uslab_numa_init(a);
+	}
+
+	/*
+	 * This decides, for every process attached to a per-CPU slab, whether
+	 * a region's local freelist belongs to its CPU, since the rseq fast
+	 * path updates freelist heads without atomic instructions. Threads
+	 * that find rseq missing later keep off the local freelists; see
+	 * uslab_percpu_alloc.
+	 */
+	a->percpu_rseq = 0;
+#ifdef USLAB_HAVE_RSEQ
+	if ((flags & USLAB_PERCPU) && (flags & USLAB_TAGGED) == 0 &&
+	    uslab_rseq_registered() == true) {
+		a->percpu_rseq = 1;
+	}
+#endif
+}
+
+struct uslab *
+uslab_create_heap_flags(size_t size_class, uint64_t nelem, uint64_t npt_slabs,
+    unsigned int flags)
+{
+	struct uslab *a;
+	size_t len;
+	void *map;
+	int e;
+
+	size_class = uslab_stride(size_class, flags);
+	if (uslab_valid(size_class, nelem, npt_slabs, flags) == false) {
+		return NULL;
+	}
+
+	if (flags & USLAB_HUGE_FLAGS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/*
+	 * Objects are aligned, and regions colored, relative to the header,
+	 * which calloc(3) would only align to 16 bytes.
+	 */
+	len = uslab_map_len(size_class, nelem, npt_slabs, flags);
+	if ((e = posix_memalign(&map, PAGE_SIZE, len)) != 0) {
+		errno = e;
+		return NULL;
+	}
+	memset(map, 0, len);
+	a = map;
+
+	uslab_init(a, size_class, nelem, npt_slabs, npt_slabs, flags, true);
+	a->backing = USLAB_BACKING_HEAP;
+
+	return a;
+}
+
+struct uslab *
+uslab_create_heap(size_t size_class, uint64_t nelem, uint64_t npt_slabs)
+{
+
+	return uslab_create_heap_flags(size_class, nelem, npt_slabs, 0);
+}
+
+/*
+ * Map len bytes for a slab. Hugetlb mappings come back aligned to their page
+ * size; for transparent huge pages we have to align the mapping ourselves,
+ * by reserving a little more address space than we need and trimming it.
+ * The kernel only backs huge-page-aligned ranges with huge pages.
+ */
+static void *
+uslab_map(void *base, size_t len, unsigned int flags, int mflags, int fd)
+{
+	size_t align;
+	char *r, *p;
+	void *map;
+
+	align = uslab_page_size(flags);
+	if (base != NULL && USLAB_ALIGN_DOWN(base, align) != (uintptr_t)base) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	if (flags & (USLAB_HUGE_2MB | USLAB_HUGE_1GB)) {
+		mflags |= MAP_HUGETLB |
+		    (__builtin_ctzll(align) << MAP_HUGE_SHIFT);
+		if (fd != -1) {
+			/* A hugetlbfs file; its pages are already huge. */
+			mflags &= ~(MAP_HUGETLB | (MAP_HUGE_MASK << MAP_HUGE_SHIFT));
+		}
+	}
+
+	if (base != NULL) {
+		return mmap(base, len, PROT_READ | PROT_WRITE,
+		    mflags | MAP_FIXED, fd, 0);
+	}
+
+	if ((flags & USLAB_THP) == 0) {
+		return mmap(NULL, len, PROT_READ | PROT_WRITE, mflags, fd, 0);
+	}
+
+	r = mmap(NULL, len + align, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (r == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+
+	p = (char *)USLAB_ALIGN_UP(r, align);
+	map = mmap(p, len, PROT_READ | PROT_WRITE, mflags | MAP_FIXED, fd, 0);
+	if (map == MAP_FAILED) {
+		munmap(r, len + align);
+		return MAP_FAILED;
+	}
+
+	if (p > r) {
+		munmap(r, p - r);
+	}
+	if (p + len < r + len + align) {
+		munmap(p + len, (r + len + align) - (p + len));
+	}
+
+	/* Best-effort: THP may be disabled, or set to "never". */
+	(void)madvise(map, len, MADV_HUGEPAGE);
+
+	return map;
+}
+
+struct uslab *
+uslab_create_anonymous_flags(void *base, size_t size_class, uint64_t nelem,
+    uint64_t npt_slabs, unsigned int flags)
+{
+	int mflags = MAP_ANONYMOUS | MAP_PRIVATE;
+	struct uslab *a;
+	void *map;
+
+	size_class = uslab_stride(size_class, flags);
+	if (uslab_valid(size_class, nelem, npt_slabs, flags) == false) {
+		return NULL;
+	}
+
+	map = uslab_map(base, uslab_map_len(size_class, nelem, npt_slabs,
+	    flags), flags, mflags, -1);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	a = map;
+	uslab_init(a, size_class, nelem, npt_slabs, npt_slabs, flags, true);
+	a->backing = USLAB_BACKING_ANONYMOUS;
+
+	return a;
+}
+
+struct uslab *
+uslab_create_anonymous(void *base, size_t size_class, uint64_t nelem,
+    uint64_t npt_slabs)
+{
+
+	return uslab_create_anonymous_flags(base, size_class, nelem, npt_slabs,
+	    0);
+}
+
+/*
+ * Growable slabs reserve address space for max_nelem objects up front, with
+ * PROT_NONE and MAP_NORESERVE so that none of it is committed, and make the
+ * header and the first npt_slabs regions accessible. Further regions of the
+ * same size are committed as allocations run out, so every object stays
+ * where it is and the owning region of a pointer is found as before.
+ */
+struct uslab *
+uslab_create_growable(void *base, size_t size_class, uint64_t nelem,
+    uint64_t npt_slabs, uint64_t max_nelem, unsigned int flags)
+{
+	int mflags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
+	uint64_t pt_max;
+	size_t pt_size, pt_stride, hdr_len, len;
+	uintptr_t q;
+	struct uslab *a;
+	void *map;
+
+	size_class = uslab_stride(size_class, flags);
+	if (uslab_valid(size_class, nelem, npt_slabs, flags) == false) {
+		return NULL;
+	}
+
+	/* Per-CPU slabs have a region per CPU, and no more. */
+	if ((flags & (USLAB_HUGE_FLAGS | USLAB_PERCPU)) != 0 ||
+	    max_nelem < nelem) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pt_size = uslab_pt_size(size_class, nelem, npt_slabs);
+	pt_stride = uslab_pt_stride(size_class, nelem, npt_slabs, flags);
+	pt_max = (size_class * max_nelem) / pt_size;
+	hdr_len = uslab_hdr_len(pt_max, flags);
+	len = hdr_len + uslab_debug_end(size_class, pt_size, pt_stride, pt_max,
+	    flags);
+
+	if (base != NULL) {
+		mflags |= MAP_FIXED;
+	}
+
+	map = mmap(base, len, PROT_NONE, mflags, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (mprotect(map, hdr_len + npt_slabs * pt_stride,
+	    PROT_READ | PROT_WRITE) == -1) {
+		munmap(map, len);
+		return NULL;
+	}
+
+	/*
+	 * The queue and bitmap, if any, have room for every region from the
+	 * start.
+	 */
+	q = USLAB_ALIGN_DOWN((char *)map + hdr_len + pt_max * pt_stride,
+	    PAGE_SIZE);
+	if ((flags & (USLAB_QUEUE_FLAGS | USLAB_DEBUG)) && mprotect((void *)q,
+	    (uintptr_t)map + len - q, PROT_READ | PROT_WRITE) == -1) {
+		munmap(map, len);
+		return NULL;
+	}
+
+	a = map;
+	uslab_init(a, size_class, nelem, npt_slabs, pt_max, flags, true);
+	a->backing = USLAB_BACKING_ANONYMOUS;
+
+	return a;
+}
+
+static void
+uslab_close_fd(int fd)
+{
+	int r;
+
+	do {
+		r = close(fd);
+	} while (r == -1 && errno == EINTR);
+}
+
+/*
+ * Recovery for persistent slabs. A process may die anywhere, so when we
+ * reopen a ramdisk slab we can't trust its freelists or usage counts. Pushes
+ * and pops publish with a single CAS, so a crash alone leaves every list
+ * well-formed, but used may be off by whatever the process was in the middle
+ * of, and stray writes through dangling pointers can corrupt links outright.
+ * Objects the dead process held, had cached in a magazine, or was halfway
+ * through freeing stay allocated.
+ *
+ * We walk every list of every region, checking that each object lies inside
+ * the region and on an object boundary, that the list doesn't loop, and that
+ * the region's lists don't hold more objects than it has. Objects whose link
+ * lies in a hole of the backing file read as zero and so
+ * link to the next object; we step over whole holes at once rather than
+ * faulting them in. used is then rebuilt from what we found.
+ *
+ * A corrupt list fails the open with EUCLEAN, unless the caller asked for
+ * USLAB_REPAIR, in which case we end the list just before the bad link. The
+ * objects past that point are lost to the slab, but every object left on the
+ * list is known to be free.
+ *
+ * Regions are independent, so we scan them with a thread per CPU.
+ */
+#define	USLAB_RECOVER_THREADS	64
+
+struct uslab_hole {
+	off_t	lo;
+	off_t	hi;
+};
+
+struct uslab_recovery {
+	struct uslab		*a;
+	struct uslab_hole	*holes;
+	size_t			nholes;
+	bool			repair;
+	uint64_t		next;
+	int			error;
+};
+
+/*
+ * Find the holes in the first len bytes of fd. Hole skipping only saves
+ * time and memory, so if anything goes wrong we just find fewer holes.
+ */
+static void
+uslab_recover_holes(struct uslab_recovery *rc, int fd, off_t len)
+{
+	struct uslab_hole *h;
+	size_t cap;
+	off_t lo, hi;
+
+	cap = 0;
+	for (hi = 0; hi < len; ) {
+		lo = lseek(fd, hi, SEEK_HOLE);
+		if (lo == -1 || lo >= len) {
+			break;
+		}
+
+		hi = lseek(fd, lo, SEEK_DATA);
+		if (hi == -1) {
+			hi = len;
+		}
+
+		if (rc->nholes == cap) {
+			cap = (cap == 0) ? 64 : cap * 2;
+			h = realloc(rc->holes, cap * sizeof (*h));
+			if (h == NULL) {
+				break;
+			}
+			rc->holes = h;
+		}
+
+		rc->holes[rc->nholes].lo = lo;
+		rc->holes[rc->nholes].hi = hi;
+		rc->nholes++;
+	}
+}
+
+/* The end of the hole holding file offset off, or 0 if it's not in one. */
+static off_t
+uslab_recover_hole_end(struct uslab_recovery *rc, off_t off)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = rc->nholes;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rc->holes[mid].hi <= off) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo < rc->nholes && rc->holes[lo].lo <= off) {
+		return rc->holes[lo].hi;
+	}
+
+	return 0;
+}
+
+/*
+ * Take one step along a list from cur, counting the objects we pass in *n.
+ * Returns where we land, and leaves *last at the object whose link took us
+ * there. Objects whose link lies in a hole link to the next object, so we
+ * step over whole holes at once.
+ */
+static char *
+uslab_recover_step(struct uslab_recovery *rc, struct uslab_pt *slab,
+    char *cur, char **last, uint64_t *n)
+{
+	struct uslab *a = rc->a;
+	char *next, *end;
+	off_t off, he;
+	uint64_t k;
+
+	end = slab->base + slab->size;
+	off = (char *)uslab_link(a, uslab_addr(a, cur)) - (char *)a;
+	he = uslab_recover_hole_end(rc, off);
+	if (he >= off + (off_t)sizeof (struct uslab_entry)) {
+		k = (he - off - sizeof (struct uslab_entry)) / a->size_class + 1;
+		k = MIN(k, (uint64_t)(end - cur) / a->size_class);
+		*n += k;
+		*last = cur + (k - 1) * a->size_class;
+		return *last + a->size_class;
+	}
+
+	*n += 1;
+	*last = cur;
+	next = uslab_link(a, uslab_addr(a, cur))->next_free;
+
+	return (next == NULL) ? cur + a->size_class : next;
+}
+
+/*
+ * Walk the list from first and return how many objects are on it. If the
+ * list is corrupt, we set *bad and leave *last at the object holding the bad
+ * link, or NULL if first itself is bad.
+ *
+ * Cycles are caught with Brent's algorithm, which needs no memory however
+ * large the region, run over the objects we land on; where we land next
+ * depends only on where we are. Once we know the length of the cycle, we find
+ * where it starts, so that cutting it keeps as much of the list as possible.
+ * The count may include trips around the cycle, so callers must walk the
+ * list again after cutting it.
+ */
+static uint64_t
+uslab_recover_list(struct uslab_recovery *rc, struct uslab_pt *slab,
+    char *first, char **last, bool *bad)
+{
+	struct uslab *a = rc->a;
+	char *cur, *end, *tortoise, *hare;
+	uint64_t n, lam, power, i, ignored;
+
+	end = slab->base + slab->size;
+	tortoise = NULL;
+	lam = power = 1;
+	*last = NULL;
+	*bad = false;
+	n = 0;
+
+	for (cur = first; cur != end; ) {
+		if (cur < slab->base || cur > end ||
+		    (cur - slab->base) % a->size_class != 0 ||
+		    n >= slab->size / a->size_class) {
+			*bad = true;
+			return n;
+		}
+
+		if (cur == tortoise) {
+			break;
+		}
+
+		if (lam == power) {
+			tortoise = cur;
+			power *= 2;
+			lam = 0;
+		}
+		lam++;
+
+		cur = uslab_recover_step(rc, slab, cur, last, &n);
+	}
+
+	if (cur == end) {
+		return n;
+	}
+
+	/*
+	 * A cycle of lam steps. Start one pointer lam steps ahead of the
+	 * other; they meet where the cycle starts, and the leading pointer's
+	 * last step took the link that closes it.
+	 */
+	*bad = true;
+	hare = first;
+	for (i = 0; i < lam; i++) {
+		hare = uslab_recover_step(rc, slab, hare, last, &ignored);
+	}
+
+	for (tortoise = first; tortoise != hare; ) {
+		tortoise = uslab_recover_step(rc, slab, tortoise, &cur,
+		    &ignored);
+		hare = uslab_recover_step(rc, slab, hare, last, &ignored);
+	}
+
+	return n;
+}
+
+/* The first object on a region's local or remote list. */
+static char *
+uslab_recover_first(struct uslab *a, struct uslab_pt *slab, bool remote)
+{
+	uint64_t off;
+
+	if (remote == true) {
+		return slab->remote;
+	}
+
+	if (a->flags & USLAB_TAGGED) {
+		off = slab->head & a->tag_mask;
+		return (off <= slab->size) ? slab->base + off : NULL;
+	}
+
+	return slab->first_free;
+}
+
+/*
+ * Count the objects on a region's local or remote list, cutting the list
+ * short if it's corrupt and we may repair it.
+ */
+static int
+uslab_recover_count(struct uslab_recovery *rc, struct uslab_pt *slab,
+    bool remote, uint64_t *n)
+{
+	struct uslab *a = rc->a;
+	char *last, *end;
+	bool bad;
+
+	end = slab->base + slab->size;
+	for (;;) {
+		*n = uslab_recover_list(rc, slab,
+		    uslab_recover_first(a, slab, remote), &last, &bad);
+		if (bad == false) {
+			return 0;
+		}
+
+		if (rc->repair == false) {
+			return EUCLEAN;
+		}
+
+		if (last != NULL) {
+			uslab_link(a, uslab_addr(a, last))->next_free =
+			    end;
+		} else if (remote == true) {
+			slab->remote = end;
+		} else if (a->flags & USLAB_TAGGED) {
+			slab->head = ((slab->head & ~a->tag_mask) +
+			    (1ULL << a->tag_shift)) | slab->size;
+		} else {
+			slab->first_free = end;
+		}
+	}
+}
+
+/* Move a region's remote list, which must be sound, onto its local one. */
+static void
+uslab_recover_splice(struct uslab *a, struct uslab_pt *slab)
+{
+	struct uslab_entry *e;
+	char *end;
+
+	end = slab->base + slab->size;
+	for (e = uslab_link(a, uslab_addr(a, slab->remote));
+	    e->next_free != end; e = uslab_link(a, uslab_addr(a, e->next_free)))
+		;
+
+	e->next_free = slab->first_free;
+	slab->first_free = slab->remote;
+	slab->remote = end;
+}
+
+/*
+ * Rebuild a USLAB_DEBUG region's part of the map from its lists, which
+ * must be sound: everything is allocated but what's on them.
+ */
+static void
+uslab_recover_debug(struct uslab_recovery *rc, struct uslab_pt *slab)
+{
+	struct uslab *a = rc->a;
+	char *cur, *next, *last, *end;
+	uint64_t n;
+	bool remote;
+
+	end = slab->base + slab->size;
+	uslab_debug_mark(a, uslab_index(a, slab->base),
+	    slab->size / a->size_class, true);
+	for (remote = false; ; remote = true) {
+		for (cur = uslab_recover_first(a, slab, remote); cur != end;
+		    cur = next) {
+			n = 0;
+			next = uslab_recover_step(rc, slab, cur, &last, &n);
+			uslab_debug_mark(a, uslab_index(a, cur), n, false);
+		}
+
+		if (remote == true) {
+			break;
+		}
+	}
+}
+
+static int
+uslab_recover_pt(struct uslab_recovery *rc, struct uslab_pt *slab)
+{
+	struct uslab *a = rc->a;
+	uint64_t n, m;
+	int e;
+
+	if ((e = uslab_recover_count(rc, slab, false, &n)) != 0 ||
+	    (e = uslab_recover_count(rc, slab, true, &m)) != 0) {
+		return e;
+	}
+
+	/* Both lists are sound, but share objects. */
+	if (n + m > slab->size / a->size_class) {
+		if (rc->repair == false) {
+			return EUCLEAN;
+		}
+
+		slab->remote = slab->base + slab->size;
+		m = 0;
+	}
+
+	/* USLAB_REMOTE slabs account for remote frees when they adopt them. */
+	if (a->flags & USLAB_REMOTE) {
+		m = 0;
+	}
+
+	if (a->flags & USLAB_DEBUG) {
+		uslab_recover_debug(rc, slab);
+	}
+
+	/*
+	 * Only rseq drains the remote lists of per-CPU slabs. If we're not
+	 * going to use it, move them to the local lists.
+	 */
+	if ((a->flags & (USLAB_PERCPU | USLAB_TAGGED)) == USLAB_PERCPU &&
+	    a->percpu_rseq == 0 && m > 0) {
+		uslab_recover_splice(a, slab);
+	}
+
+	slab->used = slab->size - (n + m) * a->size_class;
+	slab->remote_used = 0;
+	slab->hwm = MAX(slab->hwm, slab->used);
+	return 0;
+}
+
+static void *
+uslab_recover_td(void *arg)
+{
+	struct uslab_recovery *rc = arg;
+	struct uslab *a = rc->a;
+	uint64_t i;
+	int e;
+
+	while (ck_pr_load_int(&rc->error) == 0 &&
+	    (i = ck_pr_faa_64(&rc->next, 1)) < a->pt_slabs) {
+		e = uslab_recover_pt(rc, &uslab_pts(a)[i]);
+		if (e != 0) {
+			ck_pr_cas_int(&rc->error, 0, e);
+		}
+	}
+
+	return NULL;
+}
+
+/* Whether x, as stored, is an object of a. */
+static bool
+uslab_recover_obj(struct uslab *a, char *x)
+{
+
+	return uslab_index(a, x) != UINT64_MAX;
+}
+
+/*
+ * Bring the queue of a reopened slab back to a state that producers and
+ * consumers could have left it in. An MPMC producer that died between
+ * claiming a slot and publishing its object would otherwise stall consumers
+ * there for good, and a consumer that died between claiming a slot and
+ * handing it back would stall producers a lap later. Consumers clear the
+ * slots they take, so an object in a claimed slot was enqueued, published
+ * or not, and we keep it. Objects a dead consumer had claimed stay
+ * allocated, like anything else a dead process held.
+ *
+ * The queued objects are packed from head on, and every other slot is made
+ * free for its next position. Objects outside the slab, and an impossible
+ * head and tail, are corruption.
+ */
+static int
+uslab_recover_queue(struct uslab *a, bool repair)
+{
+	struct uslab_queue_slot *slots;
+	struct uslab_queue *q;
+	uint64_t h, t, k, pos, cap;
+	char **spsc, *obj;
+
+	if ((a->flags & USLAB_QUEUE_FLAGS) == 0) {
+		return 0;
+	}
+
+	q = (struct uslab_queue *)uslab_addr(a, a->queue);
+	slots = (struct uslab_queue_slot *)(q + 1);
+	spsc = (char **)(q + 1);
+	cap = a->queue_mask + 1;
+	h = q->head;
+	t = q->tail;
+	if (t - h > cap) {
+		if (repair == false) {
+			return EUCLEAN;
+		}
+
+		t = h;
+	}
+
+	for (k = 0, pos = h; pos != t; pos++) {
+		if (a->flags & USLAB_QUEUE) {
+			obj = slots[pos & a->queue_mask].obj;
+			if (obj == NULL) {
+				continue;
+			}
+		} else {
+			obj = spsc[pos & a->queue_mask];
+		}
+
+		if (uslab_recover_obj(a, obj) == false) {
+			if (repair == false) {
+				return EUCLEAN;
+			}
+			continue;
+		}
+
+		if (a->flags & USLAB_QUEUE) {
+			slots[(h + k) & a->queue_mask].obj = obj;
+		} else {
+			spsc[(h + k) & a->queue_mask] = obj;
+		}
+		k++;
+	}
+
+	if (a->flags & USLAB_QUEUE) {
+		for (pos = h; pos != h + cap; pos++) {
+			if (pos - h >= k) {
+				slots[pos & a->queue_mask].obj = NULL;
+			}
+			slots[pos & a->queue_mask].seq =
+			    pos + (pos - h < k) - (pos & a->queue_mask);
+		}
+	}
+
+	q->tail = q->seen_tail = h + k;
+	q->seen_head = h;
+	return 0;
+}
+
+/*
+ * Validate and repair every region of a reopened slab. Returns 0, or an
+ * errno value if the slab can't be used. Nothing else may be using the slab
+ * while we run.
+ */
+static int
+uslab_recover(struct uslab *a, int fd, off_t len, bool repair)
+{
+	pthread_t td[USLAB_RECOVER_THREADS];
+	struct uslab_recovery rc;
+	uint64_t i, n;
+
+	memset(&rc, 0, sizeof (rc));
+	rc.a = a;
+	rc.repair = repair;
+	uslab_recover_holes(&rc, fd, len);
+
+	n = MIN(MIN(uslab_ncpus(), a->pt_slabs), USLAB_RECOVER_THREADS);
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&td[i], NULL, uslab_recover_td, &rc) != 0) {
+			break;
+		}
+	}
+
+	uslab_recover_td(&rc);
+	while (--i > 0) {
+		pthread_join(td[i], NULL);
+	}
+
+	free(rc.holes);
+	if (rc.error != 0) {
+		return rc.error;
+	}
+
+	return uslab_recover_queue(a, repair);
+}
+
+/*
+ * Check that a slab we're reopening was created with the same parameters,
+ * and, unless it's relocatable, is mapped where it was created; its links
+ * are absolute addresses.
+ */
+static bool
+uslab_compatible(struct uslab *a, size_t size_class, uint64_t nelem,
+    uint64_t npt_slabs, unsigned int flags, off_t len)
+{
+
+	flags |= USLAB_FORCED_FLAGS;
+
+	return a->magic == USLAB_MAGIC &&
+	    len == (off_t)uslab_map_len(size_class, nelem, npt_slabs, flags) &&
+	    a->size_class == size_class && a->pt_slabs == npt_slabs &&
+	    a->pt_size == uslab_pt_size(size_class, nelem, npt_slabs) &&
+	    ((a->flags ^ flags) & USLAB_LAYOUT_FLAGS) == 0 &&
+	    uslab_addr(a, a->slab0_base) ==
+	    (char *)a + uslab_hdr_len(npt_slabs, flags);
+}
+
+struct uslab *
+uslab_create_ramdisk_flags(const char *path, void *base, size_t size_class,
+    uint64_t nelem, uint64_t npt_slabs, unsigned int flags)
+{
+	int fd, r, e, mflags = MAP_SHARED;
+	struct uslab *a;
+	struct stat sb;
+	bool opened;
+	size_t len;
+	void *map;
+
+	size_class = uslab_stride(size_class, flags);
+	if (uslab_valid(size_class, nelem, npt_slabs, flags) == false) {
+		return NULL;
+	}
+
+	opened = false;
+	r = stat(path, &sb);
+	if (r == -1 && errno == ENOENT) {
+		const char z = 0;
+		ssize_t s;
+		off_t o;
+
+		if ((fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
+			return NULL;
+		}
+
+		len = uslab_map_len(size_class, nelem, npt_slabs, flags);
+		if (flags & (USLAB_HUGE_2MB | USLAB_HUGE_1GB)) {
+			/* Files on hugetlbfs can't be written(2) to. */
+			if (ftruncate(fd, len) == -1) {
+				e = errno;
+				uslab_close_fd(fd);
+				errno = e;
+				return NULL;
+			}
+		} else {
+			o = lseek(fd, len - 1, SEEK_SET);
+			if (o == -1) {
+				e = errno;
+				uslab_close_fd(fd);
+				errno = e;
+				return NULL;
+			}
+
+			do {
+				s = write(fd, &z, 1);
+			} while (s == -1 && errno == EINTR);
+
+			if (s == -1) {
+				e = errno;
+				uslab_close_fd(fd);
+				errno = e;
+				return NULL;
+			}
+
+			o = lseek(fd, 0, SEEK_SET);
+			if (o == -1) {
+				e = errno;
+				uslab_close_fd(fd);
+				errno = e;
+				return NULL;
+			}
+		}
+
+		sb.st_size = len;
+	} else {
+		if ((fd = open(path, O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
+			return NULL;
+		}
+
+		opened = true;
+	}
+
+	map = uslab_map(base, sb.st_size, flags, mflags, fd);
+	if (map == MAP_FAILED) {
+		e = errno;
+		uslab_close_fd(fd);
+		errno = e;
+		return NULL;
+	}
+
+	a = map;
+	if (opened == true && uslab_compatible(a, size_class, nelem, npt_slabs,
+	    flags, sb.st_size) == false) {
+		e = EINVAL;
+		goto fail;
+	}
+
+	uslab_init(a, size_class, nelem, npt_slabs, npt_slabs, flags,
+	    !opened);
+	a->backing = USLAB_BACKING_RAMDISK;
+
+	if (opened == true && (e = uslab_recover(a, fd, sb.st_size,
+	    (flags & USLAB_REPAIR) != 0)) != 0) {
+		goto fail;
+	}
+
+	uslab_close_fd(fd);
+	return a;
+
+fail:
+	munmap(map, sb.st_size);
+	uslab_close_fd(fd);
+	errno = e;
+	return NULL;
+}
+
+struct uslab *
+uslab_create_ramdisk(const char *path, void *base, size_t size_class,
+    uint64_t nelem, uint64_t npt_slabs)
+{
+
+	return uslab_create_ramdisk_flags(path, base, size_class, nelem,
+	    npt_slabs, 0);
+}
+
+/*
+ * Shared slabs. Each region records the process that claimed it, so that
+ * uslab_shared_recover can tell which regions belong to processes that have
+ * exited. Pids get reused, so an owner is the pid together with the start
+ * time of the process, packed into one word that can be claimed with a CAS.
+ * Linux pids fit in 22 bits.
+ */
+#define	USLAB_OWNER_PID_BITS	22
+
+static uint64_t uslab_self;
+static pthread_once_t uslab_atfork_once = PTHREAD_ONCE_INIT;
+
+/* The start time of a process in clock ticks since boot, or 0 if unknown. */
+static uint64_t
+uslab_proc_start(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long start;
+	ssize_t n;
+	int fd, i;
+
+	snprintf(path, sizeof (path), "/proc/%d/stat", (int)pid);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return 0;
+	}
+
+	do {
+		n = read(fd, buf, sizeof (buf) - 1);
+	} while (n == -1 && errno == EINTR);
+	uslab_close_fd(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+
+	/*
+	 * The command name in field 2 may hold spaces and parentheses, so we
+	 * count fields from the last ')'. The start time is field 22.
+	 */
+	p = strrchr(buf, ')');
+	for (i = 0; i < 20 && p != NULL; i++) {
+		p = strchr(p + 1, ' ');
+	}
+
+	if (p == NULL || sscanf(p + 1, "%llu", &start) != 1) {
+		return 0;
+	}
+
+	return start;
+}
+
+/*
+ * A forked child is a new owner, and must not keep using the region its
+ * parent's thread picked, nor write into its parent's trace.
+ */
+static void
+uslab_atfork_child(void)
+{
+
+	uslab_self = 0;
+	uslab_pt = NULL;
+	uslab_trace_cur = NULL;
+	(void)pthread_mutex_init(&uslab_trace_lock, NULL);
+}
+
+static void
+uslab_atfork_register(void)
+{
+
+	(void)pthread_atfork(NULL, NULL, uslab_atfork_child);
+}
+
+static uint64_t
+uslab_owner_self(void)
+{
+	uint64_t self;
+	pid_t pid;
+
+	self = ck_pr_load_64(&uslab_self);
+	if (self == 0) {
+		pid = getpid();
+		self = (uslab_proc_start(pid) << USLAB_OWNER_PID_BITS) | pid;
+		ck_pr_store_64(&uslab_self, self);
+	}
+
+	return self;
+}
+
+/*
+ * Whether the process that claimed a region is still running. Without /proc
+ * we can only ask whether its pid is in use.
+ */
+static bool
+uslab_owner_alive(uint64_t owner)
+{
+	uint64_t start, now;
+	pid_t pid;
+
+	pid = owner & ((1ULL << USLAB_OWNER_PID_BITS) - 1);
+	start = owner >> USLAB_OWNER_PID_BITS;
+
+	now = uslab_proc_start(pid);
+	if (start == 0 || now == 0) {
+		return kill(pid, 0) == 0 || errno == EPERM;
+	}
+
+	return now == start;
+}
+
+/*
+ * Pick a region for a thread of this process. We claim a region nobody owns
+ * if there is one, so that threads spread out as they do in private slabs,
+ * and otherwise share one of our own. If other processes own every region,
+ * we share one of theirs; ownership only decides what recovery may take
+ * back.
+ */
+static uint64_t
+uslab_shared_pick(struct uslab *a)
+{
+	struct uslab_pt *pts;
+	uint64_t self, k, i, idx;
+
+	pts = uslab_pts(a);
+	self = uslab_owner_self();
+	k = ck_pr_faa_64(&a->pt_ctr, 1);
+	for (i = 0; i < a->pt_slabs; i++) {
+		idx = (k + i) % a->pt_slabs;
+		if (ck_pr_load_64(&pts[idx].owner) == 0 &&
+		    ck_pr_cas_64(&pts[idx].owner, 0, self) == true) {
+			return idx;
+		}
+	}
+
+	for (i = 0; i < a->pt_slabs; i++) {
+		idx = (k + i) % a->pt_slabs;
+		if (ck_pr_load_64(&pts[idx].owner) == self) {
+			return idx;
+		}
+	}
+
+	return k % a->pt_slabs;
+}
+
+/*
+ * Shared slabs live in a memfd, or in a POSIX shared memory object if name is
+ * given, and are always relocatable, since every process maps them wherever
+ * it likes. The descriptor is returned in *fd for the caller to hand to other
+ * processes, by fork(2) or over a Unix socket, which attach to it with
+ * uslab_attach_shared. The caller may close it once everyone has attached,
+ * and must shm_unlink(3) a named object when it's done with it.
+ */
+struct uslab *
+uslab_create_shared(const char *name, size_t size_class, uint64_t nelem,
+    uint64_t npt_slabs, unsigned int flags, int *fd)
+{
+	unsigned int mfd_flags;
+	struct uslab *a;
+	size_t len;
+	void *map;
+	int e;
+
+	flags |= USLAB_RELOCATABLE;
+	size_class = uslab_stride(size_class, flags);
+	if (uslab_valid(size_class, nelem, npt_slabs, flags) == false) {
+		return NULL;
+	}
+
+	len = uslab_map_len(size_class, nelem, npt_slabs, flags);
+	if (name != NULL) {
+		/* POSIX shared memory lives on tmpfs, never hugetlbfs. */
+		if (flags & (USLAB_HUGE_2MB | USLAB_HUGE_1GB)) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		*fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR,
+		    S_IRUSR | S_IWUSR);
+	} else {
+		/* memfd_create(2) encodes the page size like mmap(2) does. */
+		mfd_flags = 0;
+		if (flags & (USLAB_HUGE_2MB | USLAB_HUGE_1GB)) {
+			mfd_flags = MFD_HUGETLB |
+			    (__builtin_ctzll(uslab_page_size(flags)) <<
+			    MAP_HUGE_SHIFT);
+		}
+
+		*fd = memfd_create("uslab", mfd_flags);
+	}
+
+	if (*fd == -1) {
+		return NULL;
+	}
+
+	if (ftruncate(*fd, len) == -1) {
+		e = errno;
+		goto fail;
+	}
+
+	map = uslab_map(NULL, len, flags, MAP_SHARED, *fd);
+	if (map == MAP_FAILED) {
+		e = errno;
+		goto fail;
+	}
+
+	a = map;
+	uslab_init(a, size_class, nelem, npt_slabs, npt_slabs, flags, true);
+	a->backing = USLAB_BACKING_SHARED;
+	(void)pthread_once(&uslab_atfork_once, uslab_atfork_register);
+
+	return a;
+
+fail:
+	if (name != NULL) {
+		(void)shm_unlink(name);
+	}
+	uslab_close_fd(*fd);
+	*fd = -1;
+	errno = e;
+	return NULL;
+}
+
+/*
+ * Map a shared slab created by uslab_create_shared, taking its parameters
+ * from its header. Fails with EINVAL if fd doesn't hold one.
+ */
+struct uslab *
+uslab_attach_shared(int fd)
+{
+	struct uslab hdr;
+	struct stat sb;
+	size_t hdr_len;
+	ssize_t n;
+	void *map;
+
+	if (fstat(fd, &sb) == -1) {
+		return NULL;
+	}
+
+	do {
+		n = pread(fd, &hdr, sizeof (hdr), 0);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1) {
+		return NULL;
+	}
+
+	hdr_len = (n == sizeof (hdr)) ?
+	    uslab_hdr_len(hdr.pt_slabs, hdr.flags) : 0;
+	if (n != sizeof (hdr) || hdr.magic != USLAB_MAGIC ||
+	    hdr.backing != USLAB_BACKING_SHARED ||
+	    (hdr.flags & USLAB_RELOCATABLE) == 0 ||
+	    (uintptr_t)hdr.slab0_base != hdr_len ||
+	    sb.st_size != (off_t)(hdr_len + hdr.slab_len)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = uslab_map(NULL, sb.st_size, hdr.flags, MAP_SHARED, fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	(void)pthread_once(&uslab_atfork_once, uslab_atfork_register);
+	return map;
+}
+
+static uint64_t
+uslab_trace_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+uslab_trace_ticks(void)
+{
+
+#ifdef __x86_64__
+	return __builtin_ia32_rdtsc();
+#else
+	return uslab_trace_ns();
+#endif
+}
+
+/*
+ * Append len bytes to the trace file. The first error sticks, and is what
+ * uslab_trace_stop reports. Called locked.
+ */
+static void
+uslab_trace_put(struct uslab_trace *tr, const void *buf, size_t len)
+{
+	const char *p;
+	ssize_t w;
+
+	p = buf;
+	while (len > 0 && tr->error == 0) {
+		w = pwrite(tr->fd, p, len, tr->off);
+		if (w == -1 && errno == EINTR) {
+			continue;
+		}
+		if (w <= 0) {
+			tr->error = (w == -1) ? errno : EIO;
+			break;
+		}
+		p += w;
+		len -= w;
+		tr->off += w;
+	}
+}
+
+/*
+ * Write out whatever a ring holds that hasn't been. The owner may be
+ * appending as we do this: it fills in a record before it publishes the
+ * count. Called locked.
+ */
+static void
+uslab_trace_write(struct uslab_trace *tr, struct uslab_trace_ring *r)
+{
+	uint64_t n;
+
+	n = ck_pr_load_64(&r->n);
+	ck_pr_fence_load();
+	uslab_trace_put(tr, &r->recs[r->written],
+	    (n - r->written) * sizeof (r->recs[0]));
+	tr->hdr.nrecs += n - r->written;
+	r->written = n;
+}
+
+static void
+uslab_trace_exit(void *arg)
+{
+	struct uslab_trace_ring *r;
+	struct uslab_trace *tr;
+
+	r = arg;
+	(void)pthread_mutex_lock(&uslab_trace_lock);
+	tr = uslab_trace_cur;
+	if (tr != NULL && r->session == tr->session) {
+		uslab_trace_write(tr, r);
+	}
+	if (r->prev != NULL) {
+		r->prev->next = r->next;
+	} else {
+		uslab_trace_rings = r->next;
+	}
+	if (r->next != NULL) {
+		r->next->prev = r->prev;
+	}
+	(void)pthread_mutex_unlock(&uslab_trace_lock);
+
+	uslab_trace_ring = NULL;
+	free(r);
+}
+
+static void
+uslab_trace_init(void)
+{
+
+	(void)pthread_key_create(&uslab_trace_key, uslab_trace_exit);
+}
+
+/*
+ * Make room in the calling thread's ring: tie it to the trace if it isn't
+ * yet, or write it out if it's full. Returns NULL if the trace has been
+ * stopped since the caller looked, or we're out of memory, in which case
+ * the record is dropped.
+ */
+static struct uslab_trace_ring * __attribute__((noinline))
+uslab_trace_room(struct uslab_trace *tr)
+{
+	struct uslab_trace_ring *r;
+
+	(void)pthread_mutex_lock(&uslab_trace_lock);
+	r = uslab_trace_ring;
+	if (uslab_trace_cur != tr) {
+		r = NULL;
+	} else if (r != NULL && r->session == tr->session) {
+		uslab_trace_write(tr, r);
+		ck_pr_store_64(&r->n, 0);
+		r->written = 0;
+	} else {
+		if (r == NULL && (r = malloc(sizeof (*r))) != NULL) {
+			r->prev = NULL;
+			r->next = uslab_trace_rings;
+			if (r->next != NULL) {
+				r->next->prev = r;
+			}
+			uslab_trace_rings = r;
+			uslab_trace_ring = r;
+			(void)pthread_setspecific(uslab_trace_key, r);
+		}
+
+		if (r != NULL) {
+			r->session = tr->session;
+			r->tid = tr->hdr.nthreads++;
+			r->n = r->written = 0;
+		} else {
+			tr->hdr.dropped++;
+		}
+	}
+	(void)pthread_mutex_unlock(&uslab_trace_lock);
+
+	return r;
+}
+
+/*
+ * Record n calls of the same op into a slab, if it's being traced. Objects
+ * are numbered by region, then by position in the region.
+ */
+static inline void
+uslab_trace_record(struct uslab *a, unsigned int op, void *const *p,
+    uint64_t n)
+{
+	struct uslab_trace_ring *r;
+	struct uslab_trace *tr;
+	uint64_t i, j, index, ticks;
+
+	tr = ck_pr_load_ptr(&uslab_trace_cur);
+	if (tr == NULL || tr->slab != a || tr->serial != a->serial) {
+		return;
+	}
+
+	ticks = uslab_trace_ticks();
+	r = uslab_trace_ring;
+	for (i = 0; i < n; i++) {
+		if (r == NULL || r->n == USLAB_TRACE_RING ||
+		    r->session != ck_pr_load_64(&tr->session)) {
+			if ((r = uslab_trace_room(tr)) == NULL) {
+				return;
+			}
+		}
+
+		index = 0;
+		if (op != USLAB_TRACE_OOM) {
+			index = uslab_index(a, uslab_stored(a, p[i]));
+		}
+
+		j = r->n;
+		r->recs[j].ticks = ticks;
+		r->recs[j].word = USLAB_TRACE_WORD(op, r->tid, index);
+		ck_pr_fence_store();
+		ck_pr_store_64(&r->n, j + 1);
+	}
+}
+
+/*
+ * Start tracing calls into a slab to fd, which should be open for writing
+ * and is written from offset 0. Only one slab may be traced at a time.
+ */
+bool
+uslab_trace_start(struct uslab *a, int fd)
+{
+	struct uslab_trace *tr;
+	int error;
+
+	(void)pthread_once(&uslab_trace_once, uslab_trace_init);
+	(void)pthread_once(&uslab_atfork_once, uslab_atfork_register);
+
+	(void)pthread_mutex_lock(&uslab_trace_lock);
+	if (uslab_trace_cur != NULL) {
+		(void)pthread_mutex_unlock(&uslab_trace_lock);
+		errno = EBUSY;
+		return false;
+	}
+
+	tr = &uslab_tracer;
+	memset(&tr->hdr, 0, sizeof (tr->hdr));
+	tr->hdr.magic = USLAB_TRACE_MAGIC;
+	tr->hdr.size_class = a->size_class;
+	tr->hdr.nelem = a->pt_slabs * (a->pt_size / a->size_class);
+	tr->hdr.pt_slabs = a->pt_slabs;
+	tr->hdr.nobjs = a->pt_max * (a->pt_size / a->size_class);
+	tr->hdr.flags = a->flags;
+	tr->hdr.start_ticks = uslab_trace_ticks();
+	tr->hdr.start_ns = uslab_trace_ns();
+	tr->slab = a;
+	tr->serial = a->serial;
+	tr->fd = fd;
+	tr->error = 0;
+	tr->off = 0;
+	ck_pr_store_64(&tr->session, tr->session + 1);
+
+	/* The header is written again, complete, when we stop. */
+	uslab_trace_put(tr, &tr->hdr, sizeof (tr->hdr));
+	if ((error = tr->error) == 0) {
+		ck_pr_fence_store();
+		ck_pr_store_ptr(&uslab_trace_cur, tr);
+	}
+	(void)pthread_mutex_unlock(&uslab_trace_lock);
+
+	if (error != 0) {
+		errno = error;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Stop tracing a slab, write out every thread's records and finish the
+ * header. Calls that are under way as we stop may or may not be recorded.
+ * fd is left open.
+ */
+bool
+uslab_trace_stop(struct uslab *a)
+{
+	struct uslab_trace_ring *r;
+	struct uslab_trace *tr;
+	int error;
+
+	(void)pthread_mutex_lock(&uslab_trace_lock);
+	tr = uslab_trace_cur;
+	if (tr == NULL || tr->slab != a || tr->serial != a->serial) {
+		(void)pthread_mutex_unlock(&uslab_trace_lock);
+		errno = EINVAL;
+		return false;
+	}
+
+	ck_pr_store_ptr(&uslab_trace_cur, NULL);
+	for (r = uslab_trace_rings; r != NULL; r = r->next) {
+		if (r->session == tr->session) {
+			uslab_trace_write(tr, r);
+		}
+	}
+
+	tr->hdr.stop_ticks = uslab_trace_ticks();
+	tr->hdr.stop_ns = uslab_trace_ns();
+	tr->off = 0;
+	uslab_trace_put(tr, &tr->hdr, sizeof (tr->hdr));
+	error = tr->error;
+	(void)pthread_mutex_unlock(&uslab_trace_lock);
+
+	if (error != 0) {
+		errno = error;
+		return false;
+	}
+
+	return true;
+}
+
+/* Stop tracing a slab that's going away. */
+static void
+uslab_trace_release(struct uslab *a)
+{
+	struct uslab_trace *tr;
+
+	tr = ck_pr_load_ptr(&uslab_trace_cur);
+	if (tr != NULL && tr->slab == a && tr->serial == a->serial) {
+		(void)uslab_trace_stop(a);
+	}
+}
+
+/* Retire the statistics blocks of a slab that's going away. */
+static void
+uslab_tstats_release(struct uslab *a)
+{
+	struct uslab_tstats *ts;
+
+	for (ts = ck_pr_load_ptr(&uslab_tstats_all); ts != NULL;
+	    ts = ck_pr_load_ptr(&ts->next)) {
+		if (ck_pr_load_ptr(&ts->slab) == a &&
+		    ck_pr_load_64(&ts->serial) == a->serial) {
+			ck_pr_store_64(&ts->serial, 0);
+		}
+	}
+}
+
+void
+uslab_destroy_heap(struct uslab *a)
+{
+
+	uslab_tstats_release(a);
+	uslab_trace_release(a);
+	free(a);
+}
+
+void
+uslab_destroy_map(struct uslab *a)
+{
+	uint64_t self, i;
+
+	uslab_tstats_release(a);
+	uslab_trace_release(a);
+
+	/* Hand back the regions of a shared slab that we claimed. */
+	if (a->backing == USLAB_BACKING_SHARED) {
+		self = uslab_owner_self();
+		for (i = 0; i < a->pt_slabs; i++) {
+			(void)ck_pr_cas_64(&uslab_pts(a)[i].owner, self, 0);
+		}
+	}
+
+	munmap(a, (uslab_addr(a, a->slab0_base) - (char *)a) + a->slab_len);
+}
+
+static unsigned int
+uslab_node_get(void)
+{
+	unsigned int cpu, node;
+
+	if (uslab_node == -1) {
+		if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1) {
+			node = 0;
+		}
+		uslab_node = node;
+	}
+
+	return uslab_node;
+}
+
+/*
+ * Pick a region on the calling thread's node. Regions are assigned to nodes
+ * round-robin, so the regions on the node in slot s of numa_nodes are s,
+ * s + nnodes, s + 2 * nnodes, and so on. Threads on nodes the slab doesn't
+ * use, or on nodes with no regions, fall back to plain round-robin. When
+ * fresh is false, we're picking for a thread that already has an index from
+ * another slab and mustn't touch the counters.
+ */
+static uint64_t
+uslab_numa_pick(struct uslab *a, bool fresh, uint64_t k)
+{
+	unsigned int node, slot, nn;
+	uint64_t cnt;
+
+	node = uslab_node_get();
+	nn = a->numa_nnodes;
+	for (slot = 0; slot < nn && a->numa_nodes[slot] != node; slot++)
+		;
+
+	cnt = (slot < nn) ? (a->pt_slabs - slot + nn - 1) / nn : 0;
+	if (cnt == 0) {
+		if (fresh == true) {
+			k = ck_pr_faa_64(&a->pt_ctr, 1);
+		}
+		return k % a->pt_slabs;
+	}
+
+	if (fresh == true) {
+		k = ck_pr_faa_64(&a->numa_ctr[slot], 1);
+	}
+
+	return slot + (k % cnt) * nn;
+}
+
+/*
+ * Per-CPU slabs. Region i belongs to CPU i. When the kernel supports
+ * restartable sequences, a region's freelist is only ever touched by code
+ * running on its CPU, inside a critical section that the kernel restarts if
+ * the thread is preempted, migrated or signalled before the final store. The
+ * fast path then needs no atomic instructions at all. Objects freed from
+ * other CPUs are pushed onto the region's remote list with a CAS, and the
+ * owning CPU takes the whole list with a single CAS2 when its own runs dry.
+ *
+ * Without rseq, per-CPU slabs simply pick the region of the CPU we're
+ * running on for every operation and use the usual lock-free freelists.
+ */
+#ifdef USLAB_HAVE_RSEQ
+static inline struct rseq *
+uslab_rseq(void)
+{
+	char *tp;
+
+	__asm__ ("movq %%fs:0, %0" : "=r" (tp));
+	return (struct rseq *)(tp + __rseq_offset);
+}
+
+/*
+ * Whether the kernel runs our critical sections. glibc registers every
+ * thread or none, and leaves cpu_id negative when it doesn't, as does the
+ * kernel if a thread unregisters.
+ */
+static inline bool
+uslab_rseq_registered(void)
+{
+
+	return (int32_t)ck_pr_load_32(&uslab_rseq()->cpu_id) >= 0;
+}
+
+#define	USLAB_STR(x)		USLAB_STR_(x)
+#define	USLAB_STR_(x)		#x
+
+/*
+ * The critical section descriptor, the store that arms it, and the check
+ * that we're still running on the CPU the caller expects. The commit store
+ * must come last, immediately followed by USLAB_RSEQ_END. The abort handler
+ * must be preceded by the signature the kernel checks.
+ */
+#define	USLAB_RSEQ_BEGIN						\
+	".pushsection __rseq_cs, \"aw\"\n\t"				\
+	".balign 32\n"							\
+	"3:\n\t"							\
+	".long 0x0, 0x0\n\t"						\
+	".quad 1f, (2f - 1f), 4f\n\t"					\
+	".popsection\n\t"						\
+	"leaq 3b(%%rip), %%rax\n\t"					\
+	"movq %%rax, %c[cs](%[rs])\n"					\
+	"1:\n\t"							\
+	"cmpl %[cpu], %c[cpu_id](%[rs])\n\t"				\
+	"jnz %l[abort]\n\t"
+
+#define	USLAB_RSEQ_END							\
+	"2:\n\t"							\
+	".pushsection __rseq_failure, \"ax\"\n\t"			\
+	".byte 0x0f, 0xb9, 0x3d\n\t"					\
+	".long " USLAB_STR(RSEQ_SIG) "\n"				\
+	"4:\n\t"							\
+	"jmp %l[abort]\n\t"						\
+	".popsection\n\t"
+
+#define	USLAB_RSEQ_INPUTS						\
+	[rs] "r" (uslab_rseq()),					\
+	[cs] "i" (offsetof(struct rseq, rseq_cs)),			\
+	[cpu_id] "i" (offsetof(struct rseq, cpu_id)),			\
+	[cpu] "r" (cpu)
+
+/*
+ * Pop one object off the local freelist of the region belonging to cpu.
+ * Returns 1 and the object, as stored, in *obj, 0 if the list is empty, or
+ * -1 if the critical section was aborted or we aren't running on cpu.
+ */
+static inline int
+uslab_rseq_pop(struct uslab *a, struct uslab_pt *slab, unsigned int cpu,
+    void **obj)
+{
+
+	__asm__ __volatile__ goto (
+	    USLAB_RSEQ_BEGIN
+	    "movq (%[head]), %%rax\n\t"
+	    "cmpq %[end], %%rax\n\t"
+	    "jae %l[empty]\n\t"
+	    "movq (%%rax, %[link]), %%rcx\n\t"
+	    "leaq (%%rax, %[size]), %%rdx\n\t"
+	    "testq %%rcx, %%rcx\n\t"
+	    "cmovzq %%rdx, %%rcx\n\t"
+	    "movq %%rax, (%[obj])\n\t"
+	    "movq %%rcx, (%[head])\n\t"
+	    USLAB_RSEQ_END
+	    :
+	    : USLAB_RSEQ_INPUTS,
+	      [head] "r" (&slab->first_free),
+	      [end] "r" (slab->base + slab->size),
+	      [size] "r" (a->size_class),
+	      [link] "r" (uslab_bias(a) + a->link_offset),
+	      [obj] "r" (obj)
+	    : "rax", "rcx", "rdx", "memory", "cc"
+	    : empty, abort);
+
+	return 1;
+empty:
+	return 0;
+abort:
+	return -1;
+}
+
+/*
+ * Push a chain, already linked from first to last, onto the local freelist
+ * of the region belonging to cpu. first is as stored, and e is the link of
+ * last. Returns 0, or -1 if aborted.
+ */
+static inline int
+uslab_rseq_push(struct uslab_pt *slab, unsigned int cpu, void *first,
+    struct uslab_entry *e)
+{
+
+	__asm__ __volatile__ goto (
+	    USLAB_RSEQ_BEGIN
+	    "movq (%[head]), %%rax\n\t"
+	    "movq %%rax, (%[link])\n\t"
+	    "movq %[first], (%[head])\n\t"
+	    USLAB_RSEQ_END
+	    :
+	    : USLAB_RSEQ_INPUTS,
+	      [head] "r" (&slab->first_free),
+	      [first] "r" (first),
+	      [link] "r" (&e->next_free)
+	    : "rax", "memory", "cc"
+	    : abort);
+
+	return 0;
+abort:
+	return -1;
+}
+
+/*
+ * Install chain as the local freelist of the region belonging to cpu, if
+ * that list is empty. Returns 0, or -1 if the list wasn't empty or we were
+ * aborted.
+ */
+static inline int
+uslab_rseq_install(struct uslab_pt *slab, unsigned int cpu, char *chain)
+{
+
+	__asm__ __volatile__ goto (
+	    USLAB_RSEQ_BEGIN
+	    "movq (%[head]), %%rax\n\t"
+	    "cmpq %[end], %%rax\n\t"
+	    "jb %l[abort]\n\t"
+	    "movq %[chain], (%[head])\n\t"
+	    USLAB_RSEQ_END
+	    :
+	    : USLAB_RSEQ_INPUTS,
+	      [head] "r" (&slab->first_free),
+	      [end] "r" (slab->base + slab->size),
+	      [chain] "r" (chain)
+	    : "rax", "memory", "cc"
+	    : abort);
+
+	return 0;
+abort:
+	return -1;
+}
+
+/*
+ * Add delta to the usage count of the region belonging to cpu. Returns 0,
+ * or -1 if aborted.
+ */
+static inline int
+uslab_rseq_add(struct uslab_pt *slab, unsigned int cpu, int64_t delta)
+{
+
+	__asm__ __volatile__ goto (
+	    USLAB_RSEQ_BEGIN
+	    "addq %[delta], (%[used])\n\t"
+	    USLAB_RSEQ_END
+	    :
+	    : USLAB_RSEQ_INPUTS,
+	      [used] "r" (&slab->used),
+	      [delta] "r" (delta)
+	    : "rax", "memory", "cc"
+	    : abort);
+
+	return 0;
+abort:
+	return -1;
+}
+#endif
+
+/*
+ * The CPU we're running on. This may be stale by the time the caller uses
+ * it; the rseq fast path checks it again inside its critical section.
+ */
+static inline unsigned int
+uslab_cpu(void)
+{
+	int cpu;
+
+#ifdef USLAB_HAVE_RSEQ
+	if (__rseq_size > 0) {
+		return ck_pr_load_32(&uslab_rseq()->cpu_id_start);
+	}
+#endif
+
+	cpu = sched_getcpu();
+	return (cpu < 0) ? 0 : cpu;
+}
+
+static inline struct uslab_pt *
+uslab_pt_get(struct uslab *a)
+{
+	struct uslab_pt *pt, *pts;
+	unsigned int cpu;
+
+	pts = uslab_pts(a);
+	if (a->flags & USLAB_PERCPU) {
+		/* There's a region for every CPU, short of hotplugging. */
+		cpu = uslab_cpu();
+		return &pts[(cpu < a->pt_slabs) ? cpu : cpu % a->pt_slabs];
+	}
+
+	pt = uslab_pt;
+	if (pt == NULL) {
+		if (a->flags & USLAB_NUMA) {
+			uslab_pt_index = uslab_numa_pick(a, true, 0);
+		} else if (a->backing == USLAB_BACKING_SHARED) {
+			uslab_pt_index = uslab_shared_pick(a);
+		} else {
+			uslab_pt_index = ck_pr_faa_64(&a->pt_ctr, 1) %
+			    a->pt_slabs;
+		}
+		pt = uslab_pt = &pts[uslab_pt_index];
+	} else if (pt < pts || pt >= pts + a->pt_slabs) {
+		pt = &pts[(a->flags & USLAB_NUMA) ?
+		    uslab_numa_pick(a, false, uslab_pt_index) :
+		    uslab_pt_index % a->pt_slabs];
+		if (a->backing == USLAB_BACKING_SHARED &&
+		    ck_pr_load_64(&pt->owner) == 0) {
+			(void)ck_pr_cas_64(&pt->owner, 0, uslab_owner_self());
+		}
+	}
+
+	return pt;
+}
+
+/*
+ * Regions are tried in two passes when we need to steal: NUMA slabs look at
+ * regions on our own node in the first pass and remote regions in the
+ * second. Other slabs try everything in the first pass, and have no second.
+ */
+static inline unsigned int
+uslab_steal_pass(struct uslab *a, struct uslab_pt *oa, struct uslab_pt *slab)
+{
+
+	return ((a->flags & USLAB_NUMA) && slab->node != oa->node) ? 1 : 0;
+}
+
+static inline unsigned int
+uslab_steal_passes(struct uslab *a)
+{
+
+	return (a->flags & USLAB_NUMA) ? 2 : 1;
+}
+
+static inline struct uslab_pt *
+uslab_pt_of(struct uslab *a, void *p)
+{
+
+	return &uslab_pts(a)[uslab_div(&a->pt_div,
+	    uslab_stored(a, p) - a->slab0_base)];
+}
+
+static inline bool
+uslab_pt_empty(struct uslab *a, struct uslab_pt *slab)
+{
+
+	if (a->flags & USLAB_TAGGED) {
+		return (ck_pr_load_64(&slab->head) & a->tag_mask) >= slab->size;
+	}
+
+	return ck_pr_load_ptr(&slab->first_free) >= slab->base + slab->size;
+}
+
+/*
+ * The bitmap of regions that may have free objects lets allocators skip
+ * empty regions a word at a time, rather than loading every region header
+ * when the slab is nearly full, and tells them the slab is full after
+ * looking at one bit per region.
+ *
+ * A bit may be set for an empty region, but a region with free objects
+ * always has its bit set once the free that made it so returns. Frees set
+ * the bit after pushing. An allocator that finds a region empty clears the
+ * bit and then looks again, so if a free pushed in between without seeing
+ * the cleared bit, the allocator sees the object and sets the bit back. Each
+ * side's atomic operation is ordered before its load, so one of them always
+ * sees the other.
+ */
+static inline void
+uslab_avail_set(struct uslab *a, struct uslab_pt *slab)
+{
+	uint64_t *w, bit;
+
+	w = &uslab_avail(a)[slab->offset / 64];
+	bit = 1ULL << (slab->offset % 64);
+
+	ck_pr_fence_atomic_load();
+	if ((ck_pr_load_64(w) & bit) == 0) {
+		ck_pr_or_64(w, bit);
+	}
+}
+
+static void
+uslab_avail_clear(struct uslab *a, struct uslab_pt *slab)
+{
+	uint64_t *w, bit;
+
+	w = &uslab_avail(a)[slab->offset / 64];
+	bit = 1ULL << (slab->offset % 64);
+
+	ck_pr_and_64(w, ~bit);
+	ck_pr_fence_atomic_load();
+	if (uslab_pt_empty(a, slab) == false ||
+	    ck_pr_load_ptr(&slab->remote) < slab->base + slab->size) {
+		ck_pr_or_64(w, bit);
+	}
+}
+
+/*
+ * Steal loops visit regions start, start + 1, ..., wrapping around at npt,
+ * where start < npt. Returns the first step from i on that lands on a region
+ * with its bit set, or npt if there is none. Callers try their own region at
+ * step 0 without looking at the bitmap, which keeps it off the fast path.
+ */
+static uint64_t
+uslab_avail_next(struct uslab *a, uint64_t start, uint64_t npt, uint64_t i)
+{
+	uint64_t *map, idx, w, left;
+
+	map = uslab_avail(a);
+	while (i < npt) {
+		idx = start + i;
+		if (idx >= npt) {
+			idx -= npt;
+		}
+		left = MIN(64 - idx % 64, MIN(npt - idx, npt - i));
+		w = ck_pr_load_64(&map[idx / 64]) >> (idx % 64);
+		if (w != 0 && (uint64_t)__builtin_ctzll(w) < left) {
+			return i + __builtin_ctzll(w);
+		}
+		i += left;
+	}
+
+	return npt;
+}
+
+/*
+ * Account n objects just taken from a region. Slabs that keep statistics
+ * also raise its high-water mark; the add leaves us owning the line, and we
+ * only CAS when the mark actually rises, which is rare once a region has
+ * warmed up.
+ */
+static inline void
+uslab_charge(struct uslab *a, struct uslab_pt *slab, uint64_t n)
+{
+	size_t used, hwm;
+
+	if ((a->flags & USLAB_STATS) == 0) {
+		ck_pr_add_64(&slab->used, n * a->size_class);
+		return;
+	}
+
+	used = ck_pr_faa_64(&slab->used, n * a->size_class) +
+	    n * a->size_class;
+	hwm = ck_pr_load_64(&slab->hwm);
+	while (used > hwm &&
+	    ck_pr_cas_64_value(&slab->hwm, hwm, used, &hwm) == false)
+		;
+}
+
+/* Count a failed CAS, or n objects stolen, for slabs that keep statistics. */
+static inline void
+uslab_count_retry(struct uslab *a)
+{
+
+	if (a->flags & USLAB_STATS) {
+		uslab_retries++;
+	}
+}
+
+static inline void
+uslab_count_steals(struct uslab *a, uint64_t n)
+{
+
+	if (a->flags & USLAB_STATS) {
+		uslab_steals += n;
+	}
+}
+
+#ifdef CK_F_PR_CAS_PTR_2_VALUE
+/*
+ * A freelist head in the CAS2 format, as found at the start of struct
+ * uslab_pt and at its remote list. The list holds objects from base to end,
+ * as stored.
+ */
+struct uslab_head {
+	char	*first_free;
+	char	*generation;
+};
+
+/*
+ * When we begin, our slab is sparse and zeroed. Effectively, this means that
+ * we obtain our memory either with mmap(2) and MAP_ANONYMOUS, by using
+ * shm_open(3), ftruncate(2), and mmap(2), or the mmap(2)-backed file comes
+ * from a RAM-backed storage that initializes to 0 on access.
+ *
+ * Our approach is to find the first free block. We then figure out what the
+ * next free block will be. If the next free block is NULL, we know that the
+ * block immediately following the block we've chosen is the next logically
+ * free block. When this is the last block, this will put an address outside
+ * the bounds of the region into the first_free member. If we succeed, no
+ * other threads could win the bad value as first_free is ABA protected and
+ * checked to be within bounds.
+ *
+ * We are prone to ABA. If we read first_free, load the next_free from it, and
+ * are subsequently pre-empted, another concurrent process could allocate and
+ * then free our target. Additional allocations may have occurred which alter
+ * the target's next_free member by the time it was freed. In this case, we
+ * would end up in an inconsistent state. We solve this problem by doing a
+ * CAS2 on our slab to update both the free block and a generation counter.
+ *
+ * We detach up to n objects at once. We walk the chain from first_free before
+ * we own it, so a concurrent allocation can hand us garbage for a link. We
+ * never follow a link that leaves the region, and the generation counter
+ * guarantees the CAS2 fails if anything we walked changed underneath us.
+ */
+static uint64_t
+uslab_pop_list(struct uslab *a, struct uslab_head *head, char *base,
+    char *end, void **objs, uint64_t n)
+{
+	struct uslab_head update, original;
+	char *cur, *next;
+	uint64_t i;
+
+	original.generation = ck_pr_load_ptr(&head->generation);
+	ck_pr_fence_load();
+	original.first_free = ck_pr_load_ptr(&head->first_free);
+
+	for (;;) {
+		ck_pr_fence_load();
+		cur = original.first_free;
+		for (i = 0; i < n && cur >= base && cur < end; i++) {
+			objs[i] = uslab_addr(a, cur);
+			next = ck_pr_load_ptr(&uslab_link(a, objs[i])->next_free);
+			cur = (next == NULL) ? cur + a->size_class : next;
+		}
+
+		if (i == 0) {
+			return 0;
+		}
+
+		update.generation = original.generation + 1;
+		update.first_free = cur;
+		if (ck_pr_cas_ptr_2_value(head, &original, &update, &original) == true) {
+			break;
+		}
+		uslab_count_retry(a);
+	}
+
+	return i;
+}
+
+/*
+ * Atomically take an entire freelist, leaving it empty. Returns the first
+ * object on the list, or end if it was empty.
+ */
+static char *
+uslab_detach_list(struct uslab *a, struct uslab_head *head, char *end)
+{
+	struct uslab_head o, u;
+
+	o.generation = ck_pr_load_ptr(&head->generation);
+	ck_pr_fence_load();
+	o.first_free = ck_pr_load_ptr(&head->first_free);
+	for (;;) {
+		u.generation = o.generation + 1;
+		u.first_free = end;
+		if (ck_pr_cas_ptr_2_value(head, &o, &u, &o) == true) {
+			break;
+		}
+		uslab_count_retry(a);
+	}
+
+	return o.first_free;
+}
+#endif
+
+/*
+ * The same as above for the single-word head format. The head holds the
+ * offset of the first free object from the region base in its low tag_shift
+ * bits and a generation count in the rest, so a plain CAS is ABA-safe as
+ * long as the generation doesn't wrap while we're pre-empted.
+ */
+static uint64_t
+uslab_pop_chain_tagged(struct uslab *a, struct uslab_pt *slab, void **objs,
+    uint64_t n)
+{
+	uint64_t original, update, off;
+	char *cur, *next;
+	uint64_t i;
+
+	original = ck_pr_load_64(&slab->head);
+
+	for (;;) {
+		ck_pr_fence_load();
+		off = original & a->tag_mask;
+		for (i = 0; i < n && off < slab->size; i++) {
+			cur = uslab_addr(a, slab->base + off);
+			objs[i] = cur;
+			next = ck_pr_load_ptr(&uslab_link(a, cur)->next_free);
+			off = (next == NULL) ?
+			    off + a->size_class : (uint64_t)(next - slab->base);
+		}
+
+		if (i == 0) {
+			return 0;
+		}
+
+		update = ((original & ~a->tag_mask) + (1ULL << a->tag_shift)) |
+		    (off & a->tag_mask);
+		if (ck_pr_cas_64_value(&slab->head, original, update, &original) == true) {
+			break;
+		}
+		uslab_count_retry(a);
+	}
+	uslab_charge(a, slab, i);
+
+	return i;
+}
+
+static inline uint64_t
+uslab_pop_chain(struct uslab *a, struct uslab_pt *slab, void **objs,
+    uint64_t n)
+{
+
+#ifdef CK_F_PR_CAS_PTR_2_VALUE
+	if ((a->flags & USLAB_TAGGED) == 0) {
+		n = uslab_pop_list(a, (struct uslab_head *)slab, slab->base,
+		    slab->base + slab->size, objs, n);
+		uslab_charge(a, slab, n);
+		return n;
+	}
+#endif
+
+	return uslab_pop_chain_tagged(a, slab, objs, n);
+}
+
+/*
+ * Push a chain, already linked from first to last, onto a freelist in the
+ * CAS2 format. first is as stored, and e is the link of last.
+ */
+static void
+uslab_push_list(struct uslab *a, char **head, void *first,
+    struct uslab_entry *e)
+{
+	char *target;
+
+	target = ck_pr_load_ptr(head);
+	for (;;) {
 		e->next_free = target;
 		ck_pr_fence_store();
-	} while (ck_pr_cas_ptr(&allocated_slab->first_free, target, e) == false);
+		if (ck_pr_cas_ptr_value(head, target, first, &target) == true) {
+			break;
+		}
+		uslab_count_retry(a);
+	}
+}
+
+/*
+ * Push a chain of n objects, already linked from first to last, onto the
+ * region that owns them with a single CAS. We don't need any CAS2 voodoo
+ * here because we do not rely on the value of next_free for the entry we are
+ * attempting to replace at the head of our stack. Additionally, it is
+ * impossible for us to observe the same value at the time we read target and
+ * the time we try to write to it because no other concurrent processes know
+ * about our chain.
+ *
+ * The tagged format bumps the generation on frees as well, since the
+ * generation shares a word with the head.
+ */
+static void
+uslab_push_chain(struct uslab *a, struct uslab_pt *slab, void *first,
+    void *last, uint64_t n)
+{
+	uint64_t original, update;
+	struct uslab_entry *e;
+
+	e = uslab_link(a, last);
+	if (a->flags & USLAB_TAGGED) {
+		original = ck_pr_load_64(&slab->head);
+		for (;;) {
+			e->next_free = slab->base + (original & a->tag_mask);
+			ck_pr_fence_store();
+			update = ((original & ~a->tag_mask) +
+			    (1ULL << a->tag_shift)) |
+			    (uint64_t)(uslab_stored(a, first) - slab->base);
+			if (ck_pr_cas_64_value(&slab->head, original, update,
+			    &original) == true) {
+				break;
+			}
+			uslab_count_retry(a);
+		}
+	} else {
+		uslab_push_list(a, &slab->first_free, uslab_stored(a, first),
+		    e);
+	}
+
+	uslab_avail_set(a, slab);
+	ck_pr_sub_64(&slab->used, n * a->size_class);
+}
+
+#ifdef USLAB_HAVE_RSEQ
+/*
+ * Per-CPU slabs with rseq account usage to the region of the CPU that did
+ * the allocating or freeing, which need not be the region that owns the
+ * object. The sum over all regions is exact. Threads without rseq can't
+ * touch used, and charge remote_used of the object's region instead.
+ */
+static void
+uslab_percpu_charge(struct uslab *a, int64_t delta)
+{
+	struct uslab_pt *slab;
+	unsigned int cpu;
+
+	do {
+		cpu = uslab_cpu();
+		if (cpu >= a->pt_slabs) {
+			return;
+		}
+		slab = &uslab_pts(a)[cpu];
+	} while (uslab_rseq_add(slab, cpu, delta) != 0);
+
+	/* Only our CPU charges this region, bar migrations, so no CAS. */
+	if ((a->flags & USLAB_STATS) && delta > 0 && slab->used > slab->hwm) {
+		slab->hwm = slab->used;
+	}
+}
+
+/*
+ * Hand a chain taken from a remote list back to it. This only happens when
+ * we lose a race with a thread on the same CPU or migrate, so walking the
+ * chain to find its end is fine.
+ */
+static void
+uslab_percpu_unadopt(struct uslab *a, struct uslab_pt *slab, char *chain)
+{
+	struct uslab_entry *e;
+	char *end;
+
+	end = slab->base + slab->size;
+	for (e = uslab_link(a, uslab_addr(a, chain)); e->next_free != end;
+	    e = uslab_link(a, uslab_addr(a, e->next_free)))
+		;
+
+	uslab_push_list(a, &slab->remote, chain, e);
+}
+
+/*
+ * Allocate from the local freelist of our CPU's region, adopting its remote
+ * list when the local one runs dry. Other CPUs' local lists are off limits,
+ * so once both are empty we can only steal from other remote lists. Threads
+ * without rseq, say in a process that attached to a shared slab created
+ * with it, may not touch any local list, and only ever steal.
+ */
+static void *
+uslab_percpu_alloc(struct uslab *a)
+{
+	struct uslab_pt *slab;
+	unsigned int cpu;
+	char *chain, *end;
+	uint64_t i;
+	bool rseq;
+	void *p;
+	int r;
+
+	rseq = uslab_rseq_registered();
+	for (;;) {
+		cpu = uslab_cpu();
+		if (rseq == false || cpu >= a->pt_slabs) {
+			break;
+		}
+
+		slab = &uslab_pts(a)[cpu];
+		r = uslab_rseq_pop(a, slab, cpu, &p);
+		if (r == 1) {
+			p = uslab_addr(a, p);
+			goto out;
+		} else if (r == -1) {
+			continue;
+		}
+
+		end = slab->base + slab->size;
+		chain = uslab_detach_list(a,
+		    (struct uslab_head *)&slab->remote, end);
+		if (chain >= end) {
+			break;
+		}
+
+		if (uslab_rseq_install(slab, cpu, chain) != 0) {
+			uslab_percpu_unadopt(a, slab, chain);
+		}
+	}
+
+	for (i = 1; i <= a->pt_slabs; i++) {
+		slab = &uslab_pts(a)[(cpu + i) % a->pt_slabs];
+		if (uslab_pop_list(a, (struct uslab_head *)&slab->remote,
+		    slab->base, slab->base + slab->size, &p, 1) == 1) {
+			uslab_count_steals(a, i != a->pt_slabs);
+			goto out;
+		}
+	}
+
+	/* OOM. */
+	return NULL;
+
+out:
+	if (rseq == true) {
+		uslab_percpu_charge(a, a->size_class);
+	} else {
+		ck_pr_add_64(&slab->remote_used, a->size_class);
+	}
+	return p;
+}
+
+/*
+ * Free to the local freelist if we're running on the CPU that owns the
+ * object, and to its remote list otherwise, or if we can't run rseq.
+ */
+static void
+uslab_percpu_free(struct uslab *a, void *p)
+{
+	struct uslab_pt *slab;
+	unsigned int cpu;
+
+	slab = uslab_pt_of(a, p);
+	cpu = slab->offset;
+	if (uslab_rseq_registered() == false) {
+		uslab_push_list(a, &slab->remote, uslab_stored(a, p),
+		    uslab_link(a, p));
+		ck_pr_sub_64(&slab->remote_used, a->size_class);
+		return;
+	}
+
+	while (uslab_rseq_push(slab, cpu, uslab_stored(a, p),
+	    uslab_link(a, p)) != 0) {
+		if (uslab_cpu() != cpu) {
+			uslab_push_list(a, &slab->remote, uslab_stored(a, p),
+			    uslab_link(a, p));
+			break;
+		}
+	}
+
+	uslab_percpu_charge(a, -(int64_t)a->size_class);
+}
+#endif
+
+/*
+ * Remote frees. With USLAB_REMOTE, objects freed by a thread that doesn't
+ * allocate from their region go on the region's remote list, which sits on
+ * a different cacheline from the freelist its allocating threads CAS2 on.
+ * Pushing needs a single CAS, and since nothing ever pops a single object
+ * off a remote list, taking the whole list is a single swap, free of ABA.
+ *
+ * A region adopts its remote list once its freelist runs dry, whether its
+ * own threads or a stealer finds it so, and only then are the objects on it
+ * accounted as free.
+ */
+
+/*
+ * Whether slab is the region the calling thread allocates from. Threads that
+ * have never allocated have no region, so everything they free is remote.
+ */
+static inline bool
+uslab_pt_mine(struct uslab *a, struct uslab_pt *slab)
+{
+
+	return uslab_pt != NULL && uslab_pt_get(a) == slab;
+}
+
+/*
+ * Return a chain of n objects, linked from first to last, to the region that
+ * owns them.
+ */
+static inline void
+uslab_free_to(struct uslab *a, struct uslab_pt *slab, void *first,
+    void *last, uint64_t n)
+{
+
+	if ((a->flags & USLAB_REMOTE) && uslab_pt_mine(a, slab) == false) {
+		uslab_push_list(a, &slab->remote, uslab_stored(a, first),
+		    uslab_link(a, last));
+		uslab_avail_set(a, slab);
+		return;
+	}
+
+	uslab_push_chain(a, slab, first, last, n);
+}
+
+/*
+ * Move a region's remote list to its freelist. Returns false if there was
+ * nothing to move. We walk the list to count it and find its tail, which
+ * also brings the objects we're about to hand out into our cache.
+ */
+static bool
+uslab_adopt(struct uslab *a, struct uslab_pt *slab)
+{
+	char *chain, *last, *end;
+	uint64_t n;
+
+	end = slab->base + slab->size;
+	if ((a->flags & USLAB_REMOTE) == 0 ||
+	    ck_pr_load_ptr(&slab->remote) >= end) {
+		return false;
+	}
+
+	chain = ck_pr_fas_ptr(&slab->remote, end);
+	if (chain >= end) {
+		return false;
+	}
+
+	ck_pr_fence_atomic_load();
+	n = 1;
+	for (last = chain; uslab_link(a, uslab_addr(a, last))->next_free != end;
+	    last = uslab_link(a, uslab_addr(a, last))->next_free) {
+		n++;
+	}
+
+	uslab_push_chain(a, slab, uslab_addr(a, chain), uslab_addr(a, last),
+	    n);
+	return true;
+}
+
+/*
+ * Commit region n of a growable slab, which an allocation found to have
+ * n regions. Returns false if the slab can't grow any further.
+ *
+ * Any number of threads may do this at once, and a thread may still be at
+ * it long after another has finished. mprotect(2) is idempotent, every
+ * thread writes the same values to the region header, and the freelist
+ * heads are set only if they still hold the zeroes the header started with,
+ * so the region is intact whoever gets there first. Publishing it is a CAS
+ * on pt_slabs. Nobody waits for anybody.
+ */
+static bool
+uslab_grow(struct uslab *a, uint64_t n)
+{
+	struct uslab_pt *pt;
+	char *base;
+	uintptr_t lo, hi;
+
+	if (n >= a->pt_max) {
+		return false;
+	}
+
+	if (ck_pr_load_64(&a->pt_slabs) != n) {
+		return true;
+	}
+
+	/*
+	 * Regions needn't be a whole number of pages, so the pages at either
+	 * end may already be committed along with a neighbour.
+	 */
+	pt = &uslab_pts(a)[n];
+	base = a->slab0_base + n * a->pt_stride;
+	lo = USLAB_ALIGN_DOWN(uslab_addr(a, base), a->page_size);
+	hi = USLAB_ALIGN_UP(uslab_addr(a, base) + a->pt_stride, a->page_size);
+	base = uslab_pt_base(a, n);
+	if (mprotect((void *)lo, hi - lo, PROT_READ | PROT_WRITE) == -1) {
+		return false;
+	}
+
+	ck_pr_store_ptr(&pt->base, base);
+	ck_pr_store_64(&pt->size, a->pt_size);
+	ck_pr_store_64(&pt->offset, n);
+	if ((a->flags & USLAB_TAGGED) == 0) {
+		(void)ck_pr_cas_ptr(&pt->first_free, NULL, base);
+	}
+	(void)ck_pr_cas_ptr(&pt->remote, NULL, base + a->pt_size);
+	if (a->flags & USLAB_NUMA) {
+		uslab_numa_place(a, n);
+	}
+	uslab_avail_set(a, pt);
+
+	ck_pr_fence_store();
+	(void)ck_pr_cas_64(&a->pt_slabs, n, n + 1);
+
+	return true;
+}
+
+/*
+ * The index of the region i after oa, of npt. Slabs never shrink, so oa is
+ * one of them.
+ */
+static inline uint64_t
+uslab_pt_next(struct uslab_pt *oa, uint64_t i, uint64_t npt)
+{
+	uint64_t idx;
+
+	idx = oa->offset + i;
+	return (idx >= npt) ? idx - npt : idx;
+}
+
+/*
+ * Our own region ran dry, so look for objects in the others, skipping those
+ * the bitmap says are empty, then grow the slab if it can. Kept out of line
+ * so that the fast path in uslab_alloc_one stays small.
+ */
+static void * __attribute__((noinline))
+uslab_alloc_steal(struct uslab *a, struct uslab_pt *oa)
+{
+	struct uslab_pt *slab;
+	unsigned int pass;
+	uint64_t i, npt;
+	void *p;
+
+	do {
+		npt = ck_pr_load_64(&a->pt_slabs);
+		for (pass = 0; pass < uslab_steal_passes(a); pass++) {
+			for (i = 0; i < npt;
+			    i = uslab_avail_next(a, oa->offset, npt, i + 1)) {
+				slab = &uslab_pts(a)[uslab_pt_next(oa, i, npt)];
+				if (uslab_steal_pass(a, oa, slab) != pass) {
+					continue;
+				}
+
+				if ((uslab_pt_empty(a, slab) == false &&
+				    uslab_pop_chain(a, slab, &p, 1) == 1) ||
+				    (uslab_adopt(a, slab) == true &&
+				    uslab_pop_chain(a, slab, &p, 1) == 1)) {
+					uslab_count_steals(a, slab != oa);
+					return p;
+				}
+				uslab_avail_clear(a, slab);
+			}
+		}
+	} while (uslab_grow(a, npt) == true);
+
+	/* OOM. */
+	return NULL;
+}
+
+/*
+ * Allocate from our region, and if we're out of space, try to steal some
+ * memory from elsewhere. Growable slabs grow once every region is empty.
+ */
+static void *
+uslab_alloc_one(struct uslab *a)
+{
+	struct uslab_pt *oa;
+	void *p;
+
+#ifdef USLAB_HAVE_RSEQ
+	if (a->percpu_rseq) {
+		return uslab_percpu_alloc(a);
+	}
+#endif
+
+	oa = uslab_pt_get(a);
+	if (uslab_pt_empty(a, oa) == false &&
+	    uslab_pop_chain(a, oa, &p, 1) == 1) {
+		return p;
+	}
+
+	return uslab_alloc_steal(a, oa);
+}
+
+/*
+ * Allocate up to n objects, starting at our own region and stealing from the
+ * others once it runs dry. Each region costs at most one successful CAS2.
+ */
+static uint64_t
+uslab_alloc_chain(struct uslab *a, void **objs, uint64_t n)
+{
+	struct uslab_pt *slab, *oa;
+	unsigned int pass;
+	uint64_t i, k, got, npt;
+
+	got = 0;
+#ifdef USLAB_HAVE_RSEQ
+	if (a->percpu_rseq) {
+		while (got < n && (objs[got] = uslab_percpu_alloc(a)) != NULL) {
+			got++;
+		}
+		return got;
+	}
+#endif
+
+	oa = uslab_pt_get(a);
+	do {
+		npt = ck_pr_load_64(&a->pt_slabs);
+		for (pass = 0; pass < uslab_steal_passes(a); pass++) {
+			for (i = 0; got < n && i < npt;
+			    i = uslab_avail_next(a, oa->offset, npt, i + 1)) {
+				slab = &uslab_pts(a)[uslab_pt_next(oa, i, npt)];
+				if (uslab_steal_pass(a, oa, slab) != pass) {
+					continue;
+				}
+
+				k = uslab_pop_chain(a, slab, objs + got,
+				    n - got);
+				if (k < n - got && uslab_adopt(a, slab) == true) {
+					k += uslab_pop_chain(a, slab,
+					    objs + got + k, n - got - k);
+				}
+				if (k == 0) {
+					uslab_avail_clear(a, slab);
+				} else if (slab != oa) {
+					uslab_count_steals(a, k);
+				}
+				got += k;
+			}
+		}
+	} while (got < n && uslab_grow(a, npt) == true);
+
+	return got;
+}
+
+/*
+ * Return n objects to their owning regions. Objects are linked locally into
+ * one chain per region, and each chain is pushed with a single CAS. Chains
+ * are found through an open-addressed table keyed by region, kept at most
+ * half full: a batch can't span more than n regions, or more than the slab
+ * has. Small tables live on the stack. If a big one can't be allocated, we
+ * push the objects one at a time instead.
+ */
+#define	USLAB_BULK_SLOTS	64
+
+struct uslab_bulk_group {
+	struct uslab_pt	*slab;
+	void		*first;
+	void		*last;
+	uint64_t	n;
+};
+
+static void
+uslab_free_chain(struct uslab *a, void **objs, uint64_t n)
+{
+	struct uslab_bulk_group local[USLAB_BULK_SLOTS], *g;
+	struct uslab_pt *slab, *pts;
+	uint64_t i, h, nslots;
+
+#ifdef USLAB_HAVE_RSEQ
+	if (a->percpu_rseq) {
+		for (i = 0; i < n; i++) {
+			uslab_percpu_free(a, objs[i]);
+		}
+		return;
+	}
+#endif
+
+	if (n == 0) {
+		return;
+	}
+
+	nslots = MIN(n, ck_pr_load_64(&a->pt_slabs));
+	nslots = 1ULL << (64 - __builtin_clzll(2 * nslots - 1));
+	if (nslots <= USLAB_BULK_SLOTS) {
+		g = local;
+		memset(g, 0, nslots * sizeof (*g));
+	} else if ((g = calloc(nslots, sizeof (*g))) == NULL) {
+		for (i = 0; i < n; i++) {
+			uslab_free_to(a, uslab_pt_of(a, objs[i]), objs[i],
+			    objs[i], 1);
+		}
+		return;
+	}
+
+	pts = uslab_pts(a);
+	for (i = 0; i < n; i++) {
+		slab = uslab_pt_of(a, objs[i]);
+		for (h = (slab - pts) & (nslots - 1);
+		    g[h].slab != NULL && g[h].slab != slab;
+		    h = (h + 1) & (nslots - 1))
+			;
+
+		if (g[h].slab == NULL) {
+			g[h].slab = slab;
+			g[h].first = objs[i];
+			g[h].n = 0;
+		} else {
+			uslab_link(a, g[h].last)->next_free =
+			    uslab_stored(a, objs[i]);
+		}
+		g[h].last = objs[i];
+		g[h].n++;
+	}
+
+	for (h = 0; h < nslots; h++) {
+		if (g[h].slab != NULL) {
+			uslab_free_to(a, g[h].slab, g[h].first, g[h].last,
+			    g[h].n);
+		}
+	}
+
+	if (g != local) {
+		free(g);
+	}
+}
+
+/*
+ * Statistics blocks of a thread that exits stay on the list with their
+ * counts, free for the next thread to claim.
+ */
+static void
+uslab_tstats_exit(void *arg)
+{
+	struct uslab_tstats *ts;
+
+	for (ts = arg; ts != NULL; ts = ts->next_mine) {
+		ck_pr_store_64(&ts->live, 0);
+	}
+}
+
+static void
+uslab_tstats_init(void)
+{
+
+	(void)pthread_key_create(&uslab_tstats_key, uslab_tstats_exit);
+}
+
+/* Point a block we own at a, starting its counts over if it was another's. */
+static void
+uslab_tstats_assign(struct uslab_tstats *ts, struct uslab *a)
+{
+
+	if (ts->slab == a && ts->serial == a->serial) {
+		return;
+	}
+
+	ck_pr_store_64(&ts->serial, 0);
+	ck_pr_fence_store();
+	ck_pr_store_64(&ts->allocs, 0);
+	ck_pr_store_64(&ts->frees, 0);
+	ck_pr_store_64(&ts->retries, 0);
+	ck_pr_store_64(&ts->steals, 0);
+	ck_pr_store_64(&ts->ooms, 0);
+	ck_pr_store_ptr(&ts->slab, a);
+	ck_pr_fence_store();
+	ck_pr_store_64(&ts->serial, a->serial);
+}
+
+/*
+ * Find the calling thread's statistics block for a slab when it isn't in the
+ * slot we looked in first. We look among our own blocks, then for one an
+ * exited thread left for this slab or a destroyed one, then reuse one of our
+ * own left by a destroyed slab, and only then allocate. Returns NULL if we
+ * can't, in which case the calling thread goes uncounted.
+ */
+static struct uslab_tstats * __attribute__((noinline))
+uslab_tstats_find(struct uslab *a)
+{
+	struct uslab_tstats *ts, *spare, *head;
+	uint64_t serial;
+
+	spare = NULL;
+	for (ts = uslab_tstats_mine; ts != NULL; ts = ts->next_mine) {
+		if (ts->slab == a && ts->serial == a->serial) {
+			return ts;
+		}
+		if (ts->serial == 0 && spare == NULL) {
+			spare = ts;
+		}
+	}
+
+	for (ts = ck_pr_load_ptr(&uslab_tstats_all); ts != NULL;
+	    ts = ck_pr_load_ptr(&ts->next)) {
+		serial = ck_pr_load_64(&ts->serial);
+		if ((serial == a->serial || (serial == 0 && spare == NULL)) &&
+		    ck_pr_load_64(&ts->live) == 0 &&
+		    ck_pr_cas_64(&ts->live, 0, 1) == true) {
+			break;
+		}
+	}
+
+	if (ts == NULL && spare != NULL) {
+		uslab_tstats_assign(spare, a);
+		return spare;
+	}
+
+	if (ts == NULL) {
+		ts = calloc(1, sizeof (*ts));
+		if (ts == NULL) {
+			return NULL;
+		}
+		ts->live = 1;
+		head = ck_pr_load_ptr(&uslab_tstats_all);
+		do {
+			ts->next = head;
+			ck_pr_fence_store();
+		} while (ck_pr_cas_ptr_value(&uslab_tstats_all, head, ts,
+		    &head) == false);
+	}
+
+	uslab_tstats_assign(ts, a);
+	ts->next_mine = uslab_tstats_mine;
+	uslab_tstats_mine = ts;
+	(void)pthread_once(&uslab_tstats_once, uslab_tstats_init);
+	(void)pthread_setspecific(uslab_tstats_key, ts);
+
+	return ts;
+}
+
+static inline struct uslab_tstats *
+uslab_tstats_get(struct uslab *a)
+{
+	struct uslab_tstats **slot;
+
+	slot = &uslab_tstats_slots[a->serial % USLAB_STATS_SLOTS];
+	if (*slot == NULL || (*slot)->slab != a ||
+	    (*slot)->serial != a->serial) {
+		*slot = uslab_tstats_find(a);
+	}
+
+	return *slot;
+}
+
+/*
+ * Add what a call did to the calling thread's counts. retries and steals are
+ * the thread-local counters as they stood when the call began. Nobody else
+ * writes our counts, so there's nothing atomic about this but the stores.
+ */
+static inline void
+uslab_tstats_count(struct uslab_tstats *ts, uint64_t retries, uint64_t steals,
+    uint64_t allocs, uint64_t frees, uint64_t ooms)
+{
+
+	ck_pr_store_64(&ts->allocs, ts->allocs + allocs);
+	ck_pr_store_64(&ts->frees, ts->frees + frees);
+	ck_pr_store_64(&ts->retries, ts->retries + uslab_retries - retries);
+	ck_pr_store_64(&ts->steals, ts->steals + uslab_steals - steals);
+	ck_pr_store_64(&ts->ooms, ts->ooms + ooms);
+}
+
+/*
+ * Find the calling thread's magazine for this slab, claiming a free one if
+ * this is the first time we've seen it. If the magazine slot is busy holding
+ * objects for some other slab, we return NULL and the caller goes straight to
+ * the slab.
+ */
+static inline struct uslab_magazine *
+uslab_magazine_get(struct uslab *a)
+{
+	struct uslab_magazine *m;
+
+	m = &uslab_magazines[a->serial % USLAB_MAGAZINES];
+	if (m->slab == a && m->serial == a->serial) {
+		return m;
+	}
+
+	if (m->n != 0) {
+		return NULL;
+	}
+
+	m->slab = a;
+	m->serial = a->serial;
+
+	return m;
+}
+
+static inline void *
+uslab_alloc_obj(struct uslab *a)
+{
+	struct uslab_magazine *m;
+
+	if ((a->flags & USLAB_MAGAZINE) && (m = uslab_magazine_get(a)) != NULL) {
+		if (m->n == 0) {
+			m->n = uslab_alloc_chain(a, m->objs,
+			    USLAB_MAGAZINE_SIZE / 2);
+			if (m->n == 0) {
+				return NULL;
+			}
+		}
+
+		return m->objs[--m->n];
+	}
+
+	return uslab_alloc_one(a);
+}
+
+/*
+ * An slab free routine that is safe with one or more concurrent unique
+ * freeing processes in the face of many concurrent allocating processes.
+ */
+static inline void
+uslab_free_obj(struct uslab *a, void *p)
+{
+	struct uslab_magazine *m;
+
+	/*
+	 * If our magazine is full, return the older half of it to the slab,
+	 * keeping the recently freed (and likely cache-hot) objects local.
+	 */
+	if ((a->flags & USLAB_MAGAZINE) && (m = uslab_magazine_get(a)) != NULL) {
+		if (m->n == USLAB_MAGAZINE_SIZE) {
+			uslab_free_chain(a, m->objs, USLAB_MAGAZINE_SIZE / 2);
+			memmove(m->objs, &m->objs[USLAB_MAGAZINE_SIZE / 2],
+			    (USLAB_MAGAZINE_SIZE / 2) * sizeof (m->objs[0]));
+			m->n = USLAB_MAGAZINE_SIZE / 2;
+		}
+
+		m->objs[m->n++] = p;
+		return;
+	}
+
+#ifdef USLAB_HAVE_RSEQ
+	if (a->percpu_rseq) {
+		uslab_percpu_free(a, p);
+		return;
+	}
+#endif
+
+	/*
+	 * We want to free these into the same section of the pool from which
+	 * they were allocated.
+	 */
+	uslab_free_to(a, uslab_pt_of(a, p), p, p, 1);
+}
+
+/*
+ * USLAB_DEBUG slabs check every object going in and out against the map of
+ * allocated objects, and abort on the first one that is wrong: freed
+ * twice, not an object of the slab at all, or handed out while allocated,
+ * which means a freelist has been overwritten. With USLAB_POISON, free
+ * objects are filled with a poison byte but for their link, and checked when
+ * they are handed out again. Freshly mapped and reclaimed memory reads as
+ * zeros, so those pass as well.
+ */
+#define	USLAB_POISON_BYTE	0xa5
+#define	USLAB_POISON_WORD	0xa5a5a5a5a5a5a5a5ULL
+
+static void __attribute__((noinline, noreturn, cold))
+uslab_debug_fail(struct uslab *a, const void *p, const char *what)
+{
+
+	fprintf(stderr, "uslab %p: %s of %p\n", (void *)a, what, p);
+	abort();
+}
+
+/*
+ * Whether every byte of the word is zero or the poison byte. The high bit
+ * of each byte of z is set just when that byte of w is zero, without the
+ * borrows of the usual (w - 0x01..) & ~w trick, which are fine for finding
+ * some zero byte but not for checking all of them.
+ */
+static inline bool
+uslab_poison_word(uint64_t w)
+{
+	const uint64_t low = 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t z, zp, x;
+
+	x = w ^ USLAB_POISON_WORD;
+	z = ~(((w & low) + low) | w | low);
+	zp = ~(((x & low) + low) | x | low);
+	return (z | zp) == ~low;
+}
+
+static void
+uslab_debug_poison(struct uslab *a, void *p)
+{
+	char *link;
+
+	link = (char *)uslab_link(a, p);
+	memset(p, USLAB_POISON_BYTE, a->link_offset);
+	memset(link + sizeof (struct uslab_entry), USLAB_POISON_BYTE,
+	    a->size_class - a->link_offset - sizeof (struct uslab_entry));
+}
+
+static void
+uslab_debug_check_range(struct uslab *a, void *p, unsigned char *c,
+    unsigned char *end)
+{
+	uint64_t w;
+
+	for (; c + sizeof (w) <= end; c += sizeof (w)) {
+		memcpy(&w, c, sizeof (w));
+		if (uslab_poison_word(w) == false) {
+			uslab_debug_fail(a, p, "write after free");
+		}
+	}
+
+	for (; c < end; c++) {
+		if (*c != 0 && *c != USLAB_POISON_BYTE) {
+			uslab_debug_fail(a, p, "write after free");
+		}
+	}
+}
+
+/* Everything but the link must still be poison, or zero. */
+static void
+uslab_debug_check(struct uslab *a, void *p)
+{
+	unsigned char *link;
+
+	link = (unsigned char *)uslab_link(a, p);
+	uslab_debug_check_range(a, p, p, link);
+	uslab_debug_check_range(a, p, link + sizeof (struct uslab_entry),
+	    (unsigned char *)p + a->size_class);
+}
+
+/*
+ * Each object has a byte of the map to itself, so threads marking different
+ * objects never share a word, and the freelist CAS that moves an object from
+ * the thread freeing it to the one allocating it orders their marks. Frees
+ * swap the byte atomically, so that of two threads freeing an object at
+ * once, even two sharing a region, only one finds it allocated. An object
+ * just popped from a freelist is ours alone, so allocation gets by with a
+ * plain load and store.
+ */
+static void
+uslab_debug_alloc(struct uslab *a, void *p)
+{
+	uint8_t *map;
+	uint64_t i;
+
+	i = uslab_index(a, uslab_stored(a, p));
+	if (i == UINT64_MAX) {
+		uslab_debug_fail(a, p, "corrupt freelist at allocation");
+	}
+
+	map = uslab_debug_map(a) + i;
+	if (ck_pr_load_8(map) != 0) {
+		uslab_debug_fail(a, p, "corrupt freelist at allocation");
+	}
+	ck_pr_store_8(map, 1);
+
+	if (a->flags & USLAB_POISON) {
+		uslab_debug_check(a, p);
+	}
+}
+
+static void
+uslab_debug_free(struct uslab *a, void *p)
+{
+	uint64_t i;
+
+	i = uslab_index(a, uslab_stored(a, p));
+	if (i == UINT64_MAX) {
+		uslab_debug_fail(a, p, "free of a foreign or misaligned pointer");
+	}
+
+	if (ck_pr_fas_8(uslab_debug_map(a) + i, 0) == 0) {
+		uslab_debug_fail(a, p, "double free");
+	}
+
+	if (a->flags & USLAB_POISON) {
+		uslab_debug_poison(a, p);
+	}
+}
+
+/*
+ * Slabs that keep statistics or check their objects, and calls made while a
+ * trace is being taken, go through these, which count and record what each
+ * call did. Kept out of line so that other calls pay only for the tests.
+ */
+static inline bool
+uslab_instrumented(struct uslab *a)
+{
+
+	return (a->flags & (USLAB_STATS | USLAB_DEBUG)) ||
+	    ck_pr_load_ptr(&uslab_trace_cur) != NULL;
+}
+
+static inline struct uslab_tstats *
+uslab_tstats_begin(struct uslab *a)
+{
+
+	return (a->flags & USLAB_STATS) ? uslab_tstats_get(a) : NULL;
+}
+
+static void * __attribute__((noinline))
+uslab_alloc_instrumented(struct uslab *a)
+{
+	struct uslab_tstats *ts;
+	uint64_t retries, steals;
+	void *p;
+
+	ts = uslab_tstats_begin(a);
+	retries = uslab_retries;
+	steals = uslab_steals;
+	p = uslab_alloc_obj(a);
+	if (p != NULL && (a->flags & USLAB_DEBUG)) {
+		uslab_debug_alloc(a, p);
+	}
+	if (ts != NULL) {
+		uslab_tstats_count(ts, retries, steals, p != NULL, 0,
+		    p == NULL);
+	}
+	uslab_trace_record(a, (p != NULL) ? USLAB_TRACE_ALLOC : USLAB_TRACE_OOM,
+	    &p, 1);
+
+	return p;
+}
+
+static void __attribute__((noinline))
+uslab_free_instrumented(struct uslab *a, void *p)
+{
+	struct uslab_tstats *ts;
+	uint64_t retries, steals;
+
+	if (a->flags & USLAB_DEBUG) {
+		uslab_debug_free(a, p);
+	}
+	uslab_trace_record(a, USLAB_TRACE_FREE, &p, 1);
+	ts = uslab_tstats_begin(a);
+	retries = uslab_retries;
+	steals = uslab_steals;
+	uslab_free_obj(a, p);
+	if (ts != NULL) {
+		uslab_tstats_count(ts, retries, steals, 0, 1, 0);
+	}
+}
+
+void *
+uslab_alloc(struct uslab *a)
+{
+
+	if (uslab_instrumented(a)) {
+		return uslab_alloc_instrumented(a);
+	}
+
+	return uslab_alloc_obj(a);
+}
+
+void
+uslab_free(struct uslab *a, void *p)
+{
+
+	/* Stupid. */
+	if (p == NULL) return;
+
+	if (uslab_instrumented(a)) {
+		uslab_free_instrumented(a, p);
+		return;
+	}
+
+	uslab_free_obj(a, p);
+}
+
+/*
+ * Allocate up to n objects into p, returning the number actually allocated.
+ * Objects are taken from the calling thread's region first, detaching as many
+ * as it has with a single CAS2, and then stolen from other regions the same
+ * way. Magazines are bypassed.
+ */
+uint64_t
+uslab_alloc_bulk(struct uslab *a, void **p, uint64_t n)
+{
+	struct uslab_tstats *ts;
+	uint64_t retries, steals, got, i;
+
+	if (!uslab_instrumented(a)) {
+		return uslab_alloc_chain(a, p, n);
+	}
+
+	ts = uslab_tstats_begin(a);
+	retries = uslab_retries;
+	steals = uslab_steals;
+	got = uslab_alloc_chain(a, p, n);
+	for (i = 0; i < got && (a->flags & USLAB_DEBUG); i++) {
+		uslab_debug_alloc(a, p[i]);
+	}
+	if (ts != NULL) {
+		uslab_tstats_count(ts, retries, steals, got, 0, got < n);
+	}
+	uslab_trace_record(a, USLAB_TRACE_ALLOC, p, got);
+	uslab_trace_record(a, USLAB_TRACE_OOM, NULL, got < n);
+
+	return got;
+}
+
+/*
+ * Free n objects. Objects are grouped by their owning region, so a batch
+ * costs one CAS per region it spans rather than one per object. The objects
+ * may come from any mix of uslab_alloc and uslab_alloc_bulk calls.
+ */
+void
+uslab_free_bulk(struct uslab *a, void **p, uint64_t n)
+{
+	struct uslab_tstats *ts;
+	uint64_t retries, steals, i;
+
+	if (!uslab_instrumented(a)) {
+		uslab_free_chain(a, p, n);
+		return;
+	}
+
+	for (i = 0; i < n && (a->flags & USLAB_DEBUG); i++) {
+		uslab_debug_free(a, p[i]);
+	}
+	uslab_trace_record(a, USLAB_TRACE_FREE, p, n);
+	ts = uslab_tstats_begin(a);
+	retries = uslab_retries;
+	steals = uslab_steals;
+	uslab_free_chain(a, p, n);
+	if (ts != NULL) {
+		uslab_tstats_count(ts, retries, steals, 0, n, 0);
+	}
+}
+
+/*
+ * Return everything in the calling thread's magazine for this slab. Threads
+ * should do this before they exit or before the slab is destroyed; objects
+ * left in a magazine are otherwise lost to the slab.
+ */
+void
+uslab_magazine_flush(struct uslab *a)
+{
+	struct uslab_magazine *m;
+
+	m = &uslab_magazines[a->serial % USLAB_MAGAZINES];
+	if (m->slab != a || m->serial != a->serial) {
+		return;
+	}
+
+	uslab_free_chain(a, m->objs, m->n);
+	m->n = 0;
+}
+
+/*
+ * Atomically take a region's entire freelist, leaving it empty. Returns the
+ * first object on the list, or the end of the region if it was empty.
+ */
+static char *
+uslab_detach(struct uslab *a, struct uslab_pt *slab)
+{
+	uint64_t original, update;
+
+#ifdef CK_F_PR_CAS_PTR_2_VALUE
+	if ((a->flags & USLAB_TAGGED) == 0) {
+		return uslab_detach_list(a, (struct uslab_head *)slab,
+		    slab->base + slab->size);
+	}
+#endif
+
+	original = ck_pr_load_64(&slab->head);
+	do {
+		update = ((original & ~a->tag_mask) + (1ULL << a->tag_shift)) |
+		    slab->size;
+	} while (ck_pr_cas_64_value(&slab->head, original, update,
+	    &original) == false);
+
+	return slab->base + (original & a->tag_mask);
+}
+
+/*
+ * Install a chain as a region's freelist, but only if the region is still
+ * empty.
+ */
+static bool
+uslab_attach(struct uslab *a, struct uslab_pt *slab, char *first)
+{
+	uint64_t original, update;
+
+#ifdef CK_F_PR_CAS_PTR_2_VALUE
+	if ((a->flags & USLAB_TAGGED) == 0) {
+		struct uslab_head o, u;
+
+		o.generation = ck_pr_load_ptr(&slab->generation);
+		ck_pr_fence_load();
+		o.first_free = slab->base + slab->size;
+		u.generation = o.generation + 1;
+		u.first_free = first;
+
+		return ck_pr_cas_ptr_2(slab, &o, &u);
+	}
+#endif
+
+	original = ck_pr_load_64(&slab->head);
+	if ((original & a->tag_mask) != slab->size) {
+		return false;
+	}
+
+	update = ((original & ~a->tag_mask) + (1ULL << a->tag_shift)) |
+	    (uint64_t)(first - slab->base);
+
+	return ck_pr_cas_64(&slab->head, original, update);
+}
+
+/*
+ * Hand a detached chain back to its region. Frees may have landed on the
+ * region while we held its list. Rather than appending them after our chain,
+ * which may end in a run of zeroed objects, we take them back and put them
+ * in front: they were pushed onto an empty list, so the last of them links
+ * to the end of the region and we can relink it to our chain.
+ */
+static void
+uslab_reattach(struct uslab *a, struct uslab_pt *slab, char *first)
+{
+	struct uslab_entry *e;
+	char *end, *h;
+
+	end = slab->base + slab->size;
+	while (uslab_attach(a, slab, first) == false) {
+		h = uslab_detach(a, slab);
+		if (h >= end) {
+			continue;
+		}
+
+		for (e = uslab_link(a, uslab_addr(a, h)); e->next_free != end;
+		    e = uslab_link(a, uslab_addr(a, e->next_free)))
+			;
+		e->next_free = first;
+		first = h;
+	}
+
+	/* Allocators may have cleared our bit while the list was away. */
+	uslab_avail_set(a, slab);
+}
+
+static size_t
+uslab_release(struct uslab *a, uintptr_t lo, uintptr_t hi)
+{
+	int r;
+
+	if (hi <= lo) {
+		return 0;
+	}
+
+	if (a->backing == USLAB_BACKING_RAMDISK ||
+	    a->backing == USLAB_BACKING_SHARED) {
+		/* The same as fallocate(2) with FALLOC_FL_PUNCH_HOLE. */
+		r = madvise((void *)lo, hi - lo, MADV_REMOVE);
+	} else {
+#ifdef MADV_FREE
+		r = madvise((void *)lo, hi - lo, MADV_FREE);
+		if (r == -1 && errno == EINVAL)
+#endif
+		r = madvise((void *)lo, hi - lo, MADV_DONTNEED);
+	}
+
+	return (r == 0) ? hi - lo : 0;
+}
+
+#define	USLAB_PAGE_DOWN(a, x)	USLAB_ALIGN_DOWN((x), (a)->page_size)
+#define	USLAB_PAGE_UP(a, x)	USLAB_ALIGN_UP((x), (a)->page_size)
+
+/*
+ * Run a cache's destructor on a free object. Its link field holds the
+ * freelist link, not what its last user left there, and anything the
+ * destructor writes to it is undone, since the slab still needs the link.
+ */
+static void
+uslab_cache_dtor(struct uslab_cache *c, void *obj)
+{
+	struct uslab_entry e;
+
+	e = *uslab_link(c->slab, obj);
+	c->dtor(obj, c->arg);
+	*uslab_link(c->slab, obj) = e;
+}
+
+/*
+ * Destroy the constructed objects of a cache that overlap [lo, hi) of a
+ * region, whose memory is about to go, so that they're constructed afresh.
+ */
+static void
+uslab_cache_forget(struct uslab_cache *c, struct uslab_pt *slab, uintptr_t lo,
+    uintptr_t hi)
+{
+	struct uslab *a = c->slab;
+	char *base;
+	uint64_t k, n, i;
+
+	if (hi <= lo) {
+		return;
+	}
+
+	base = uslab_addr(a, slab->base);
+	n = MIN((hi - (uintptr_t)base + a->size_class - 1) / a->size_class,
+	    slab->size / a->size_class);
+	for (k = (lo - (uintptr_t)base) / a->size_class; k < n; k++) {
+		i = uslab_index(a, slab->base + k * a->size_class);
+		if (ck_pr_btr_64(&c->constructed[i / 64], i % 64) == true &&
+		    c->dtor != NULL) {
+			uslab_cache_dtor(c, base + k * a->size_class);
+		}
+	}
+}
+
+/*
+ * Release the pages of one region that hold nothing but free objects.
+ *
+ * Every freelist is a chain of explicitly linked objects, optionally ending
+ * in a run of zeroed objects that extends to the end of the region. We
+ * detach the list, mark its explicitly linked objects in a bitmap, and
+ * rebuild it in address order. In address order, a run of free objects can
+ * rely on the zero-means-adjacent rule all the way through, except for the
+ * last object of a run, which must link explicitly past the allocated
+ * objects that follow it. So we release whole pages inside each run, short
+ * of the page holding the last object's link. The final run merges with the
+ * zeroed tail and needs no explicit link at all.
+ *
+ * We write every link before releasing anything, so whether the kernel
+ * zeroes a page right away, later (MADV_FREE), or not at all, each object
+ * reads either its link or zero, and both lead to the same next object.
+ *
+ * An object cache's objects are destroyed, and forgotten, before any of
+ * their memory goes, and before the links of their run are rewritten, so
+ * a destructor sees each link as the object's free left it.
+ *
+ * If the chain looks corrupt, we put it back untouched.
+ */
+static size_t
+uslab_reclaim_pt(struct uslab *a, struct uslab_pt *slab, struct uslab_cache *c)
+{
+	char *end, *first, *cur, *next, *zero, *prev, *obj;
+	uint64_t *map, nobj, i, j, k, n;
+	uintptr_t lo, hi;
+	size_t released;
+
+	released = 0;
+	end = slab->base + slab->size;
+	(void)uslab_adopt(a, slab);
+	first = uslab_detach(a, slab);
+	if (first >= end) {
+		return 0;
+	}
+
+	/* Find the zeroed tail; every object from there on is free. */
+	zero = end;
+	n = 0;
+	for (cur = first; cur != end; cur = next) {
+		if (cur < slab->base || cur > end ||
+		    (cur - slab->base) % a->size_class != 0 ||
+		    ++n > slab->size / a->size_class) {
+			goto restore;
+		}
+
+		next = uslab_link(a, uslab_addr(a, cur))->next_free;
+		if (next == NULL) {
+			zero = cur;
+			break;
+		}
+	}
+
+	nobj = (zero - slab->base) / a->size_class;
+	map = calloc((nobj + 63) / 64 + 1, sizeof (*map));
+	if (map == NULL) {
+		goto restore;
+	}
+
+	for (cur = first; cur != zero;
+	    cur = uslab_link(a, uslab_addr(a, cur))->next_free) {
+		if (cur > zero) {
+			free(map);
+			goto restore;
+		}
+
+		i = (cur - slab->base) / a->size_class;
+		if ((map[i / 64] & (1ULL << (i % 64))) != 0) {
+			free(map);
+			goto restore;
+		}
+		map[i / 64] |= 1ULL << (i % 64);
+	}
+
+	prev = NULL;
+	first = zero;
+	for (i = 0; i < nobj; i = j + 1) {
+		if ((map[i / 64] & (1ULL << (i % 64))) == 0) {
+			j = i;
+			continue;
+		}
+
+		for (j = i; j + 1 < nobj &&
+		    (map[(j + 1) / 64] & (1ULL << ((j + 1) % 64))) != 0; j++)
+			;
+
+		obj = slab->base + i * a->size_class;
+		if (j + 1 == nobj && zero != end) {
+			hi = MIN(USLAB_PAGE_UP(a, uslab_addr(a, zero)),
+			    USLAB_PAGE_DOWN(a, uslab_addr(a, end)));
+		} else {
+			hi = USLAB_PAGE_DOWN(a,
+			    uslab_addr(a, slab->base + j * a->size_class));
+		}
+		lo = USLAB_PAGE_UP(a, uslab_addr(a, obj));
+		if (c != NULL) {
+			uslab_cache_forget(c, slab, lo, hi);
+		}
+
+		if (prev == NULL) {
+			first = obj;
+		} else {
+			uslab_link(a, uslab_addr(a, prev))->next_free =
+			    obj;
+		}
+
+		for (k = i; k < j; k++, obj += a->size_class) {
+			uslab_link(a, uslab_addr(a, obj))->next_free =
+			    obj + a->size_class;
+		}
+		prev = obj;
+		released += uslab_release(a, lo, hi);
+	}
+
+	if (prev != NULL) {
+		uslab_link(a, uslab_addr(a, prev))->next_free = zero;
+	}
+	free(map);
+
+restore:
+	uslab_reattach(a, slab, first);
+	return released;
+}
+
+static size_t
+uslab_reclaim_all(struct uslab *a, struct uslab_cache *c)
+{
+	size_t released;
+	uint64_t i;
+
+	/*
+	 * The rseq fast path updates freelist heads without atomics, so only
+	 * code running on a region's CPU may touch its freelist.
+	 */
+	released = 0;
+	if (a->percpu_rseq) {
+		return 0;
+	}
+
+	for (i = 0; i < a->pt_slabs; i++) {
+		released += uslab_reclaim_pt(a, &uslab_pts(a)[i], c);
+	}
+
+	return released;
+}
+
+/*
+ * Return pages that hold only free objects to the operating system. This is
+ * safe with concurrent allocators and freers, but while a region is being
+ * scanned it appears empty, so allocations fall back to stealing from other
+ * regions and may fail if every other region is full. Objects cached in
+ * magazines are treated as allocated. Returns the number of bytes released.
+ * Slabs under an object cache must use uslab_cache_reclaim instead.
+ */
+size_t
+uslab_reclaim(struct uslab *a)
+{
+
+	return uslab_reclaim_all(a, NULL);
+}
+
+/*
+ * Create an object cache over a slab. An object is constructed by ctor the
+ * first time the cache hands it out, and stays constructed while it's free,
+ * so the next allocation only has to reset what its last user dirtied. dtor
+ * runs when the cache gives the object's memory back or is destroyed.
+ * Either may be NULL. ctor returns 0, or an errno value to fail the
+ * allocation.
+ *
+ * Freeing an object still overwrites its link, so slabs for caches usually
+ * move the link off the first word with USLAB_LINK, to a field that doesn't
+ * matter while the object is free. dtor finds the link there too, and
+ * whatever it writes to that field is undone. While the cache exists every allocation,
+ * free and reclaim of the slab's objects goes through it. The slab outlives
+ * it. Returns NULL with errno set on failure, EINVAL if the slab is
+ * USLAB_POISON, which would overwrite every free object.
+ */
+struct uslab_cache *
+uslab_cache_create(struct uslab *a, int (*ctor)(void *obj, void *arg),
+    void (*dtor)(void *obj, void *arg), void *arg)
+{
+	struct uslab_cache *c;
+	uint64_t nobj;
+
+	if (a->flags & USLAB_POISON) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	c = calloc(1, sizeof (*c));
+	if (c == NULL) {
+		return NULL;
+	}
+
+	nobj = a->pt_max * (a->pt_size / a->size_class);
+	c->constructed = calloc((nobj + 63) / 64, sizeof (*c->constructed));
+	if (c->constructed == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	c->slab = a;
+	c->ctor = ctor;
+	c->dtor = dtor;
+	c->arg = arg;
+	return c;
+}
+
+/*
+ * Allocate a constructed object. Returns NULL if the slab is empty, or with
+ * errno set to what ctor returned if it fails; the object goes back
+ * unconstructed.
+ */
+void *
+uslab_cache_alloc(struct uslab_cache *c)
+{
+	struct uslab *a = c->slab;
+	uint64_t i, *w;
+	void *p;
+	int r;
+
+	p = uslab_alloc(a);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	i = uslab_index(a, uslab_stored(a, p));
+	w = &c->constructed[i / 64];
+	if (ck_pr_load_64(w) & (1ULL << (i % 64))) {
+		return p;
+	}
+
+	if (c->ctor != NULL && (r = c->ctor(p, c->arg)) != 0) {
+		uslab_free(a, p);
+		errno = r;
+		return NULL;
+	}
+
+	ck_pr_or_64(w, 1ULL << (i % 64));
+	return p;
+}
+
+/* Free an object in the state its next user expects, less the link. */
+void
+uslab_cache_free(struct uslab_cache *c, void *p)
+{
+
+	uslab_free(c->slab, p);
+}
+
+/*
+ * uslab_reclaim for a cache's slab, destroying the free objects whose memory
+ * it releases. They're constructed again when next allocated.
+ */
+size_t
+uslab_cache_reclaim(struct uslab_cache *c)
+{
+
+	return uslab_reclaim_all(c->slab, c);
+}
+
+/*
+ * Destroy every object the cache constructed, which must all be free, and
+ * then the cache. The slab and its objects' memory stay.
+ */
+void
+uslab_cache_destroy(struct uslab_cache *c)
+{
+	struct uslab *a = c->slab;
+	uint64_t per, nobj, i;
+
+	per = a->pt_size / a->size_class;
+	nobj = a->pt_max * per;
+	for (i = 0; c->dtor != NULL && i < nobj; i++) {
+		if ((c->constructed[i / 64] & (1ULL << (i % 64))) == 0) {
+			continue;
+		}
+
+		uslab_cache_dtor(c, uslab_addr(a, uslab_pt_base(a, i / per) +
+		    i % per * a->size_class));
+	}
+
+	free(c->constructed);
+	free(c);
+}
+
+/*
+ * Take a snapshot of a slab: fill in st, and the first npt region entries of
+ * pt, and return the number of regions. Nothing is stopped while we read, so
+ * counts may be out of step with each other by whatever was in flight.
+ *
+ * Region counts are read from the regions. Objects on a region's remote list
+ * count as used until the region adopts them, and objects in magazines count
+ * as used. Per-CPU slabs charge the CPU doing the work rather than the
+ * region owning the object, or the owning region for threads without rseq,
+ * so their totals are exact but a region's count and mark only describe the
+ * work done on its CPU.
+ */
+uint64_t
+uslab_stats(struct uslab *a, struct uslab_stats *st, struct uslab_stats_pt *pt,
+    uint64_t npt)
+{
+	struct uslab_tstats *ts;
+	struct uslab_pt *slab;
+	uint64_t i, n, per, total;
+	int64_t used;
+
+	memset(st, 0, sizeof (*st));
+	st->size_class = a->size_class;
+	st->pt_slabs = n = ck_pr_load_64(&a->pt_slabs);
+
+	per = a->pt_size / a->size_class;
+	total = 0;
+	for (i = 0; i < n; i++) {
+		slab = &uslab_pts(a)[i];
+		used = (int64_t)(ck_pr_load_64(&slab->used) +
+		    ck_pr_load_64(&slab->remote_used));
+		total += used;
+		if (i < npt) {
+			used = MIN(MAX(used, 0), (int64_t)a->pt_size);
+			pt[i].used = used / a->size_class;
+			pt[i].free = per - pt[i].used;
+			pt[i].hwm = ck_pr_load_64(&slab->hwm) / a->size_class;
+		}
+	}
+	st->used = total / a->size_class;
+	st->free = n * per - st->used;
+
+	for (ts = ck_pr_load_ptr(&uslab_tstats_all); ts != NULL;
+	    ts = ck_pr_load_ptr(&ts->next)) {
+		if (ck_pr_load_64(&ts->serial) != a->serial ||
+		    ck_pr_load_ptr(&ts->slab) != a) {
+			continue;
+		}
+
+		ck_pr_fence_load();
+		st->allocs += ck_pr_load_64(&ts->allocs);
+		st->frees += ck_pr_load_64(&ts->frees);
+		st->retries += ck_pr_load_64(&ts->retries);
+		st->steals += ck_pr_load_64(&ts->steals);
+		st->ooms += ck_pr_load_64(&ts->ooms);
+	}
+
+	return n;
+}
+
+/*
+ * Free every object of a region that is neither on its freelist nor held,
+ * according to the caller. Returns how many we freed. We find the free
+ * objects by detaching the list, marking it in a bitmap and putting it back.
+ * If the list looks corrupt, we free nothing.
+ */
+static uint64_t
+uslab_shared_sweep(struct uslab *a, struct uslab_pt *slab,
+    bool (*held)(void *, void *), void *arg)
+{
+	char *end, *first, *cur, *next, *p;
+	uint64_t *map, nobj, i, n;
+
+	end = slab->base + slab->size;
+	nobj = slab->size / a->size_class;
+	map = calloc((nobj + 63) / 64, sizeof (*map));
+	if (map == NULL) {
+		return 0;
+	}
+
+	n = 0;
+	(void)uslab_adopt(a, slab);
+	first = uslab_detach(a, slab);
+	for (cur = first; cur != end; cur = next) {
+		if (cur < slab->base || cur > end ||
+		    (cur - slab->base) % a->size_class != 0) {
+			goto out;
+		}
+
+		i = (cur - slab->base) / a->size_class;
+		if ((map[i / 64] & (1ULL << (i % 64))) != 0) {
+			goto out;
+		}
+		map[i / 64] |= 1ULL << (i % 64);
+
+		next = uslab_link(a, uslab_addr(a, cur))->next_free;
+		if (next == NULL) {
+			/* Everything after a zero link is free. */
+			for (i++; i < nobj; i++) {
+				map[i / 64] |= 1ULL << (i % 64);
+			}
+			break;
+		}
+	}
+	uslab_reattach(a, slab, first);
+
+	for (i = 0; i < nobj; i++) {
+		if ((map[i / 64] & (1ULL << (i % 64))) != 0) {
+			continue;
+		}
+
+		p = uslab_addr(a, slab->base + i * a->size_class);
+		if (held(p, arg) == false) {
+			if (a->flags & USLAB_DEBUG) {
+				uslab_debug_mark(a,
+				    uslab_index(a, slab->base + i * a->size_class),
+				    1, false);
+			}
+			uslab_push_chain(a, slab, p, p, 1);
+			n++;
+		}
+	}
+
+	free(map);
+	return n;
+
+out:
+	uslab_reattach(a, slab, first);
+	free(map);
+	return 0;
+}
+
+/*
+ * Take back the regions of shared slab processes that have exited, so that
+ * other processes may claim them. If held is given, we also free every
+ * object allocated from those regions for which held returns false. Objects
+ * may have been passed to other processes, so only the application can tell
+ * whether anyone still refers to them; held must return true for anything
+ * that someone may still use or free. Returns the number of objects freed.
+ *
+ * Objects are attributed to the process that claimed the region they were
+ * allocated from, so threads of a process that had to share another
+ * process's region aren't covered. Nor are per-CPU slabs with rseq, whose
+ * freelists only their CPU may touch; their regions are released, but
+ * nothing is freed.
+ */
+uint64_t
+uslab_shared_recover(struct uslab *a, bool (*held)(void *p, void *arg),
+    void *arg)
+{
+	struct uslab_pt *slab;
+	uint64_t self, i, o, n;
+
+	n = 0;
+	self = uslab_owner_self();
+	for (i = 0; i < a->pt_slabs; i++) {
+		slab = &uslab_pts(a)[i];
+		o = ck_pr_load_64(&slab->owner);
+		if (o == 0 || o == self || uslab_owner_alive(o) == true) {
+			continue;
+		}
+
+		/*
+		 * Hold the region as our own while we sweep it, so that nobody
+		 * else claims or recovers it, then let it go.
+		 */
+		if (ck_pr_cas_64(&slab->owner, o, self) == false) {
+			continue;
+		}
+
+		if (held != NULL && a->percpu_rseq == 0) {
+			n += uslab_shared_sweep(a, slab, held, arg);
+		}
+		ck_pr_store_64(&slab->owner, 0);
+	}
+
+	return n;
+}
+
+/*
+ * Queues. USLAB_QUEUE slabs keep a bounded MPMC ring in the style of
+ * Vyukov's: every slot has a sequence number, equal to the position in the
+ * queue it may next be enqueued at while it's free, and to that position
+ * plus one once an object there is published. Producers claim positions by
+ * moving tail past them with a CAS, and consumers by moving head. Checking
+ * the sequence numbers of a run of slots before the CAS lets either side
+ * claim the whole run at once: nobody else can enqueue at a position before
+ * tail passes it, or dequeue before head does, so the slots we found free
+ * or published stay that way until our CAS succeeds. Neither side waits for
+ * the other, except that consumers can't get past a slot that has been
+ * claimed but not yet published.
+ *
+ * USLAB_QUEUE_SPSC slabs have one producer and one consumer, which own tail
+ * and head respectively and only ever load the other's. Each remembers the
+ * last value it saw of the other's index, so that they only touch each
+ * other's cacheline when the queue looks full or empty.
+ *
+ * Slots hold objects as stored, so queues work in relocatable slabs, and
+ * persist in ramdisk slabs. Objects are passed by reference; the queue
+ * never looks inside them.
+ */
+static inline struct uslab_queue *
+uslab_queue(struct uslab *a)
+{
+
+	return (struct uslab_queue *)uslab_addr(a, a->queue);
+}
+
+static inline struct uslab_queue_slot *
+uslab_queue_slot(struct uslab *a, uint64_t pos)
+{
+
+	return (struct uslab_queue_slot *)(uslab_queue(a) + 1) +
+	    (pos & a->queue_mask);
+}
+
+/* Sequence numbers are stored less the slot index. */
+static inline uint64_t
+uslab_queue_seq(struct uslab *a, struct uslab_queue_slot *slot, uint64_t pos)
+{
+
+	return ck_pr_load_64(&slot->seq) + (pos & a->queue_mask);
+}
+
+static inline void
+uslab_queue_publish(struct uslab *a, struct uslab_queue_slot *slot,
+    uint64_t pos, uint64_t seq)
+{
+
+	ck_pr_store_64(&slot->seq, seq - (pos & a->queue_mask));
+}
+
+static uint64_t
+uslab_mpmc_enqueue(struct uslab *a, void **objs, uint64_t n)
+{
+	struct uslab_queue_slot *slot;
+	struct uslab_queue *q;
+	uint64_t pos, seq, i, k;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	q = uslab_queue(a);
+	pos = ck_pr_load_64(&q->tail);
+	for (;;) {
+		for (k = 0; k < n; k++) {
+			seq = uslab_queue_seq(a, uslab_queue_slot(a, pos + k),
+			    pos + k);
+			if (seq != pos + k) {
+				break;
+			}
+		}
+
+		if (k > 0) {
+			if (ck_pr_cas_64_value(&q->tail, pos, pos + k,
+			    &pos) == true) {
+				break;
+			}
+			continue;
+		}
+
+		/* The slot still holds an object from the last lap. */
+		if ((int64_t)(seq - pos) < 0) {
+			return 0;
+		}
+		pos = ck_pr_load_64(&q->tail);
+	}
+
+	ck_pr_fence_acquire();
+	for (i = 0; i < k; i++) {
+		slot = uslab_queue_slot(a, pos + i);
+		ck_pr_store_ptr(&slot->obj, uslab_stored(a, objs[i]));
+		ck_pr_fence_store();
+		uslab_queue_publish(a, slot, pos + i, pos + i + 1);
+	}
+
+	return k;
+}
+
+static uint64_t
+uslab_mpmc_dequeue(struct uslab *a, void **objs, uint64_t n)
+{
+	struct uslab_queue_slot *slot;
+	struct uslab_queue *q;
+	uint64_t pos, seq, i, k;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	q = uslab_queue(a);
+	pos = ck_pr_load_64(&q->head);
+	for (;;) {
+		for (k = 0; k < n; k++) {
+			seq = uslab_queue_seq(a, uslab_queue_slot(a, pos + k),
+			    pos + k);
+			if (seq != pos + k + 1) {
+				break;
+			}
+		}
+
+		if (k > 0) {
+			if (ck_pr_cas_64_value(&q->head, pos, pos + k,
+			    &pos) == true) {
+				break;
+			}
+			continue;
+		}
+
+		/* Nothing has been published at head yet. */
+		if ((int64_t)(seq - (pos + 1)) < 0) {
+			return 0;
+		}
+		pos = ck_pr_load_64(&q->head);
+	}
+
+	ck_pr_fence_acquire();
+	for (i = 0; i < k; i++) {
+		slot = uslab_queue_slot(a, pos + i);
+		objs[i] = uslab_addr(a, ck_pr_load_ptr(&slot->obj));
+		ck_pr_store_ptr(&slot->obj, NULL);
+		ck_pr_fence_release();
+		uslab_queue_publish(a, slot, pos + i,
+		    pos + i + a->queue_mask + 1);
+	}
+
+	return k;
+}
+
+static uint64_t
+uslab_spsc_enqueue(struct uslab *a, void **objs, uint64_t n)
+{
+	struct uslab_queue *q;
+	uint64_t t, i, k;
+	char **slots;
+
+	q = uslab_queue(a);
+	slots = (char **)(q + 1);
+	t = ck_pr_load_64(&q->tail);
+	if (a->queue_mask + 1 - (t - q->seen_head) < n) {
+		q->seen_head = ck_pr_load_64(&q->head);
+		ck_pr_fence_acquire();
+	}
+
+	k = MIN(n, a->queue_mask + 1 - (t - q->seen_head));
+	for (i = 0; i < k; i++) {
+		slots[(t + i) & a->queue_mask] = uslab_stored(a, objs[i]);
+	}
+	ck_pr_fence_store();
+	ck_pr_store_64(&q->tail, t + k);
+
+	return k;
+}
+
+static uint64_t
+uslab_spsc_dequeue(struct uslab *a, void **objs, uint64_t n)
+{
+	struct uslab_queue *q;
+	uint64_t h, i, k;
+	char **slots;
+
+	q = uslab_queue(a);
+	slots = (char **)(q + 1);
+	h = ck_pr_load_64(&q->head);
+	if (q->seen_tail - h < n) {
+		q->seen_tail = ck_pr_load_64(&q->tail);
+		ck_pr_fence_load();
+	}
+
+	k = MIN(n, q->seen_tail - h);
+	for (i = 0; i < k; i++) {
+		objs[i] = uslab_addr(a, slots[(h + i) & a->queue_mask]);
+	}
+	ck_pr_fence_release();
+	ck_pr_store_64(&q->head, h + k);
+
+	return k;
+}
+
+/*
+ * Enqueue up to n objects of the slab, in order, and return how many we
+ * enqueued. Slabs created without a queue flag enqueue nothing.
+ */
+uint64_t
+uslab_enqueue_bulk(struct uslab *a, void **p, uint64_t n)
+{
+
+	if (a->flags & USLAB_QUEUE) {
+		return uslab_mpmc_enqueue(a, p, n);
+	} else if (a->flags & USLAB_QUEUE_SPSC) {
+		return uslab_spsc_enqueue(a, p, n);
+	}
+
+	return 0;
+}
+
+/*
+ * Dequeue up to n objects into p, oldest first, and return how many we
+ * dequeued.
+ */
+uint64_t
+uslab_dequeue_bulk(struct uslab *a, void **p, uint64_t n)
+{
+
+	if (a->flags & USLAB_QUEUE) {
+		return uslab_mpmc_dequeue(a, p, n);
+	} else if (a->flags & USLAB_QUEUE_SPSC) {
+		return uslab_spsc_dequeue(a, p, n);
+	}
+
+	return 0;
+}
+
+bool
+uslab_enqueue(struct uslab *a, void *p)
+{
+
+	return uslab_enqueue_bulk(a, &p, 1) == 1;
+}
+
+void *
+uslab_dequeue(struct uslab *a)
+{
+	void *p;
+
+	return (uslab_dequeue_bulk(a, &p, 1) == 1) ? p : NULL;
+}
+
+/*
+ * The number of objects in the queue, which may be out of date by the time
+ * we return if others are using it.
+ */
+uint64_t
+uslab_queued(struct uslab *a)
+{
+	struct uslab_queue *q;
+	uint64_t h, t;
+
+	if ((a->flags & USLAB_QUEUE_FLAGS) == 0) {
+		return 0;
+	}
+
+	q = uslab_queue(a);
+	h = ck_pr_load_64(&q->head);
+	ck_pr_fence_load();
+	t = ck_pr_load_64(&q->tail);
+
+	return (t - h <= a->queue_mask + 1) ? t - h : 0;
+}
+
+/*
+ * Size-class sets. A set is a single mapping holding a header page followed
+ * by one complete slab per size class, each occupying exactly class_len
+ * bytes. Classes run from min_size in steps of powers of two with one
+ * intermediate step in between (16, 24, 32, 48, 64, ...), so no allocation
+ * wastes more than a third of its object.
+ *
+ * Because every class occupies the same number of bytes, the class that owns
+ * a pointer follows from its offset alone and no per-object header is
+ * needed.
+ */
+static size_t
+uslab_set_class_size(struct uslab_set *s, unsigned int idx)
+{
+
+	if (idx & 1) {
+		return (3 * (s->min_size << (idx / 2))) / 2;
+	}
+
+	return s->min_size << (idx / 2);
+}
+
+static inline unsigned int
+uslab_set_class(struct uslab_set *s, size_t size)
+{
+	unsigned int lg;
+
+	if (size <= s->min_size) {
+		return 0;
+	}
+
+	lg = 63 - __builtin_clzll(size - 1);
+	return 2 * (lg - s->min_shift) + 1 + (size > (3ULL << (lg - 1)));
+}
+
+/*
+ * How many objects of a class fit in class_len bytes. USLAB_DEBUG classes
+ * also need a byte for each in their map, aligned to a cacheline.
+ */
+static uint64_t
+uslab_set_nelem(size_t size, size_t class_len, size_t hdr_len,
+    unsigned int flags)
+{
+	size_t avail;
+
+	if (class_len <= hdr_len) {
+		return 0;
+	}
+
+	avail = class_len - hdr_len;
+	if ((flags & USLAB_DEBUG) == 0) {
+		return avail / size;
+	}
+
+	if (avail <= 64) {
+		return 0;
+	}
+
+	return (avail - 64) / (size + 1);
+}
+
+struct uslab_set *
+uslab_set_create_anonymous(void *base, size_t min_size, size_t max_size,
+    size_t class_len, uint64_t npt_slabs, unsigned int flags)
+{
+	int mflags = MAP_ANONYMOUS | MAP_PRIVATE;
+	unsigned int i, nclasses;
+	struct uslab_set *s, t;
+	size_t size, map_len, hdr_len;
+	char *cur;
+	void *map;
+
+	if (min_size < 16 || (min_size & (min_size - 1)) != 0 ||
+	    max_size < min_size ||
+	    (flags & (USLAB_HUGE_FLAGS | USLAB_QUEUE_FLAGS | USLAB_COLOR |
+	    USLAB_ALIGN_MASK)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	t.min_size = min_size;
+	t.min_shift = __builtin_ctzll(min_size);
+	nclasses = uslab_set_class(&t, max_size) + 1;
+	if (nclasses > USLAB_SET_MAX_CLASSES) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	class_len = (class_len + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+	hdr_len = uslab_hdr_len(npt_slabs, flags);
+	for (i = 0; i < nclasses; i++) {
+		size = uslab_set_class_size(&t, i);
+		if (uslab_valid(size, uslab_set_nelem(size, class_len, hdr_len,
+		    flags), npt_slabs, flags) == false) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	if (base != NULL) {
+		mflags |= MAP_FIXED;
+	}
+
+	map_len = PAGE_SIZE + nclasses * class_len;
+	map = mmap(base, map_len, PROT_READ | PROT_WRITE, mflags, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	s = map;
+	s->min_size = min_size;
+	s->min_shift = t.min_shift;
+	s->nclasses = nclasses;
+	s->class_len = class_len;
+	uslab_div_init(&s->class_div, class_len);
+	s->map_len = map_len;
+	s->classes_base = cur = ((char *)s) + PAGE_SIZE;
+
+	for (i = 0; i < nclasses; i++) {
+		size = uslab_set_class_size(s, i);
+		s->classes[i] = (struct uslab *)cur;
+		uslab_init(s->classes[i], size, uslab_set_nelem(size,
+		    class_len, hdr_len, flags), npt_slabs, npt_slabs, flags, true);
+		s->classes[i]->backing = USLAB_BACKING_ANONYMOUS;
+		cur += class_len;
+	}
+
+	return s;
+}
+
+void
+uslab_set_destroy(struct uslab_set *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->nclasses; i++) {
+		uslab_tstats_release(s->classes[i]);
+		uslab_trace_release(s->classes[i]);
+	}
+	munmap(s, s->map_len);
+}
+
+/*
+ * Returns the size of the objects that uslab_set_alloc would hand out for
+ * the given size, or 0 if the set can't serve it.
+ */
+size_t
+uslab_set_size(struct uslab_set *s, size_t size)
+{
+	unsigned int idx;
+
+	idx = uslab_set_class(s, size);
+	if (idx >= s->nclasses) {
+		return 0;
+	}
+
+	return s->classes[idx]->size_class;
+}
+
+size_t
+uslab_set_reclaim(struct uslab_set *s)
+{
+	size_t released;
+	unsigned int i;
+
+	released = 0;
+	for (i = 0; i < s->nclasses; i++) {
+		released += uslab_reclaim(s->classes[i]);
+	}
+
+	return released;
+}
+
+void *
+uslab_set_alloc(struct uslab_set *s, size_t size)
+{
+	unsigned int idx;
+
+	idx = uslab_set_class(s, size);
+	if (idx >= s->nclasses) {
+		return NULL;
+	}
+
+	return uslab_alloc(s->classes[idx]);
+}
+
+void
+uslab_set_free(struct uslab_set *s, void *p)
+{
+
+	if (p == NULL) return;
 
-	ck_pr_sub_64(&allocated_slab->used, a->size_class);
+	uslab_free(s->classes[uslab_div(&s->class_div,
+	    ((char *)p) - s->classes_base)], p);
 }
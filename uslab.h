@@ -18,53 +18,400 @@
 #ifndef _USLAB_H_
 #define _USLAB_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct uslab_pt {
 	/*
 	 * first_free and generation *must* be contiguous so that CAS2 can
 	 * update both to avoid ABA conflicts on concurrent allocations.
+	 *
+	 * Slabs created with USLAB_TAGGED keep the offset of the first free
+	 * object from base and a generation count together in head instead,
+	 * and leave generation unused.
 	 */
-	char	*first_free;
+	union {
+		char		*first_free;
+		uint64_t	head;
+	};
 	char	*generation;
 	size_t	size;
 	size_t	used;
 	size_t	offset;
 
 	char	 *base;
+	uint64_t node;
 	/*
-	 * Keep this cacheline-sized, otherwise false sharing will kill
-	 * throughput in threads in adjacent uslabs.
+	 * Slabs created with USLAB_STATS: the most used has ever been. The
+	 * fields up to here fill a cacheline; keep it that way, otherwise
+	 * false sharing will kill throughput in threads in adjacent uslabs.
 	 */
-	char	pad[64 - 48];
+	size_t	hwm;
+
+	/*
+	 * Per-CPU slabs and USLAB_REMOTE slabs: objects freed to this region
+	 * by threads running on other CPUs, or by threads other than those
+	 * allocating from it. This is a freelist in the CAS2 format, kept on
+	 * its own cacheline so that remote frees don't disturb the owner.
+	 */
+	char	*remote;
+	char	*remote_generation;
+
+	/*
+	 * Shared slabs: the process that claimed this region, as its pid and
+	 * start time, or zero.
+	 */
+	uint64_t owner;
+
+	/*
+	 * Per-CPU slabs with rseq: used, as charged by threads that can't
+	 * run rseq and so may only update it atomically.
+	 */
+	size_t	remote_used;
+	char	pad_remote[64 - 32];
 };
 
+/*
+ * The region the calling thread allocates from. The library provides this;
+ * applications that still define it themselves keep working.
+ */
 extern __thread struct uslab_pt *uslab_pt;
 
+/*
+ * A free object. A zero link means the adjacent object is next. Like every
+ * address stored in a relocatable slab, links there are offsets from the
+ * slab header.
+ */
 struct uslab_entry {
 	char *next_free;
 };
 
+/*
+ * Flags accepted by the uslab_create_* family.
+ */
+#define	USLAB_MAGAZINE		0x0001	/* Cache objects in per-thread magazines */
+#define	USLAB_TAGGED		0x0002	/* Single-word tagged freelist heads */
+#define	USLAB_NUMA		0x0004	/* Place regions and threads by NUMA node */
+#define	USLAB_PERCPU		0x0008	/* One region per CPU */
+#define	USLAB_HUGE_2MB		0x0010	/* Back with 2 MiB hugetlb pages */
+#define	USLAB_HUGE_1GB		0x0020	/* Back with 1 GiB hugetlb pages */
+#define	USLAB_THP		0x0040	/* Ask for transparent huge pages */
+#define	USLAB_REPAIR		0x0080	/* Repair corrupt ramdisk slabs on reopen */
+#define	USLAB_RELOCATABLE	0x0100	/* Store offsets, map anywhere */
+#define	USLAB_REMOTE		0x0200	/* Defer frees to other threads' regions */
+#define	USLAB_QUEUE		0x0400	/* Queue of objects, MPMC */
+#define	USLAB_QUEUE_SPSC	0x0800	/* Queue of objects, SPSC */
+#define	USLAB_STATS		0x1000	/* Count operations per thread */
+#define	USLAB_DEBUG		0x2000	/* Abort on double and stray frees */
+#define	USLAB_POISON		0x4000	/* With USLAB_DEBUG, poison free objects */
+#define	USLAB_COLOR		0x8000	/* Start each region at a different color */
+
+/*
+ * Free objects keep their freelist link in their first word, or off bytes
+ * in with USLAB_LINK(off), so that an object cache can leave the rest of
+ * them constructed. off must be a multiple of the size of a pointer, below
+ * 32 KiB, and leave room for the link in the object.
+ */
+#define	USLAB_LINK_SHIFT	16
+#define	USLAB_LINK_MASK		0x0fff0000U
+#define	USLAB_LINK(off)		((unsigned int)((off) / sizeof (void *)) << USLAB_LINK_SHIFT)
+#define	USLAB_LINK_OFFSET(flags) \
+	((((flags) & USLAB_LINK_MASK) >> USLAB_LINK_SHIFT) * sizeof (void *))
+
+/*
+ * USLAB_ALIGN(align) rounds the object size up to a multiple of align, a
+ * power of two of at most a page, so that objects don't straddle more
+ * cachelines than they must.
+ */
+#define	USLAB_ALIGN_SHIFT	28
+#define	USLAB_ALIGN_MASK	0xf0000000U
+#define	USLAB_ALIGN(align)	((unsigned int)__builtin_ctz(align) << USLAB_ALIGN_SHIFT)
+#define	USLAB_ALIGNMENT(flags) \
+	((size_t)1 << (((flags) & USLAB_ALIGN_MASK) >> USLAB_ALIGN_SHIFT))
+
+/*
+ * USLAB_COLOR slabs start region i (i * color) % USLAB_COLOR_SPAN bytes into
+ * its stride, where color is a cacheline, or the alignment if that's bigger,
+ * so that the regions' first objects fall in different sets of caches with
+ * 4 KiB ways. Each region's stride grows by USLAB_COLOR_SPAN to make room.
+ */
+#define	USLAB_COLOR_SPAN	4096
+
+#define	USLAB_HUGE_FLAGS	(USLAB_HUGE_2MB | USLAB_HUGE_1GB | USLAB_THP)
+#define	USLAB_QUEUE_FLAGS	(USLAB_QUEUE | USLAB_QUEUE_SPSC)
+
+/*
+ * Tagged heads must leave at least this many bits of generation count after
+ * the region offset, or slab creation fails with EINVAL.
+ */
+#define	USLAB_TAG_MIN_BITS	16
+
+/* NUMA slabs spread their regions over at most this many nodes. */
+#define	USLAB_MAX_NODES		64
+
+/*
+ * Per-thread magazines hold USLAB_MAGAZINE_SIZE objects. They are filled and
+ * drained half a magazine at a time.
+ */
+#define	USLAB_MAGAZINE_SIZE	64
+
+/*
+ * A divisor, prepared by uslab_div_init so that uslab_div divides by it with
+ * a multiply and shifts instead of a division, in the style of libdivide:
+ * with a shift alone for powers of two, where magic is zero, and otherwise
+ * with a multiply by a rounded-up reciprocal, plus a fixup for divisors
+ * whose reciprocal needs 65 bits.
+ */
+struct uslab_div {
+	uint64_t	magic;
+	uint64_t	d;
+	uint32_t	shift;
+	uint32_t	add;
+};
+
+static inline uint64_t
+uslab_div(const struct uslab_div *v, uint64_t n)
+{
+	uint64_t q;
+
+	if (v->magic == 0) {
+		return n >> v->shift;
+	}
+
+	q = (uint64_t)(((unsigned __int128)v->magic * n) >> 64);
+	if (v->add != 0) {
+		q += (n - q) >> 1;
+	}
+
+	return q >> v->shift;
+}
+
+enum uslab_backing {
+	USLAB_BACKING_HEAP,
+	USLAB_BACKING_ANONYMOUS,
+	USLAB_BACKING_RAMDISK,
+	USLAB_BACKING_SHARED,
+};
+
 struct uslab {
+	uint64_t	magic;
+
+	/*
+	 * Relocatable slabs store these, the region bases and freelist links
+	 * as offsets from the slab header. reloc_mask is all ones for them and
+	 * zero otherwise.
+	 */
 	struct uslab_pt	*pt_base;
 	char		*slab0_base;
+	uintptr_t	reloc_mask;
 
 	uint64_t	size_class;
 	size_t		slab_len;
 	uint64_t	pt_slabs;
+	uint64_t	pt_max;
 	size_t		pt_size;
+	size_t		pt_stride;
+	size_t		pt_color;	/* USLAB_COLOR slabs, or zero */
 	uint64_t	pt_ctr;
+
+	/* pt_stride and size_class as divisors. */
+	struct uslab_div pt_div;
+	struct uslab_div size_div;
+	size_t		page_size;
+
+	unsigned int	flags;
+	uint64_t	serial;
+	unsigned int	tag_shift;
+	uint64_t	tag_mask;
+
+	/*
+	 * Queue slabs: the queue, as stored, and the number of slots in it
+	 * less one.
+	 */
+	char		*queue;
+	uint64_t	queue_mask;
+
+	/*
+	 * USLAB_DEBUG slabs: a byte for each object, by index, that is set
+	 * while it is allocated, as stored.
+	 */
+	uint8_t		*debug_map;
+
+	/* Where in a free object its link is; see USLAB_LINK. */
+	size_t		link_offset;
+
+	enum uslab_backing backing;
+
+	unsigned int	percpu_rseq;
+
+	unsigned int	numa_nnodes;
+	uint32_t	numa_nodes[USLAB_MAX_NODES];
+	uint64_t	numa_ctr[USLAB_MAX_NODES];
+};
+
+/*
+ * A snapshot of a slab, filled in by uslab_stats. Object counts of regions
+ * come from the regions themselves. High-water marks and operation counts
+ * are only kept by slabs created with USLAB_STATS, and are zero for others.
+ * High-water marks are kept by the regions. Operation counts are kept per
+ * thread, and summed over every thread of the calling process that has used
+ * the slab.
+ */
+struct uslab_stats_pt {
+	uint64_t	used;		/* Objects allocated, in objects */
+	uint64_t	free;		/* Objects free */
+	uint64_t	hwm;		/* Most objects ever allocated at once */
 };
 
+struct uslab_stats {
+	uint64_t	size_class;
+	uint64_t	pt_slabs;	/* Regions in use */
+	uint64_t	used;		/* Sum over all regions */
+	uint64_t	free;
+
+	uint64_t	allocs;		/* Objects handed out */
+	uint64_t	frees;		/* Objects given back */
+	uint64_t	retries;	/* Failed freelist CAS2 or CAS */
+	uint64_t	steals;		/* Objects taken from other regions */
+	uint64_t	ooms;		/* Allocations that came back short */
+};
+
+/*
+ * Traces written by uslab_trace_start: a header, then one record per object
+ * allocated or freed, and per allocation that failed. Records are grouped
+ * by thread, in the order each thread made its calls, but not ordered
+ * between threads. Times are in ticks of the TSC on x86-64, and nanoseconds
+ * of CLOCK_MONOTONIC elsewhere; the header gives both clocks at the start
+ * and end of the trace, to convert between them. Allocations are stamped
+ * once the object is ours, and frees before it is given back, so that an
+ * object's free always comes before its next allocation.
+ *
+ * Objects are identified by their index in the slab, counting from zero;
+ * every index is below nobjs. Threads are numbered from zero in the order
+ * they first made a traced call.
+ */
+#define	USLAB_TRACE_MAGIC	0x75736c6174720001ULL
+
+#define	USLAB_TRACE_ALLOC	1
+#define	USLAB_TRACE_FREE	2
+#define	USLAB_TRACE_OOM		3	/* A failed allocation, index 0 */
+
+#define	USLAB_TRACE_OP(w)	((unsigned int)((w) & 0xf))
+#define	USLAB_TRACE_TID(w)	((uint64_t)(((w) >> 4) & 0xfffff))
+#define	USLAB_TRACE_INDEX(w)	((uint64_t)((w) >> 24))
+#define	USLAB_TRACE_WORD(op, tid, index) \
+	((uint64_t)(op) | ((uint64_t)(tid) << 4) | ((uint64_t)(index) << 24))
+
+struct uslab_trace_hdr {
+	uint64_t	magic;
+	uint64_t	size_class;
+	uint64_t	nelem;		/* Objects in the initial regions */
+	uint64_t	pt_slabs;
+	uint64_t	nobjs;		/* Bound on object indices */
+	uint64_t	flags;
+	uint64_t	nthreads;
+	uint64_t	nrecs;
+	uint64_t	dropped;	/* Calls lost for want of memory */
+	uint64_t	start_ticks;
+	uint64_t	start_ns;
+	uint64_t	stop_ticks;
+	uint64_t	stop_ns;
+};
+
+struct uslab_trace_rec {
+	uint64_t	ticks;
+	uint64_t	word;		/* Op, thread and index */
+};
+
+/*
+ * A family of slabs serving size classes from min_size up, packed into one
+ * mapping. Each class occupies class_len bytes, including its own header.
+ */
+#define	USLAB_SET_MAX_CLASSES	64
+
+struct uslab_set {
+	size_t		min_size;
+	unsigned int	min_shift;
+	unsigned int	nclasses;
+	size_t		class_len;
+	struct uslab_div class_div;	/* class_len as a divisor */
+	size_t		map_len;
+	char		*classes_base;
+	struct uslab	*classes[USLAB_SET_MAX_CLASSES];
+};
+
+/*
+ * An object cache over a slab, whose objects stay constructed while they're
+ * free. Process-local: it lives on the heap, not in the slab.
+ */
+struct uslab_cache {
+	struct uslab	*slab;
+	int		(*ctor)(void *obj, void *arg);
+	void		(*dtor)(void *obj, void *arg);
+	void		*arg;
+
+	/* The objects that have been constructed, by index. */
+	uint64_t	*constructed;
+};
+
+void		uslab_div_init(struct uslab_div *, uint64_t d);
+
 struct uslab	*uslab_create_anonymous(void *base, size_t size_class, uint64_t nelem, uint64_t npt_slabs);
 struct uslab 	*uslab_create_heap(size_t size_class, uint64_t nelem, uint64_t npt_slabs);
 struct uslab 	*uslab_create_ramdisk(const char *path, void *base, size_t size_class, uint64_t nelem, uint64_t npt_slabs);
+struct uslab	*uslab_create_anonymous_flags(void *base, size_t size_class, uint64_t nelem, uint64_t npt_slabs, unsigned int flags);
+struct uslab 	*uslab_create_heap_flags(size_t size_class, uint64_t nelem, uint64_t npt_slabs, unsigned int flags);
+struct uslab 	*uslab_create_ramdisk_flags(const char *path, void *base, size_t size_class, uint64_t nelem, uint64_t npt_slabs, unsigned int flags);
+struct uslab	*uslab_create_growable(void *base, size_t size_class, uint64_t nelem, uint64_t npt_slabs, uint64_t max_nelem, unsigned int flags);
+struct uslab	*uslab_create_shared(const char *name, size_t size_class, uint64_t nelem, uint64_t npt_slabs, unsigned int flags, int *fd);
+struct uslab	*uslab_attach_shared(int fd);
+uint64_t	uslab_shared_recover(struct uslab *, bool (*held)(void *p, void *arg), void *arg);
 
 void		*uslab_alloc(struct uslab *);
 void		uslab_free(struct uslab *, void *p);
 
+uint64_t	uslab_alloc_bulk(struct uslab *, void **p, uint64_t n);
+void		uslab_free_bulk(struct uslab *, void **p, uint64_t n);
+
+void		uslab_magazine_flush(struct uslab *);
+
+bool		uslab_enqueue(struct uslab *, void *p);
+void		*uslab_dequeue(struct uslab *);
+uint64_t	uslab_enqueue_bulk(struct uslab *, void **p, uint64_t n);
+uint64_t	uslab_dequeue_bulk(struct uslab *, void **p, uint64_t n);
+uint64_t	uslab_queued(struct uslab *);
+
+size_t		uslab_reclaim(struct uslab *);
+
+uint64_t	uslab_stats(struct uslab *, struct uslab_stats *st, struct uslab_stats_pt *pt, uint64_t npt);
+
+bool		uslab_trace_start(struct uslab *, int fd);
+bool		uslab_trace_stop(struct uslab *);
+
+struct uslab_set *uslab_set_create_anonymous(void *base, size_t min_size, size_t max_size, size_t class_len, uint64_t npt_slabs, unsigned int flags);
+void		uslab_set_destroy(struct uslab_set *);
+size_t		uslab_set_reclaim(struct uslab_set *);
+
+size_t		uslab_set_size(struct uslab_set *, size_t size);
+void		*uslab_set_alloc(struct uslab_set *, size_t size);
+void		uslab_set_free(struct uslab_set *, void *p);
+
+struct uslab_cache *uslab_cache_create(struct uslab *, int (*ctor)(void *obj, void *arg), void (*dtor)(void *obj, void *arg), void *arg);
+void		*uslab_cache_alloc(struct uslab_cache *);
+void		uslab_cache_free(struct uslab_cache *, void *p);
+size_t		uslab_cache_reclaim(struct uslab_cache *);
+void		uslab_cache_destroy(struct uslab_cache *);
+
 void		uslab_destroy_heap(struct uslab *);
 void		uslab_destroy_map(struct uslab *);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
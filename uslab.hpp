@@ -0,0 +1,436 @@
+/*
+ * Copyright 2015 Fastly, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Typed object pools, and allocators for standard containers, over uslab
+ * for C++11 and later; std::pmr needs C++17. Names keep the uslab_ prefix
+ * rather than living in namespace uslab, which C++ won't have alongside
+ * struct uslab. Everything here is inline over the C calls in uslab.h;
+ * there is nothing to link but the library itself.
+ */
+
+#ifndef _USLAB_HPP_
+#define _USLAB_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+#define	USLAB_HAVE_PMR	1
+#endif
+
+#include "uslab.h"
+
+/*
+ * A pool of T. Objects are sizeof (T) rounded up to alignof (T), and never
+ * smaller than a freelist link. A slab the pool creates itself is mapped, so
+ * its objects are aligned for any T aligned to a page or less. Its memory
+ * goes back when the pool is destroyed, whatever is still allocated; objects
+ * and handles must not outlive it.
+ *
+ * make constructs an object and returns a handle, a std::unique_ptr whose
+ * deleter destroys the object and frees it to the pool. create and destroy
+ * are the same without the handle. The _bulk calls construct or destroy
+ * many objects at a time, moving them in and out of the slab with
+ * uslab_alloc_bulk and uslab_free_bulk. Allocations that find the slab
+ * empty throw std::bad_alloc, except for the _bulk ones, which make as
+ * many objects as they can and return how many. If a constructor throws,
+ * the objects built so far are destroyed, everything allocated is freed,
+ * and the exception propagates.
+ */
+template <typename T>
+class uslab_pool {
+public:
+	static_assert(alignof (T) <= 4096, "uslab objects are page aligned at most");
+
+	static constexpr size_t size_class =
+	    ((sizeof (T) > sizeof (struct uslab_entry) ? sizeof (T) :
+	    sizeof (struct uslab_entry)) + alignof (T) - 1) / alignof (T) *
+	    alignof (T);
+
+	struct deleter {
+		struct uslab *slab;
+
+		void operator()(T *p) const noexcept
+		{
+
+			p->~T();
+			uslab_free(slab, p);
+		}
+	};
+
+	typedef std::unique_ptr<T, deleter> handle;
+
+	/*
+	 * A pool of its own anonymous slab, aligned for T unless flags ask
+	 * for more.
+	 */
+	uslab_pool(uint64_t nelem, uint64_t npt_slabs, unsigned int flags = 0)
+	    : slab_(uslab_create_anonymous_flags(nullptr, size_class, nelem,
+	    npt_slabs, (flags & USLAB_ALIGN_MASK) ? flags :
+	    flags | USLAB_ALIGN(alignof (T)))), owned_(true)
+	{
+
+		if (slab_ == nullptr) {
+			throw std::system_error(errno, std::generic_category(),
+			    "uslab_create_anonymous_flags");
+		}
+	}
+
+	/*
+	 * A pool over a slab someone else created, and will destroy. Its
+	 * objects must be big enough and aligned for T.
+	 */
+	explicit uslab_pool(struct uslab *a) : slab_(a), owned_(false)
+	{
+		uintptr_t base;
+
+		base = (uintptr_t)a->slab0_base +
+		    ((a->flags & USLAB_RELOCATABLE) ? (uintptr_t)a : 0);
+		if (a->size_class < sizeof (T) ||
+		    a->size_class % alignof (T) != 0 ||
+		    base % alignof (T) != 0 || a->pt_color % alignof (T) != 0) {
+			throw std::invalid_argument("slab objects don't fit T");
+		}
+	}
+
+	~uslab_pool()
+	{
+
+		if (owned_ == true) {
+			uslab_destroy_map(slab_);
+		}
+	}
+
+	uslab_pool(const uslab_pool &) = delete;
+	uslab_pool &operator=(const uslab_pool &) = delete;
+
+	struct uslab *
+	slab() const noexcept
+	{
+
+		return slab_;
+	}
+
+	template <typename... Args>
+	T *
+	create(Args &&...args)
+	{
+		void *p;
+
+		p = uslab_alloc(slab_);
+		if (p == nullptr) {
+			throw std::bad_alloc();
+		}
+
+		try {
+			return ::new (p) T(std::forward<Args>(args)...);
+		} catch (...) {
+			uslab_free(slab_, p);
+			throw;
+		}
+	}
+
+	void
+	destroy(T *p) noexcept
+	{
+
+		if (p != nullptr) {
+			deleter{slab_}(p);
+		}
+	}
+
+	template <typename... Args>
+	handle
+	make(Args &&...args)
+	{
+
+		return handle(create(std::forward<Args>(args)...),
+		    deleter{slab_});
+	}
+
+	/*
+	 * Construct up to n objects into p, each from the same arguments.
+	 * Returns how many there are.
+	 */
+	template <typename... Args>
+	uint64_t
+	create_bulk(T **p, uint64_t n, const Args &...args)
+	{
+		uint64_t got, i;
+
+		got = uslab_alloc_bulk(slab_, reinterpret_cast<void **>(p), n);
+		i = 0;
+		try {
+			for (; i < got; i++) {
+				::new ((void *)p[i]) T(args...);
+			}
+		} catch (...) {
+			while (i > 0) {
+				p[--i]->~T();
+			}
+			uslab_free_bulk(slab_, reinterpret_cast<void **>(p),
+			    got);
+			throw;
+		}
+
+		return got;
+	}
+
+	void
+	destroy_bulk(T **p, uint64_t n) noexcept
+	{
+
+		for (uint64_t i = 0; i < n; i++) {
+			p[i]->~T();
+		}
+		uslab_free_bulk(slab_, reinterpret_cast<void **>(p), n);
+	}
+
+	/* create_bulk, with each object in a handle of its own. */
+	template <typename... Args>
+	uint64_t
+	make_bulk(handle *h, uint64_t n, const Args &...args)
+	{
+		T *p[64];
+		uint64_t got, want, k, i;
+
+		for (got = 0; got < n; got += k) {
+			want = std::min<uint64_t>(n - got, 64);
+			k = create_bulk(p, want, args...);
+			for (i = 0; i < k; i++) {
+				h[got + i] = handle(p[i], deleter{slab_});
+			}
+			if (k < want) {
+				return got + k;
+			}
+		}
+
+		return got;
+	}
+
+private:
+	struct uslab	*slab_;
+	bool		owned_;
+};
+
+template <typename T>
+constexpr size_t uslab_pool<T>::size_class;
+
+/*
+ * Size-class sets serve the allocators below. A class's objects are aligned
+ * to the largest power of two dividing its size, up to a page, so rounding
+ * the size up to the alignment gets a class that is aligned enough.
+ * Returns NULL if the set has no class that big, or it's full, or if the
+ * alignment isn't a power of two or rounding up would wrap.
+ */
+static inline void *
+uslab_set_alloc_aligned(struct uslab_set *s, size_t bytes, size_t align)
+{
+
+	if (align == 0 || (align & (align - 1)) != 0 || align > 4096 ||
+	    bytes > SIZE_MAX - align) {
+		return nullptr;
+	}
+
+	return uslab_set_alloc(s, (bytes + align - 1) & ~(align - 1));
+}
+
+/* Whether p came from the set. */
+static inline bool
+uslab_set_holds(const struct uslab_set *s, const void *p)
+{
+
+	return (const char *)p >= s->classes_base &&
+	    (const char *)p < s->classes_base + s->nclasses * s->class_len;
+}
+
+/*
+ * An Allocator for standard containers that takes what fits from a size-class
+ * set, lock-free, and everything else from std::allocator: arrays too big
+ * for any class, over-aligned types, and whatever a full class can't take.
+ * Copies and rebinds share the set, which must outlive them.
+ */
+template <typename T>
+class uslab_allocator {
+public:
+	typedef T value_type;
+
+	explicit uslab_allocator(struct uslab_set *s) noexcept : set_(s)
+	{
+	}
+
+	template <typename U>
+	uslab_allocator(const uslab_allocator<U> &other) noexcept
+	    : set_(other.set())
+	{
+	}
+
+	struct uslab_set *
+	set() const noexcept
+	{
+
+		return set_;
+	}
+
+	T *
+	allocate(size_t n)
+	{
+		void *p;
+
+		if (n <= SIZE_MAX / sizeof (T) &&
+		    (p = uslab_set_alloc_aligned(set_, n * sizeof (T),
+		    alignof (T))) != nullptr) {
+			return static_cast<T *>(p);
+		}
+
+		return std::allocator<T>().allocate(n);
+	}
+
+	void
+	deallocate(T *p, size_t n) noexcept
+	{
+
+		if (uslab_set_holds(set_, p)) {
+			uslab_set_free(set_, p);
+			return;
+		}
+
+		std::allocator<T>().deallocate(p, n);
+	}
+
+private:
+	struct uslab_set	*set_;
+};
+
+template <typename T, typename U>
+inline bool
+operator==(const uslab_allocator<T> &a, const uslab_allocator<U> &b) noexcept
+{
+
+	return a.set() == b.set();
+}
+
+template <typename T, typename U>
+inline bool
+operator!=(const uslab_allocator<T> &a, const uslab_allocator<U> &b) noexcept
+{
+
+	return a.set() != b.set();
+}
+
+#ifdef USLAB_HAVE_PMR
+/*
+ * uslab_allocator's policy as a std::pmr::memory_resource, falling back to
+ * an upstream resource rather than std::allocator. It either creates a set
+ * of its own, with classes from 16 bytes up to max_size, or serves from a
+ * set someone else created and will destroy.
+ */
+class uslab_resource : public std::pmr::memory_resource {
+public:
+	uslab_resource(size_t max_size, size_t class_len, uint64_t npt_slabs,
+	    unsigned int flags = 0, std::pmr::memory_resource *upstream =
+	    std::pmr::get_default_resource())
+	    : set_(uslab_set_create_anonymous(nullptr, 16, max_size, class_len,
+	    npt_slabs, flags)), upstream_(upstream), owned_(true)
+	{
+
+		if (set_ == nullptr) {
+			throw std::system_error(errno, std::generic_category(),
+			    "uslab_set_create_anonymous");
+		}
+	}
+
+	explicit uslab_resource(struct uslab_set *s,
+	    std::pmr::memory_resource *upstream =
+	    std::pmr::get_default_resource()) noexcept
+	    : set_(s), upstream_(upstream), owned_(false)
+	{
+	}
+
+	~uslab_resource()
+	{
+
+		if (owned_ == true) {
+			uslab_set_destroy(set_);
+		}
+	}
+
+	uslab_resource(const uslab_resource &) = delete;
+	uslab_resource &operator=(const uslab_resource &) = delete;
+
+	struct uslab_set *
+	set() const noexcept
+	{
+
+		return set_;
+	}
+
+	std::pmr::memory_resource *
+	upstream_resource() const noexcept
+	{
+
+		return upstream_;
+	}
+
+protected:
+	void *
+	do_allocate(size_t bytes, size_t align) override
+	{
+		void *p;
+
+		p = uslab_set_alloc_aligned(set_, bytes, align);
+		if (p != nullptr) {
+			return p;
+		}
+
+		return upstream_->allocate(bytes, align);
+	}
+
+	void
+	do_deallocate(void *p, size_t bytes, size_t align) override
+	{
+
+		if (uslab_set_holds(set_, p)) {
+			uslab_set_free(set_, p);
+			return;
+		}
+
+		upstream_->deallocate(p, bytes, align);
+	}
+
+	bool
+	do_is_equal(const std::pmr::memory_resource &other) const noexcept
+	    override
+	{
+
+		return this == &other;
+	}
+
+private:
+	struct uslab_set		*set_;
+	std::pmr::memory_resource	*upstream_;
+	bool				owned_;
+};
+#endif
+
+#endif
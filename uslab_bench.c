@@ -17,11 +17,18 @@
  * per-thread from 1..N threads for a stoachastic workload of M operations.
  */
 
+#define	_GNU_SOURCE
+
 #include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
 
 #include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,8 +36,11 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include <ck_pr.h>
+
 #include "jemalloc/jemalloc.h"
 #include "uslab.h"
+#include "hist.h"
 #include "rdtscp.h"
 
 struct td_state {
@@ -48,8 +58,9 @@ struct td_state {
 	uint64_t	tdelta;
 };
 
+#define	BENCH_BATCH	32
+
 struct td_state *state;
-__thread struct uslab_pt *uslab_pt = NULL;
 
 void *
 bench_td_jemalloc(void *arg)
@@ -121,84 +132,54 @@ bench_td_uslab(void *arg)
 	et = rdtscp();
 
 	a->tdelta = et - st;
+	uslab_magazine_flush(a->slab);
 
 	return NULL;
 }
 
-void
-usage(void)
+void *
+bench_td_uslab_bulk(void *arg)
 {
+	struct td_state *a;
+	uint64_t st, et, n;
 
-	fprintf(stderr, "uslab_bench -t N -n N\n"
-			"\t-a N:\tNumber of slabs to use\n"
-			"\t-n N:\tNumber of operations to complete per thread\n"
-			"\t-t N:\tNumber of threads to test up to\n");
-	exit(EX_USAGE);
-}
-
-int
-main(int argc, char **argv)
-{
-	unsigned long n_tds, n_ops, n_slabs;
-	struct uslab *slab;
-	uint64_t td_total;
-	int opt;
+	a = arg;
 
-	n_slabs = n_tds = 2;
-	n_ops = 10 * 1000 * 1000;
+	st = rdtscp();
+	for (uint64_t i = 0; i < a->n_ops; i += n) {
+		n = uslab_alloc_bulk(a->slab, &a->ptrs[i],
+		    MIN(BENCH_BATCH, a->n_ops - i));
+		a->n_allocs_completed += n;
+	}
 
-	while ((opt = getopt(argc, argv, "a:n:t:")) != -1) {
-		switch (opt) {
-		case 'a':
-			errno = 0;
-			n_slabs = strtoul(optarg, NULL, 0);
-			if (errno != 0) {
-				usage();
-			}
-			break;
-		case 'n':
-			errno = 0;
-			n_ops = strtoul(optarg, NULL, 0);
-			if (errno != 0) {
-				usage();
-			}
-			break;
-		case 't':
-			errno = 0;
-			n_tds = strtoul(optarg, NULL, 0);
-			if (errno != 0) {
-				usage();
-			}
-			break;
-		default:
-			usage();
-			break;
-		}
+	for (uint64_t i = 0; i < a->n_ops; i += n) {
+		n = MIN(BENCH_BATCH, a->n_ops - i);
+		uslab_free_bulk(a->slab, &a->ptrs[i], n);
+		a->n_frees_completed += n;
 	}
+	et = rdtscp();
 
-	n_slabs = MIN(n_slabs, n_tds);
-	td_total = 0;
+	a->tdelta = et - st;
 
-	state = calloc(n_tds, sizeof (*state));
-	//slab = uslab_create_anonymous(NULL, sizeof (void *), n_ops * n_tds, n_slabs);
-	slab = uslab_create_heap(sizeof (void *), n_ops * n_tds, n_slabs);
-	
-	for (unsigned long i = 0; i < n_tds; i++) {
-		state[i].n_ops = n_ops;
-		state[i].tid = i;
-		state[i].ptrs = calloc(n_ops, sizeof (void *));
-		state[i].slab = slab;
-	}
+	return NULL;
+}
+
+void
+bench_run(const char *name, void *(*fn)(void *), unsigned long n_tds)
+{
+	uint64_t td_total, n_total;
+
+	td_total = n_total = 0;
 
 	for (unsigned long i = 0; i < n_tds; i++) {
-		pthread_create(&state[i].pt, NULL, bench_td_uslab, &state[i]);
+		pthread_create(&state[i].pt, NULL, fn, &state[i]);
 	}
 
 	for (unsigned long i = 0; i < n_tds; i++) {
 		pthread_join(state[i].pt, NULL);
 	}
 
-
+	fprintf(stderr, "%s, %lu threads:\n", name, n_tds);
 	for (unsigned long i = 0; i < n_tds; i++) {
 		fprintf(stderr, "Thread %lu:\n"
 		    "\tn_allocs: %" PRIu64 "\n"
@@ -207,54 +188,1510 @@ main(int argc, char **argv)
 		    i, state[i].n_allocs_completed,
 		    state[i].n_frees_completed, state[i].tdelta);
 		td_total += state[i].tdelta;
+		n_total += state[i].n_allocs_completed +
+		    state[i].n_frees_completed;
 		state[i].n_allocs_completed = state[i].n_frees_completed = state[i].tdelta = 0;
 	}
-	fprintf(stderr, "td_total: %" PRIu64 "\n\n", td_total);
-	td_total = 0;
+	fprintf(stderr, "td_total: %" PRIu64 "\n", td_total);
+	fprintf(stderr, "cycles/op: %.2f\n\n",
+	    n_total ? (double)td_total / n_total : 0.0);
+}
 
-	uslab_destroy_heap(slab);
+void
+bench_uslab(const char *name, void *(*fn)(void *), unsigned long n_tds,
+    unsigned long n_slabs, uint64_t n_ops, unsigned int flags)
+{
+	struct uslab *slab;
+	unsigned long ncpu;
 
-	for (unsigned long i = 0; i < n_tds; i++) {
-		pthread_create(&state[i].pt, NULL, bench_td_malloc, &state[i]);
+	/*
+	 * Per-CPU slabs need a region for every CPU, and every region must be
+	 * able to hold all threads' objects, since threads can't take objects
+	 * from regions other than their CPU's.
+	 */
+	if (flags & USLAB_PERCPU) {
+		ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		slab = uslab_create_heap_flags(sizeof (void *),
+		    n_ops * n_tds * ncpu, ncpu, flags);
+	} else {
+		//slab = uslab_create_anonymous(NULL, sizeof (void *), n_ops * n_tds, n_slabs);
+		slab = uslab_create_heap_flags(sizeof (void *), n_ops * n_tds,
+		    MIN(n_slabs, n_tds), flags);
+	}
+	if (slab == NULL) {
+		perror("uslab_create_heap_flags");
+		exit(EX_OSERR);
 	}
 
 	for (unsigned long i = 0; i < n_tds; i++) {
-		pthread_join(state[i].pt, NULL);
+		state[i].slab = slab;
 	}
+	bench_run(name, fn, n_tds);
+	uslab_destroy_heap(slab);
+}
+
+/*
+ * Random-access touch latency. Every object in an anonymous slab of len
+ * bytes is linked into a single random cycle, which we then chase. Each load
+ * depends on the one before it, so TLB and cache misses are fully exposed.
+ */
+#define	BENCH_TOUCH_SIZE	64
 
+void *bench_touch_sink;
 
-	for (unsigned long i = 0; i < n_tds; i++) {
-		fprintf(stderr, "Thread %lu:\n"
-		    "\tn_allocs: %" PRIu64 "\n"
-		    "\tn_frees:  %" PRIu64 "\n"
-		    "\tcycles:   %" PRIu64 "\n",
-		    i, state[i].n_allocs_completed,
-		    state[i].n_frees_completed, state[i].tdelta);
-		td_total += state[i].tdelta;
-		state[i].n_allocs_completed = state[i].n_frees_completed = state[i].tdelta = 0;
+void
+bench_touch(const char *name, size_t len, unsigned int flags)
+{
+	struct uslab *slab;
+	uint64_t n, i, j, st, et;
+	void **objs, **p, *t;
+
+	n = len / BENCH_TOUCH_SIZE;
+	slab = uslab_create_anonymous_flags(NULL, BENCH_TOUCH_SIZE, n, 1,
+	    flags);
+	if (slab == NULL) {
+		fprintf(stderr, "%s: %s, skipped\n\n", name, strerror(errno));
+		return;
 	}
-	fprintf(stderr, "td_total: %" PRIu64 "\n\n", td_total);
-	td_total = 0;
 
-	for (unsigned long i = 0; i < n_tds; i++) {
-		pthread_create(&state[i].pt, NULL, bench_td_jemalloc, &state[i]);
+	objs = calloc(n, sizeof (*objs));
+	for (i = 0; i < n && (objs[i] = uslab_alloc(slab)) != NULL; i++)
+		;
+	n = i;
+
+	for (i = n - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = objs[i];
+		objs[i] = objs[j];
+		objs[j] = t;
 	}
 
-	for (unsigned long i = 0; i < n_tds; i++) {
-		pthread_join(state[i].pt, NULL);
+	for (i = 0; i < n; i++) {
+		*(void **)objs[i] = objs[(i + 1) % n];
 	}
 
+	p = objs[0];
+	st = rdtscp();
+	for (i = 0; i < n; i++) {
+		p = *p;
+	}
+	et = rdtscp();
+	bench_touch_sink = p;
 
-	for (unsigned long i = 0; i < n_tds; i++) {
-		fprintf(stderr, "Thread %lu:\n"
-		    "\tn_allocs: %" PRIu64 "\n"
-		    "\tn_frees:  %" PRIu64 "\n"
-		    "\tcycles:   %" PRIu64 "\n",
-		    i, state[i].n_allocs_completed,
-		    state[i].n_frees_completed, state[i].tdelta);
-		td_total += state[i].tdelta;
+	fprintf(stderr, "%s, %" PRIu64 " objects:\n"
+	    "cycles/touch: %.2f\n\n", name, n, (double)(et - st) / n);
+
+	free(objs);
+	uslab_destroy_map(slab);
+}
+
+/*
+ * Cache behavior of touch-heavy workloads, with hardware counters where the
+ * kernel lets us have them. The regions workload updates the first few
+ * objects of each of many regions in turn, as threads working near the
+ * heads of their own regions do; with regions a power of two long, those
+ * objects share a handful of cache sets unless the slab is colored. The
+ * objects workload reads every word of objects in a random order; objects
+ * of odd sizes straddle cachelines unless the slab is aligned.
+ */
+#define	BENCH_CACHE_REGIONS	64
+#define	BENCH_CACHE_HOT		4
+#define	BENCH_CACHE_OBJECTS	16384
+#define	BENCH_CACHE_TOUCHES	(16 * 1000 * 1000)
+
+static const struct {
+	const char	*name;
+	uint32_t	type;
+	uint64_t	config;
+} bench_events[] = {
+	{ "L1d misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+	    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+#define	BENCH_NEVENTS	(sizeof (bench_events) / sizeof (bench_events[0]))
+
+struct bench_counters {
+	int		fd[BENCH_NEVENTS];
+	uint64_t	n[BENCH_NEVENTS];
+	uint64_t	cycles;
+};
+
+static void
+bench_counters_start(struct bench_counters *c)
+{
+	struct perf_event_attr pe;
+	size_t i;
+
+	for (i = 0; i < BENCH_NEVENTS; i++) {
+		memset(&pe, 0, sizeof (pe));
+		pe.size = sizeof (pe);
+		pe.type = bench_events[i].type;
+		pe.config = bench_events[i].config;
+		pe.disabled = 1;
+		pe.exclude_kernel = 1;
+		pe.exclude_hv = 1;
+		c->fd[i] = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+		if (c->fd[i] != -1) {
+			ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	c->cycles = rdtscp();
+}
+
+static void
+bench_counters_stop(struct bench_counters *c)
+{
+	size_t i;
+
+	c->cycles = rdtscp() - c->cycles;
+	for (i = 0; i < BENCH_NEVENTS; i++) {
+		if (c->fd[i] == -1) {
+			continue;
+		}
+
+		ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(c->fd[i], &c->n[i], sizeof (c->n[i])) !=
+		    sizeof (c->n[i])) {
+			c->n[i] = UINT64_MAX;
+		}
+		close(c->fd[i]);
+	}
+}
+
+static void
+bench_counters_report(const char *name, struct bench_counters *c,
+    uint64_t n)
+{
+	size_t i;
+
+	fprintf(stderr, "%s:\ncycles/touch: %.2f\n", name,
+	    (double)c->cycles / n);
+	for (i = 0; i < BENCH_NEVENTS; i++) {
+		if (c->fd[i] == -1 || c->n[i] == UINT64_MAX) {
+			fprintf(stderr, "%s/touch: n/a\n", bench_events[i].name);
+		} else {
+			fprintf(stderr, "%s/touch: %.3f\n",
+			    bench_events[i].name, (double)c->n[i] / n);
+		}
+	}
+	fprintf(stderr, "\n");
+}
+
+void
+bench_cache_regions(const char *name, unsigned int flags)
+{
+	static volatile uint64_t *hot[BENCH_CACHE_REGIONS * BENCH_CACHE_HOT];
+	struct bench_counters c;
+	struct uslab *slab;
+	uint64_t i, k, n, r;
+
+	/* A page of objects per region. */
+	n = BENCH_CACHE_REGIONS * (4096 / 64);
+	slab = uslab_create_anonymous_flags(NULL, 64, n, BENCH_CACHE_REGIONS,
+	    flags);
+	if (slab == NULL) {
+		perror("uslab_create_anonymous_flags");
+		exit(EX_OSERR);
+	}
+
+	for (i = 0; i < n && uslab_alloc(slab) != NULL; i++)
+		;
+
+	for (r = 0; r < BENCH_CACHE_REGIONS; r++) {
+		for (k = 0; k < BENCH_CACHE_HOT; k++) {
+			hot[r * BENCH_CACHE_HOT + k] = (volatile uint64_t *)
+			    (slab->pt_base[r].base + k * 64);
+		}
+	}
+
+	n = BENCH_CACHE_TOUCHES / (BENCH_CACHE_REGIONS * BENCH_CACHE_HOT);
+	bench_counters_start(&c);
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < BENCH_CACHE_REGIONS * BENCH_CACHE_HOT; k++) {
+			(*hot[k])++;
+		}
+	}
+	bench_counters_stop(&c);
+	bench_counters_report(name, &c,
+	    n * BENCH_CACHE_REGIONS * BENCH_CACHE_HOT);
+
+	uslab_destroy_map(slab);
+}
+
+void
+bench_cache_objects(const char *name, size_t size, unsigned int flags)
+{
+	struct bench_counters c;
+	struct uslab *slab;
+	uint64_t i, j, k, n, sum;
+	uint64_t **objs, *t;
+
+	slab = uslab_create_anonymous_flags(NULL, size, BENCH_CACHE_OBJECTS, 1,
+	    flags);
+	if (slab == NULL) {
+		perror("uslab_create_anonymous_flags");
+		exit(EX_OSERR);
+	}
+
+	objs = calloc(BENCH_CACHE_OBJECTS, sizeof (*objs));
+	for (i = 0; i < BENCH_CACHE_OBJECTS &&
+	    (objs[i] = uslab_alloc(slab)) != NULL; i++) {
+		memset(objs[i], 1, size);
+	}
+
+	for (i = BENCH_CACHE_OBJECTS - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = objs[i];
+		objs[i] = objs[j];
+		objs[j] = t;
+	}
+
+	n = BENCH_CACHE_TOUCHES / BENCH_CACHE_OBJECTS;
+	sum = 0;
+	bench_counters_start(&c);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < BENCH_CACHE_OBJECTS; j++) {
+			for (k = 0; k < size / sizeof (uint64_t); k++) {
+				sum += objs[j][k];
+			}
+		}
+	}
+	bench_counters_stop(&c);
+	bench_touch_sink = (void *)(uintptr_t)sum;
+	bench_counters_report(name, &c, n * BENCH_CACHE_OBJECTS);
+
+	free(objs);
+	uslab_destroy_map(slab);
+}
+
+/*
+ * Finding the region of an object, as every free does, by dividing its
+ * offset by the region stride and by the slab's prepared divisor. Each
+ * lookup picks the next object, so we measure latency, as a free sees it.
+ */
+#define	BENCH_DIV_OBJECTS	16384
+#define	BENCH_DIV_OPS		(16 * 1000 * 1000)
+
+void
+bench_div(const char *name, size_t size, unsigned int flags)
+{
+	struct uslab *slab;
+	uint64_t *offs, i, j, r, t, st, hw, fast;
+
+	slab = uslab_create_anonymous_flags(NULL, size, BENCH_DIV_OBJECTS, 16,
+	    flags);
+	if (slab == NULL) {
+		perror("uslab_create_anonymous_flags");
+		exit(EX_OSERR);
+	}
+
+	offs = calloc(BENCH_DIV_OBJECTS, sizeof (*offs));
+	for (i = 0; i < BENCH_DIV_OBJECTS; i++) {
+		offs[i] = (char *)uslab_alloc(slab) - slab->slab0_base;
+	}
+
+	for (i = BENCH_DIV_OBJECTS - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = offs[i];
+		offs[i] = offs[j];
+		offs[j] = t;
+	}
+
+	r = 0;
+	st = rdtscp();
+	for (i = 0; i < BENCH_DIV_OPS; i++) {
+		r = offs[(i + r) & (BENCH_DIV_OBJECTS - 1)] / slab->pt_stride;
+	}
+	hw = rdtscp() - st;
+	bench_touch_sink = (void *)(uintptr_t)r;
+
+	r = 0;
+	st = rdtscp();
+	for (i = 0; i < BENCH_DIV_OPS; i++) {
+		r = uslab_div(&slab->pt_div,
+		    offs[(i + r) & (BENCH_DIV_OBJECTS - 1)]);
+	}
+	fast = rdtscp() - st;
+	bench_touch_sink = (void *)(uintptr_t)r;
+
+	fprintf(stderr, "%s, stride %zu (%s):\n"
+	    "cycles/op (divide):   %.2f\n"
+	    "cycles/op (prepared): %.2f\n"
+	    "cycles/op saved:      %.2f\n\n", name, slab->pt_stride,
+	    slab->pt_div.magic == 0 ? "shift" : "multiply",
+	    (double)hw / BENCH_DIV_OPS, (double)fast / BENCH_DIV_OPS,
+	    ((double)hw - (double)fast) / BENCH_DIV_OPS);
+
+	free(offs);
+	uslab_destroy_map(slab);
+}
+
+/*
+ * Allocation latency in a full slab, where every allocation fails, and in a
+ * nearly full one, where a single free object sits in a random region. Both
+ * are dominated by how quickly we find free space, or learn there is none.
+ */
+#define	BENCH_FULL_PER_REGION	64
+#define	BENCH_FULL_OPS		100000
+
+void
+bench_full(const char *name, unsigned long n_slabs, unsigned int flags)
+{
+	uint64_t n, i, j, st, et, oom, near;
+	struct uslab *slab;
+	void **objs;
+
+	n = n_slabs * BENCH_FULL_PER_REGION;
+	slab = uslab_create_heap_flags(sizeof (void *), n, n_slabs, flags);
+	if (slab == NULL) {
+		perror("uslab_create_heap_flags");
+		exit(EX_OSERR);
+	}
+
+	objs = calloc(n, sizeof (*objs));
+	for (i = 0; i < n && (objs[i] = uslab_alloc(slab)) != NULL; i++)
+		;
+	n = i;
+
+	st = rdtscp();
+	for (i = 0; i < BENCH_FULL_OPS; i++) {
+		bench_touch_sink = uslab_alloc(slab);
+	}
+	et = rdtscp();
+	oom = et - st;
+
+	near = 0;
+	for (i = 0; i < BENCH_FULL_OPS; i++) {
+		j = random() % n;
+		uslab_free(slab, objs[j]);
+		st = rdtscp();
+		objs[j] = uslab_alloc(slab);
+		et = rdtscp();
+		near += et - st;
+	}
+
+	fprintf(stderr, "%s, %lu regions:\n"
+	    "cycles/alloc (full):     %.2f\n"
+	    "cycles/alloc (one free): %.2f\n\n", name, n_slabs,
+	    (double)oom / BENCH_FULL_OPS, (double)near / BENCH_FULL_OPS);
+
+	free(objs);
+	uslab_destroy_heap(slab);
+}
+
+/*
+ * Cross-thread frees, as in a pipeline: each producer allocates objects and
+ * hands them through a ring to its consumer, which frees them. Consumers
+ * never allocate, so on USLAB_REMOTE slabs every free is a remote one. We
+ * report the cycles spent in the allocator on each side as well as overall
+ * throughput, which also counts waiting on the ring.
+ */
+#define	BENCH_XFREE_RING	1024
+#define	BENCH_QUEUE_BATCH	16
+
+struct bench_xfree {
+	pthread_t	pt[2];
+	struct uslab	*slab;
+	void		*(*alloc)(struct uslab *);
+	void		(*free)(struct uslab *, void *);
+	uint64_t	n_ops;
+	uint64_t	tdelta[2];
+	uint64_t	in_alloc;
+	uint64_t	in_free;
+
+	uint64_t	head __attribute__((aligned(64)));
+	uint64_t	tail __attribute__((aligned(64)));
+	void		*ring[BENCH_XFREE_RING] __attribute__((aligned(64)));
+};
+
+void *
+bench_xfree_malloc(struct uslab *slab)
+{
+
+	(void)slab;
+	return malloc(sizeof (void *));
+}
+
+void
+bench_xfree_free(struct uslab *slab, void *p)
+{
+
+	(void)slab;
+	free(p);
+}
+
+void *
+bench_xfree_jemalloc(struct uslab *slab)
+{
+
+	(void)slab;
+	return je_malloc(sizeof (void *));
+}
+
+void
+bench_xfree_jefree(struct uslab *slab, void *p)
+{
+
+	(void)slab;
+	je_free(p);
+}
+
+void *
+bench_td_producer(void *arg)
+{
+	struct bench_xfree *x;
+	uint64_t st, et, ost;
+	void *p;
+
+	x = arg;
+
+	st = rdtscp();
+	for (uint64_t i = 0; i < x->n_ops; i++) {
+		ost = rdtscp();
+		p = x->alloc(x->slab);
+		x->in_alloc += rdtscp() - ost;
+		while (i - ck_pr_load_64(&x->tail) == BENCH_XFREE_RING) {
+			ck_pr_stall();
+		}
+		ck_pr_fence_acquire();
+		x->ring[i % BENCH_XFREE_RING] = p;
+		ck_pr_fence_release();
+		ck_pr_store_64(&x->head, i + 1);
+	}
+	et = rdtscp();
+
+	x->tdelta[0] = et - st;
+
+	return NULL;
+}
+
+void *
+bench_td_consumer(void *arg)
+{
+	struct bench_xfree *x;
+	uint64_t st, et, ost;
+	void *p;
+
+	x = arg;
+
+	st = rdtscp();
+	for (uint64_t i = 0; i < x->n_ops; i++) {
+		while (ck_pr_load_64(&x->head) == i) {
+			ck_pr_stall();
+		}
+		ck_pr_fence_acquire();
+		p = x->ring[i % BENCH_XFREE_RING];
+		ck_pr_fence_release();
+		ck_pr_store_64(&x->tail, i + 1);
+		ost = rdtscp();
+		x->free(x->slab, p);
+		x->in_free += rdtscp() - ost;
+	}
+	et = rdtscp();
+
+	x->tdelta[1] = et - st;
+
+	return NULL;
+}
+
+void
+bench_xfree(const char *name, unsigned long n_pairs, uint64_t n_ops,
+    unsigned int flags, void *(*alloc)(struct uslab *),
+    void (*free_fn)(struct uslab *, void *))
+{
+	struct bench_xfree *x;
+	struct uslab *slab;
+	uint64_t td_total, in_alloc, in_free;
+
+	/*
+	 * Each producer gets a region of its own, with room for a full ring
+	 * and as much again sitting on its remote list.
+	 */
+	slab = NULL;
+	if (alloc == uslab_alloc) {
+		slab = uslab_create_heap_flags(sizeof (void *),
+		    n_pairs * 4 * BENCH_XFREE_RING, n_pairs, flags);
+		if (slab == NULL) {
+			perror("uslab_create_heap_flags");
+			exit(EX_OSERR);
+		}
+	}
+
+	if (posix_memalign((void **)&x, 64, n_pairs * sizeof (*x)) != 0) {
+		perror("posix_memalign");
+		exit(EX_OSERR);
+	}
+	memset(x, 0, n_pairs * sizeof (*x));
+
+	for (unsigned long i = 0; i < n_pairs; i++) {
+		x[i].slab = slab;
+		x[i].alloc = alloc;
+		x[i].free = free_fn;
+		x[i].n_ops = n_ops;
+		pthread_create(&x[i].pt[0], NULL, bench_td_producer, &x[i]);
+		pthread_create(&x[i].pt[1], NULL, bench_td_consumer, &x[i]);
+	}
+
+	td_total = in_alloc = in_free = 0;
+	for (unsigned long i = 0; i < n_pairs; i++) {
+		pthread_join(x[i].pt[0], NULL);
+		pthread_join(x[i].pt[1], NULL);
+		td_total += MAX(x[i].tdelta[0], x[i].tdelta[1]);
+		in_alloc += x[i].in_alloc;
+		in_free += x[i].in_free;
+	}
+
+	fprintf(stderr, "%s, %lu pairs:\n", name, n_pairs);
+	for (unsigned long i = 0; i < n_pairs; i++) {
+		fprintf(stderr, "Pair %lu:\n"
+		    "\tproducer cycles: %" PRIu64 "\n"
+		    "\tconsumer cycles: %" PRIu64 "\n",
+		    i, x[i].tdelta[0], x[i].tdelta[1]);
+	}
+	fprintf(stderr, "cycles/alloc:  %.2f\n"
+	    "cycles/free:   %.2f\n"
+	    "cycles/object: %.2f\n\n",
+	    (double)in_alloc / (n_pairs * n_ops),
+	    (double)in_free / (n_pairs * n_ops),
+	    (double)td_total / (n_pairs * n_ops));
+
+	free(x);
+	if (slab != NULL) {
+		uslab_destroy_heap(slab);
+	}
+}
+
+struct bench_queue {
+	pthread_t	pt[2];
+	struct uslab	*slab;
+	uint64_t	n_ops;
+	uint64_t	batch;
+	uint64_t	tdelta[2];
+};
+
+void *
+bench_td_enqueue(void *arg)
+{
+	struct bench_queue *q;
+	void *objs[BENCH_QUEUE_BATCH];
+	uint64_t st, i, j, k, n;
+
+	q = arg;
+
+	st = rdtscp();
+	for (i = 0; i < q->n_ops; i += n) {
+		n = MIN(q->batch, q->n_ops - i);
+		for (j = 0; j < n; j++) {
+			while ((objs[j] = uslab_alloc(q->slab)) == NULL) {
+				ck_pr_stall();
+			}
+		}
+		for (j = 0; j < n; j += k) {
+			k = uslab_enqueue_bulk(q->slab, objs + j, n - j);
+		}
+	}
+	q->tdelta[0] = rdtscp() - st;
+
+	return NULL;
+}
+
+void *
+bench_td_dequeue(void *arg)
+{
+	struct bench_queue *q;
+	void *objs[BENCH_QUEUE_BATCH];
+	uint64_t st, i, j, n;
+
+	q = arg;
+
+	st = rdtscp();
+	for (i = 0; i < q->n_ops; i += n) {
+		n = uslab_dequeue_bulk(q->slab, objs,
+		    MIN(q->batch, q->n_ops - i));
+		if (n == 0) {
+			ck_pr_stall();
+		}
+		for (j = 0; j < n; j++) {
+			uslab_free(q->slab, objs[j]);
+		}
+	}
+	q->tdelta[1] = rdtscp() - st;
+
+	return NULL;
+}
+
+/*
+ * Pass objects from producers to consumers through queue slabs, one slab
+ * per pair, as bench_xfree does through a ring of its own.
+ */
+void
+bench_queue(const char *name, unsigned long n_pairs, uint64_t n_ops,
+    uint64_t batch, unsigned int flags)
+{
+	struct bench_queue *q;
+	uint64_t td_total;
+
+	q = calloc(n_pairs, sizeof (*q));
+	for (unsigned long i = 0; i < n_pairs; i++) {
+		q[i].slab = uslab_create_heap_flags(sizeof (void *),
+		    BENCH_XFREE_RING, 1, flags);
+		if (q[i].slab == NULL) {
+			perror("uslab_create_heap_flags");
+			exit(EX_OSERR);
+		}
+		q[i].n_ops = n_ops;
+		q[i].batch = batch;
+		pthread_create(&q[i].pt[0], NULL, bench_td_enqueue, &q[i]);
+		pthread_create(&q[i].pt[1], NULL, bench_td_dequeue, &q[i]);
+	}
+
+	td_total = 0;
+	for (unsigned long i = 0; i < n_pairs; i++) {
+		pthread_join(q[i].pt[0], NULL);
+		pthread_join(q[i].pt[1], NULL);
+		td_total += MAX(q[i].tdelta[0], q[i].tdelta[1]);
+		uslab_destroy_heap(q[i].slab);
+	}
+
+	fprintf(stderr, "%s, %lu pairs, batches of %" PRIu64 ":\n"
+	    "cycles/object: %.2f\n\n", name, n_pairs, batch,
+	    (double)td_total / (n_pairs * n_ops));
+	free(q);
+}
+
+/*
+ * Latency distributions. Every allocation and free is timed on its own with
+ * rdtscp and recorded in a histogram (see hist.h). Each thread fills
+ * histograms of its own, which are merged once it's done. The cost of a
+ * back-to-back rdtscp pair, measured before we start, is taken off every
+ * sample.
+ *
+ * Threads are pinned to a CPU each, and run the whole workload once
+ * untimed before the measured run, so that page faults and cold caches
+ * don't land in the tail.
+ */
+enum bench_format {
+	BENCH_FORMAT_CSV,
+	BENCH_FORMAT_JSON,
+};
+
+struct bench_lat {
+	pthread_t	pt;
+	struct uslab	*slab;
+	void		*(*alloc)(struct uslab *);
+	void		(*free)(struct uslab *, void *);
+	void		**ptrs;
+	uint64_t	n_ops;
+	uint64_t	n_warmup;
+	uint64_t	overhead;
+	int		cpu;
+	struct hist hist[2];	/* Allocations, frees */
+};
+
+static void
+bench_pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	(void)pthread_setaffinity_np(pthread_self(), sizeof (set), &set);
+}
+
+void *
+bench_td_latency(void *arg)
+{
+	struct bench_lat *l;
+	uint64_t st, et, i, n;
+
+	l = arg;
+	bench_pin(l->cpu);
+
+	n = MIN(l->n_warmup, l->n_ops);
+	for (i = 0; i < n; i++) {
+		l->ptrs[i] = l->alloc(l->slab);
+	}
+	for (i = 0; i < n; i++) {
+		l->free(l->slab, l->ptrs[i]);
+	}
+
+	for (i = 0; i < l->n_ops; i++) {
+		st = rdtscp();
+		l->ptrs[i] = l->alloc(l->slab);
+		et = rdtscp();
+		hist_add(&l->hist[0], et - st - MIN(et - st, l->overhead));
+	}
+
+	for (i = 0; i < l->n_ops; i++) {
+		st = rdtscp();
+		l->free(l->slab, l->ptrs[i]);
+		et = rdtscp();
+		hist_add(&l->hist[1], et - st - MIN(et - st, l->overhead));
+	}
+
+	if (l->slab != NULL) {
+		uslab_magazine_flush(l->slab);
+	}
+
+	return NULL;
+}
+
+static void
+bench_hist_report(enum bench_format format, const char *name,
+    unsigned long n_tds, const char *op, const struct hist *h,
+    uint64_t overhead)
+{
+	static const char *fmt[] = {
+		[BENCH_FORMAT_CSV] = "%s,%lu,%s,%" PRIu64 ",%" PRIu64
+		    ",%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+		    ",%" PRIu64 ",%" PRIu64 "\n",
+		[BENCH_FORMAT_JSON] = "{\"allocator\": \"%s\", \"threads\": %lu, "
+		    "\"op\": \"%s\", \"count\": %" PRIu64 ", \"min\": %" PRIu64
+		    ", \"mean\": %.2f, \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+		    ", \"p99\": %" PRIu64 ", \"p99.9\": %" PRIu64
+		    ", \"max\": %" PRIu64 ", \"tsc_overhead\": %" PRIu64 "}\n",
+	};
+
+	printf(fmt[format], name, n_tds, op, h->count, h->min,
+	    h->count ? (double)h->sum / h->count : 0.0,
+	    hist_quantile(h, 0.5), hist_quantile(h, 0.9),
+	    hist_quantile(h, 0.99), hist_quantile(h, 0.999),
+	    h->max, overhead);
+	fflush(stdout);
+}
+
+/*
+ * Time every allocation and free of the usual workload on n_tds threads,
+ * and print the distributions of each, in cycles, to stdout. A NULL alloc
+ * means uslab_alloc on a slab created with flags.
+ */
+void
+bench_latency(enum bench_format format, const char *name,
+    unsigned long n_tds, unsigned long n_slabs, uint64_t n_ops,
+    uint64_t n_warmup, unsigned int flags, void *(*alloc)(struct uslab *),
+    void (*free_fn)(struct uslab *, void *))
+{
+	struct hist *total;
+	struct bench_lat *l;
+	struct uslab *slab;
+	uint64_t overhead;
+	long ncpu;
+
+	slab = NULL;
+	if (alloc == NULL) {
+		slab = uslab_create_heap_flags(sizeof (void *), n_ops * n_tds,
+		    MIN(n_slabs, n_tds), flags);
+		if (slab == NULL) {
+			perror("uslab_create_heap_flags");
+			exit(EX_OSERR);
+		}
+		alloc = uslab_alloc;
+		free_fn = uslab_free;
+	}
+
+	ncpu = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	overhead = rdtscp_overhead();
+	l = calloc(n_tds, sizeof (*l));
+	total = calloc(2, sizeof (*total));
+	if (l == NULL || total == NULL) {
+		perror("calloc");
+		exit(EX_OSERR);
+	}
+	total[0].min = total[1].min = UINT64_MAX;
+
+	for (unsigned long i = 0; i < n_tds; i++) {
+		l[i].slab = slab;
+		l[i].alloc = alloc;
+		l[i].free = free_fn;
+		l[i].ptrs = state[i].ptrs;
+		l[i].n_ops = n_ops;
+		l[i].n_warmup = n_warmup;
+		l[i].overhead = overhead;
+		l[i].cpu = i % ncpu;
+		l[i].hist[0].min = l[i].hist[1].min = UINT64_MAX;
+		pthread_create(&l[i].pt, NULL, bench_td_latency, &l[i]);
+	}
+
+	for (unsigned long i = 0; i < n_tds; i++) {
+		pthread_join(l[i].pt, NULL);
+		hist_merge(&total[0], &l[i].hist[0]);
+		hist_merge(&total[1], &l[i].hist[1]);
+	}
+
+	bench_hist_report(format, name, n_tds, "alloc", &total[0], overhead);
+	bench_hist_report(format, name, n_tds, "free", &total[1], overhead);
+
+	free(total);
+	free(l);
+	if (slab != NULL) {
+		uslab_destroy_heap(slab);
+	}
+}
+
+/*
+ * Workload profiles. Unlike the default run, these keep a live set of
+ * objects and interleave allocations and frees, so freelists are exercised
+ * in steady state, in random order, across threads, and when they run dry.
+ * Each thread may hold up to its share of the slab's objects (-c), plus an
+ * eighth for slack, and every allocator gets the same sequence of choices
+ * from the same seeds. Cycles are counted over the whole run, bookkeeping
+ * included, and divided by the number of allocations and frees done.
+ *
+ *  mixed:     Allocate or free at random, drifting towards -O percent of
+ *             the thread's share. Frees pick a random live object.
+ *  nearfull:  The same at the whole share, so the slab as a whole hovers
+ *             at full: threads steal from each other's regions and often
+ *             find nothing left. Allocators that run out free instead.
+ *  burst:     Allocate a burst of 2^k objects, k uniform in 0..11, then free
+ *             as many random live objects, over a background of a quarter
+ *             of the share.
+ *  lifetime:  Each step frees whatever is due and allocates one object that
+ *             lives for a number of steps drawn from a long-tailed
+ *             distribution: mostly up to 16, sometimes up to 1024, and one
+ *             time in 64 up to the share.
+ *  pipeline:  Threads pair up as producer and consumer over a ring; every
+ *             object is freed by a thread other than the one that
+ *             allocated it. Only even thread counts are run.
+ */
+#define	BENCH_PROFILE_SHARE	65536
+#define	BENCH_BURST_MAX_SHIFT	11
+
+struct bench_alloc {
+	const char	*name;
+	unsigned int	flags;
+	void		*(*alloc)(struct uslab *);
+	void		(*free)(struct uslab *, void *);
+};
+
+struct bench_ring {
+	uint64_t	head __attribute__((aligned(64)));
+	uint64_t	tail __attribute__((aligned(64)));
+	void		*slots[BENCH_XFREE_RING] __attribute__((aligned(64)));
+};
+
+struct bench_prof {
+	pthread_t	pt;
+	void		*(*fn)(void *);
+	const struct bench_alloc *ba;
+	struct uslab	*slab;
+	uint64_t	n_ops;
+	uint64_t	share;
+	uint64_t	occupancy;
+	uint64_t	seed;
+	uint64_t	tid;
+	struct bench_ring *ring;
+
+	void		**live;
+	uint64_t	n_live;
+	uint64_t	live_max;
+
+	uint64_t	done;
+	uint64_t	ooms;
+	uint64_t	tdelta;
+};
+
+struct bench_profile {
+	const char	*name;
+	void		*(*fn)(void *);
+	uint64_t	occupancy;
+};
+
+static inline uint64_t
+bench_rand(uint64_t *s)
+{
+
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 2685821657736338717ULL;
+}
+
+/* Allocate into the live set. Returns false if the allocator is out. */
+static inline bool
+bench_prof_alloc(struct bench_prof *b)
+{
+	void *p;
+
+	p = b->ba->alloc(b->slab);
+	b->done++;
+	if (p == NULL) {
+		b->ooms++;
+		return false;
+	}
+
+	b->live[b->n_live++] = p;
+	return true;
+}
+
+/* Free a random member of the live set. */
+static inline void
+bench_prof_free(struct bench_prof *b)
+{
+	uint64_t i;
+
+	i = bench_rand(&b->seed) % b->n_live;
+	b->ba->free(b->slab, b->live[i]);
+	b->live[i] = b->live[--b->n_live];
+	b->done++;
+}
+
+void *
+bench_prof_mixed(void *arg)
+{
+	struct bench_prof *b;
+	uint64_t target, st, r;
+
+	b = arg;
+	target = b->share * b->occupancy / 100;
+
+	st = rdtscp();
+	while (b->done < b->n_ops) {
+		r = bench_rand(&b->seed) % 100;
+		if (b->n_live == 0 || (b->n_live < b->live_max &&
+		    r < (b->n_live < target ? 75 : 25))) {
+			if (bench_prof_alloc(b) == true || b->n_live == 0) {
+				continue;
+			}
+		}
+		bench_prof_free(b);
+	}
+	b->tdelta = rdtscp() - st;
+
+	return NULL;
+}
+
+void *
+bench_prof_burst(void *arg)
+{
+	struct bench_prof *b;
+	uint64_t n, i, st;
+
+	b = arg;
+	while (b->n_live < b->share / 4 && bench_prof_alloc(b) == true)
+		;
+	b->done = b->ooms = 0;
+
+	st = rdtscp();
+	while (b->done < b->n_ops) {
+		n = 1ULL << (bench_rand(&b->seed) % (BENCH_BURST_MAX_SHIFT + 1));
+		for (i = 0; i < n && b->n_live < b->live_max; i++) {
+			if (bench_prof_alloc(b) == false) {
+				break;
+			}
+		}
+		for (n = i; n > 0 && b->n_live > 0; n--) {
+			bench_prof_free(b);
+		}
+	}
+	b->tdelta = rdtscp() - st;
+
+	return NULL;
+}
+
+/*
+ * Objects are kept on a timing wheel with a slot for every step of the
+ * longest lifetime, in the slot of the step they're due to be freed at, or
+ * the next empty one after it.
+ */
+void *
+bench_prof_lifetime(void *arg)
+{
+	struct bench_prof *b;
+	uint64_t now, mask, life, r, st, i;
+	void **wheel, *p;
+
+	b = arg;
+	for (mask = 1; mask < b->share; mask <<= 1)
+		;
+	wheel = calloc(mask--, sizeof (*wheel));
+	if (wheel == NULL) {
+		perror("calloc");
+		exit(EX_OSERR);
+	}
+
+	st = rdtscp();
+	for (now = 0; b->done < b->n_ops; now++) {
+		if ((p = wheel[now & mask]) != NULL) {
+			b->ba->free(b->slab, p);
+			wheel[now & mask] = NULL;
+			b->n_live--;
+			b->done++;
+		}
+
+		r = bench_rand(&b->seed);
+		if ((r & 63) == 0) {
+			life = (r >> 6) % b->share;
+		} else if ((r & 7) == 0) {
+			life = (r >> 6) % 1024;
+		} else {
+			life = (r >> 6) % 16;
+		}
+		life = MIN(life + 1, mask);
+
+		if (b->n_live == mask) {
+			continue;
+		}
+		b->done++;
+		if ((p = b->ba->alloc(b->slab)) == NULL) {
+			b->ooms++;
+			continue;
+		}
+		for (i = now + life; wheel[i & mask] != NULL; i++)
+			;
+		wheel[i & mask] = p;
+		b->n_live++;
+	}
+	b->tdelta = rdtscp() - st;
+
+	for (i = 0; i <= mask; i++) {
+		if (wheel[i] != NULL) {
+			b->ba->free(b->slab, wheel[i]);
+		}
+	}
+	b->n_live = 0;
+	free(wheel);
+
+	return NULL;
+}
+
+void *
+bench_prof_pipeline(void *arg)
+{
+	struct bench_ring *ring;
+	struct bench_prof *b;
+	uint64_t i, st;
+	void *p;
+
+	b = arg;
+	ring = b->ring;
+
+	st = rdtscp();
+	for (i = 0; i < b->n_ops; i++) {
+		if (b->tid % 2 == 0) {
+			while ((p = b->ba->alloc(b->slab)) == NULL) {
+				b->ooms++;
+				ck_pr_stall();
+			}
+			while (i - ck_pr_load_64(&ring->tail) ==
+			    BENCH_XFREE_RING) {
+				ck_pr_stall();
+			}
+			ring->slots[i % BENCH_XFREE_RING] = p;
+			ck_pr_fence_store();
+			ck_pr_store_64(&ring->head, i + 1);
+		} else {
+			while (ck_pr_load_64(&ring->head) == i) {
+				ck_pr_stall();
+			}
+			ck_pr_fence_load();
+			p = ring->slots[i % BENCH_XFREE_RING];
+			ck_pr_fence_release();
+			ck_pr_store_64(&ring->tail, i + 1);
+			b->ba->free(b->slab, p);
+		}
+		b->done++;
+	}
+	b->tdelta = rdtscp() - st;
+
+	return NULL;
+}
+
+void *
+bench_td_profile(void *arg)
+{
+	struct bench_prof *b;
+
+	b = arg;
+	b->fn(b);
+	if (b->slab != NULL) {
+		uslab_magazine_flush(b->slab);
+	}
+
+	return NULL;
+}
+
+static const struct bench_profile bench_profiles[] = {
+	{ "mixed",	bench_prof_mixed,	0 },
+	{ "nearfull",	bench_prof_mixed,	100 },
+	{ "burst",	bench_prof_burst,	0 },
+	{ "lifetime",	bench_prof_lifetime,	0 },
+	{ "pipeline",	bench_prof_pipeline,	0 },
+};
+
+static const struct bench_alloc bench_allocs[] = {
+	{ "uslab",		0,		uslab_alloc,	uslab_free },
+	{ "uslab (tagged)",	USLAB_TAGGED,	uslab_alloc,	uslab_free },
+	{ "uslab (remote)",	USLAB_REMOTE,	uslab_alloc,	uslab_free },
+	{ "uslab (magazine)",	USLAB_MAGAZINE,	uslab_alloc,	uslab_free },
+	{ "malloc",		0,	bench_xfree_malloc,	bench_xfree_free },
+	{ "jemalloc",		0,	bench_xfree_jemalloc,	bench_xfree_jefree },
+};
+
+void
+bench_profile(const struct bench_profile *pf, const struct bench_alloc *ba,
+    unsigned long n_tds, unsigned long n_slabs, uint64_t n_ops,
+    uint64_t share, uint64_t occupancy)
+{
+	struct bench_ring *rings;
+	struct bench_prof *b;
+	struct uslab *slab;
+	uint64_t td_total, done, ooms;
+
+	slab = NULL;
+	if (ba->alloc == uslab_alloc) {
+		slab = uslab_create_heap_flags(sizeof (void *), n_tds * share,
+		    MIN(n_slabs, n_tds), ba->flags);
+		if (slab == NULL) {
+			perror("uslab_create_heap_flags");
+			exit(EX_OSERR);
+		}
+	}
+
+	b = calloc(n_tds, sizeof (*b));
+	if (b == NULL || posix_memalign((void **)&rings, 64,
+	    (n_tds / 2 + 1) * sizeof (*rings)) != 0) {
+		perror("calloc");
+		exit(EX_OSERR);
+	}
+	memset(rings, 0, (n_tds / 2 + 1) * sizeof (*rings));
+
+	for (unsigned long i = 0; i < n_tds; i++) {
+		b[i].fn = pf->fn;
+		b[i].ba = ba;
+		b[i].slab = slab;
+		b[i].n_ops = n_ops;
+		b[i].share = share;
+		b[i].occupancy = pf->occupancy ? pf->occupancy : occupancy;
+		b[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		b[i].tid = i;
+		b[i].ring = &rings[i / 2];
+		b[i].live_max = share + share / 8;
+		b[i].live = calloc(b[i].live_max, sizeof (void *));
+		if (b[i].live == NULL) {
+			perror("calloc");
+			exit(EX_OSERR);
+		}
+	}
+
+	for (unsigned long i = 0; i < n_tds; i++) {
+		pthread_create(&b[i].pt, NULL, bench_td_profile, &b[i]);
+	}
+
+	td_total = done = ooms = 0;
+	for (unsigned long i = 0; i < n_tds; i++) {
+		pthread_join(b[i].pt, NULL);
+		td_total += b[i].tdelta;
+		done += b[i].done;
+		ooms += b[i].ooms;
+	}
+
+	/* Objects may have moved between threads, so free them all at once. */
+	for (unsigned long i = 0; i < n_tds; i++) {
+		while (b[i].n_live > 0) {
+			ba->free(slab, b[i].live[--b[i].n_live]);
+		}
+		free(b[i].live);
+	}
+
+	fprintf(stderr, "%s", pf->name);
+	if (pf->fn == bench_prof_mixed) {
+		fprintf(stderr, " (%" PRIu64 "%% full)", b[0].occupancy);
+	}
+	fprintf(stderr, ", %s, %lu threads:\n"
+	    "cycles/op: %.2f\n"
+	    "ooms:      %" PRIu64 "\n\n", ba->name, n_tds,
+	    done ? (double)td_total / done : 0.0, ooms);
+
+	free(rings);
+	free(b);
+	if (slab != NULL) {
+		uslab_magazine_flush(slab);
+		uslab_destroy_heap(slab);
+	}
+}
+
+/* Run the named profile, or all of them, from 1 to n_tds threads. */
+void
+bench_profiles_run(const char *name, unsigned long n_tds,
+    unsigned long n_slabs, uint64_t n_ops, uint64_t share,
+    uint64_t occupancy)
+{
+	const struct bench_profile *pf;
+	bool found;
+
+	found = false;
+	for (size_t i = 0; i < sizeof (bench_profiles) /
+	    sizeof (bench_profiles[0]); i++) {
+		pf = &bench_profiles[i];
+		if (strcmp(name, "all") != 0 && strcmp(name, pf->name) != 0) {
+			continue;
+		}
+
+		found = true;
+		for (unsigned long t = 1; t <= n_tds; t++) {
+			if (pf->fn == bench_prof_pipeline && t % 2 != 0) {
+				continue;
+			}
+			for (size_t j = 0; j < sizeof (bench_allocs) /
+			    sizeof (bench_allocs[0]); j++) {
+				bench_profile(pf, &bench_allocs[j], t,
+				    n_slabs, n_ops, share, occupancy);
+			}
+		}
+	}
+
+	if (found == false) {
+		fprintf(stderr, "unknown profile %s\n", name);
+		exit(EX_USAGE);
+	}
+}
+
+void
+usage(void)
+{
+
+	fprintf(stderr, "uslab_bench -t N -n N\n"
+			"\t-a N:\tNumber of slabs to use\n"
+			"\t-c N:\tObjects per thread in workload profiles\n"
+			"\t-C:\tMeasure cache misses with and without coloring and alignment and exit\n"
+			"\t-d:\tMeasure finding objects' regions by division and with prepared divisors and exit\n"
+			"\t-f:\tMeasure allocation latency in full slabs of -a regions and exit\n"
+			"\t-l:\tPrint latency distributions of every operation to stdout and exit\n"
+			"\t-n N:\tNumber of operations to complete per thread\n"
+			"\t-o F:\tPrint latency distributions as csv (the default) or json\n"
+			"\t-O N:\tPercentage of its objects each thread keeps live in the mixed profile\n"
+			"\t-p P:\tRun workload profile P (mixed, nearfull, burst, lifetime, pipeline or all) and exit\n"
+			"\t-q:\tMeasure queue slabs with -t / 2 producer-consumer pairs and exit\n"
+			"\t-r N:\tMeasure random touch latency over N MiB and exit\n"
+			"\t-t N:\tNumber of threads to test up to\n"
+			"\t-w N:\tNumber of untimed operations per thread before timing with -l\n"
+			"\t-x:\tMeasure cross-thread frees with -t / 2 producer-consumer pairs and exit\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long n_tds, n_ops, n_slabs, touch_mb, n_warmup, share, occupancy;
+	enum bench_format format;
+	const char *profile;
+	int opt, cache, div, full, latency, queue, xfree;
+
+	n_slabs = n_tds = 2;
+	n_ops = 10 * 1000 * 1000;
+	touch_mb = 0;
+	n_warmup = ULONG_MAX;
+	share = BENCH_PROFILE_SHARE;
+	occupancy = 50;
+	profile = NULL;
+	format = BENCH_FORMAT_CSV;
+	cache = div = full = latency = queue = xfree = 0;
+
+	while ((opt = getopt(argc, argv, "a:c:Cdfln:o:O:p:qr:t:w:x")) != -1) {
+		switch (opt) {
+		case 'a':
+			errno = 0;
+			n_slabs = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		case 'c':
+			errno = 0;
+			share = strtoul(optarg, NULL, 0);
+			if (errno != 0 || share == 0) {
+				usage();
+			}
+			break;
+		case 'C':
+			cache = 1;
+			break;
+		case 'd':
+			div = 1;
+			break;
+		case 'f':
+			full = 1;
+			break;
+		case 'l':
+			latency = 1;
+			break;
+		case 'n':
+			errno = 0;
+			n_ops = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		case 'o':
+			if (strcmp(optarg, "csv") == 0) {
+				format = BENCH_FORMAT_CSV;
+			} else if (strcmp(optarg, "json") == 0) {
+				format = BENCH_FORMAT_JSON;
+			} else {
+				usage();
+			}
+			break;
+		case 'O':
+			errno = 0;
+			occupancy = strtoul(optarg, NULL, 0);
+			if (errno != 0 || occupancy > 100) {
+				usage();
+			}
+			break;
+		case 'p':
+			profile = optarg;
+			break;
+		case 'q':
+			queue = 1;
+			break;
+		case 'r':
+			errno = 0;
+			touch_mb = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		case 't':
+			errno = 0;
+			n_tds = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		case 'w':
+			errno = 0;
+			n_warmup = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		case 'x':
+			xfree = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (cache != 0) {
+		bench_cache_regions("regions", 0);
+		bench_cache_regions("regions (colored)", USLAB_COLOR);
+		bench_cache_objects("objects (56 bytes)", 56, 0);
+		bench_cache_objects("objects (56 bytes, aligned)", 56,
+		    USLAB_ALIGN(64));
+		return EX_OK;
+	}
+
+	if (div != 0) {
+		bench_div("uslab", 64, 0);
+		bench_div("uslab", 48, 0);
+		bench_div("uslab (colored)", 64, USLAB_COLOR);
+		return EX_OK;
+	}
+
+	if (full != 0) {
+		bench_full("uslab", n_slabs, 0);
+		bench_full("uslab (tagged)", n_slabs, USLAB_TAGGED);
+		return EX_OK;
+	}
+
+	if (xfree != 0) {
+		n_tds = MAX(n_tds / 2, 1);
+		bench_xfree("uslab", n_tds, n_ops, 0, uslab_alloc, uslab_free);
+		bench_xfree("uslab (remote)", n_tds, n_ops, USLAB_REMOTE,
+		    uslab_alloc, uslab_free);
+		bench_xfree("uslab (tagged)", n_tds, n_ops, USLAB_TAGGED,
+		    uslab_alloc, uslab_free);
+		bench_xfree("uslab (tagged, remote)", n_tds, n_ops,
+		    USLAB_TAGGED | USLAB_REMOTE, uslab_alloc, uslab_free);
+		bench_xfree("malloc", n_tds, n_ops, 0, bench_xfree_malloc,
+		    bench_xfree_free);
+		bench_xfree("jemalloc", n_tds, n_ops, 0, bench_xfree_jemalloc,
+		    bench_xfree_jefree);
+		return EX_OK;
+	}
+
+	if (queue != 0) {
+		n_tds = MAX(n_tds / 2, 1);
+		bench_queue("uslab (spsc)", n_tds, n_ops, 1, USLAB_QUEUE_SPSC);
+		bench_queue("uslab (spsc)", n_tds, n_ops, BENCH_QUEUE_BATCH,
+		    USLAB_QUEUE_SPSC);
+		bench_queue("uslab (mpmc)", n_tds, n_ops, 1, USLAB_QUEUE);
+		bench_queue("uslab (mpmc)", n_tds, n_ops, BENCH_QUEUE_BATCH,
+		    USLAB_QUEUE);
+		return EX_OK;
+	}
+
+	if (profile != NULL) {
+		bench_profiles_run(profile, n_tds, n_slabs, n_ops, share,
+		    occupancy);
+		return EX_OK;
+	}
+
+	if (touch_mb != 0) {
+		bench_touch("touch (4 KiB pages)", touch_mb << 20, 0);
+		bench_touch("touch (THP)", touch_mb << 20, USLAB_THP);
+		bench_touch("touch (2 MiB hugetlb)", touch_mb << 20,
+		    USLAB_HUGE_2MB);
+		bench_touch("touch (1 GiB hugetlb)", touch_mb << 20,
+		    USLAB_HUGE_1GB);
+		return EX_OK;
+	}
+
+	state = calloc(n_tds, sizeof (*state));
+	for (unsigned long i = 0; i < n_tds; i++) {
+		state[i].n_ops = n_ops;
+		state[i].tid = i;
+		state[i].ptrs = calloc(n_ops, sizeof (void *));
+	}
+
+	if (latency != 0) {
+		if (format == BENCH_FORMAT_CSV) {
+			printf("allocator,threads,op,count,min,mean,p50,p90,"
+			    "p99,p99.9,max,tsc_overhead\n");
+		}
+
+		for (unsigned long t = 1; t <= n_tds; t++) {
+			bench_latency(format, "uslab", t, n_slabs, n_ops,
+			    n_warmup, 0, NULL, NULL);
+			bench_latency(format, "uslab (tagged)", t, n_slabs,
+			    n_ops, n_warmup, USLAB_TAGGED, NULL, NULL);
+			bench_latency(format, "uslab (magazine)", t, n_slabs,
+			    n_ops, n_warmup, USLAB_MAGAZINE, NULL, NULL);
+			bench_latency(format, "malloc", t, n_slabs, n_ops,
+			    n_warmup, 0, bench_xfree_malloc, bench_xfree_free);
+			bench_latency(format, "jemalloc", t, n_slabs, n_ops,
+			    n_warmup, 0, bench_xfree_jemalloc,
+			    bench_xfree_jefree);
+		}
+		return EX_OK;
+	}
+
+	for (unsigned long t = 1; t <= n_tds; t++) {
+		bench_uslab("uslab", bench_td_uslab, t, n_slabs, n_ops, 0);
+		bench_uslab("uslab (tagged)", bench_td_uslab, t, n_slabs,
+		    n_ops, USLAB_TAGGED);
+		bench_uslab("uslab (relocatable)", bench_td_uslab, t, n_slabs,
+		    n_ops, USLAB_RELOCATABLE);
+		bench_uslab("uslab (magazine)", bench_td_uslab, t, n_slabs,
+		    n_ops, USLAB_MAGAZINE);
+		bench_uslab("uslab (stats)", bench_td_uslab, t, n_slabs,
+		    n_ops, USLAB_STATS);
+		bench_uslab("uslab (debug)", bench_td_uslab, t, n_slabs,
+		    n_ops, USLAB_DEBUG);
+		bench_uslab("uslab (poison)", bench_td_uslab, t, n_slabs,
+		    n_ops, USLAB_DEBUG | USLAB_POISON);
+		bench_uslab("uslab (bulk)", bench_td_uslab_bulk, t, n_slabs,
+		    n_ops, 0);
+		bench_uslab("uslab (percpu)", bench_td_uslab, t, n_slabs,
+		    n_ops, USLAB_PERCPU);
+
+		bench_run("malloc", bench_td_malloc, t);
+		bench_run("jemalloc", bench_td_jemalloc, t);
 	}
-	fprintf(stderr, "td_total: %" PRIu64 "\n\n", td_total);
 
 	return EX_OK;
 }
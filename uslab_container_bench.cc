@@ -0,0 +1,237 @@
+/*
+ * Copyright 2015 Fastly, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Insert and erase throughput of node-based standard containers with the
+ * default allocator, jemalloc, and uslab through uslab_allocator and
+ * uslab_resource. Each run inserts -n keys in a shuffled order and then
+ * erases them in another, so nodes are freed out of allocation order.
+ */
+
+#include <sys/param.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "jemalloc/jemalloc.h"
+#include "uslab.hpp"
+#include "rdtscp.h"
+
+/* jemalloc as a memory resource. */
+class je_resource : public std::pmr::memory_resource {
+protected:
+	void *
+	do_allocate(size_t bytes, size_t align) override
+	{
+		void *p;
+
+		if (align <= alignof (max_align_t)) {
+			p = je_malloc(bytes);
+		} else if (je_posix_memalign(&p, align, bytes) != 0) {
+			p = nullptr;
+		}
+
+		if (p == nullptr) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	void
+	do_deallocate(void *p, size_t bytes, size_t align) override
+	{
+
+		(void)bytes;
+		(void)align;
+		je_free(p);
+	}
+
+	bool
+	do_is_equal(const std::pmr::memory_resource &other) const noexcept
+	    override
+	{
+
+		return this == &other;
+	}
+};
+
+static std::vector<int> bench_ins, bench_del;
+
+/* Cycles to insert every key and erase them again, best of n_runs. */
+template <typename C>
+static uint64_t
+bench_list(C &c, uint64_t n_runs)
+{
+	uint64_t best, st;
+	size_t i;
+
+	best = UINT64_MAX;
+	for (uint64_t r = 0; r < n_runs; r++) {
+		std::vector<typename C::iterator> it;
+
+		it.reserve(bench_ins.size());
+		st = rdtscp();
+		for (i = 0; i < bench_ins.size(); i++) {
+			it.push_back(c.insert(c.end(), bench_ins[i]));
+		}
+		for (i = 0; i < bench_del.size(); i++) {
+			c.erase(it[bench_del[i]]);
+		}
+		best = MIN(best, rdtscp() - st);
+	}
+
+	return best;
+}
+
+template <typename C>
+static uint64_t
+bench_map(C &c, uint64_t n_runs)
+{
+	uint64_t best, st;
+	size_t i;
+
+	best = UINT64_MAX;
+	for (uint64_t r = 0; r < n_runs; r++) {
+		st = rdtscp();
+		for (i = 0; i < bench_ins.size(); i++) {
+			c.emplace(bench_ins[i], i);
+		}
+		for (i = 0; i < bench_del.size(); i++) {
+			c.erase(bench_del[i]);
+		}
+		best = MIN(best, rdtscp() - st);
+	}
+
+	return best;
+}
+
+static void
+bench_report(const char *container, const char *alloc, uint64_t cycles)
+{
+
+	printf("%-14s %-18s cycles/op: %.2f\n", container, alloc,
+	    (double)cycles / (bench_ins.size() + bench_del.size()));
+}
+
+template <typename K, typename V>
+using uslab_map_alloc = uslab_allocator<std::pair<const K, V> >;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "Usage: uslab_container_bench [-n keys] [-r runs]\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t n_keys, n_runs;
+	int c;
+
+	n_keys = 1000000;
+	n_runs = 5;
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_keys = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			n_runs = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	std::mt19937_64 rng(42);
+	for (uint64_t i = 0; i < n_keys; i++) {
+		bench_ins.push_back(i);
+		bench_del.push_back(i);
+	}
+	std::shuffle(bench_ins.begin(), bench_ins.end(), rng);
+	std::shuffle(bench_del.begin(), bench_del.end(), rng);
+
+	/*
+	 * Nodes are at most 48 bytes; hash table buckets go upstream. Each
+	 * class has room for every key, plus some for headers. Every
+	 * container gets a fresh set, so that none starts out with freelists
+	 * another one shuffled.
+	 */
+	size_t class_len = n_keys * 64 + (1 << 20);
+	je_resource je;
+
+	{
+		uslab_resource ur(64, class_len, 1, USLAB_MAGAZINE);
+		uslab_resource pr(64, class_len, 1, USLAB_MAGAZINE);
+		std::list<int> a;
+		std::pmr::list<int> b(&je);
+		std::list<int, uslab_allocator<int> > u(
+		    (uslab_allocator<int>(ur.set())));
+		std::pmr::list<int> p(&pr);
+
+		bench_report("list", "default", bench_list(a, n_runs));
+		bench_report("list", "jemalloc", bench_list(b, n_runs));
+		bench_report("list", "uslab (allocator)", bench_list(u, n_runs));
+		bench_report("list", "uslab (pmr)", bench_list(p, n_runs));
+	}
+
+	{
+		uslab_resource ur(64, class_len, 1, USLAB_MAGAZINE);
+		uslab_resource pr(64, class_len, 1, USLAB_MAGAZINE);
+		std::map<int, uint64_t> a;
+		std::pmr::map<int, uint64_t> b(&je);
+		std::map<int, uint64_t, std::less<int>,
+		    uslab_map_alloc<int, uint64_t> > u(
+		    (uslab_map_alloc<int, uint64_t>(ur.set())));
+		std::pmr::map<int, uint64_t> p(&pr);
+
+		bench_report("map", "default", bench_map(a, n_runs));
+		bench_report("map", "jemalloc", bench_map(b, n_runs));
+		bench_report("map", "uslab (allocator)", bench_map(u, n_runs));
+		bench_report("map", "uslab (pmr)", bench_map(p, n_runs));
+	}
+
+	{
+		uslab_resource ur(64, class_len, 1, USLAB_MAGAZINE);
+		uslab_resource pr(64, class_len, 1, USLAB_MAGAZINE);
+		std::unordered_map<int, uint64_t> a;
+		std::pmr::unordered_map<int, uint64_t> b(&je);
+		std::unordered_map<int, uint64_t, std::hash<int>,
+		    std::equal_to<int>, uslab_map_alloc<int, uint64_t> > u(
+		    0, std::hash<int>(), std::equal_to<int>(),
+		    uslab_map_alloc<int, uint64_t>(ur.set()));
+		std::pmr::unordered_map<int, uint64_t> p(&pr);
+
+		bench_report("unordered_map", "default", bench_map(a, n_runs));
+		bench_report("unordered_map", "jemalloc", bench_map(b, n_runs));
+		bench_report("unordered_map", "uslab (allocator)",
+		    bench_map(u, n_runs));
+		bench_report("unordered_map", "uslab (pmr)", bench_map(p, n_runs));
+	}
+
+	return EX_OK;
+}
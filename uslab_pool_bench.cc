@@ -0,0 +1,204 @@
+/*
+ * Copyright 2015 Fastly, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Compares uslab_pool with the hand-written placement new and destructor
+ * calls over uslab_alloc and uslab_free that it replaces, one object at a
+ * time and in bulk. Each round constructs a window of objects and then
+ * destroys them all, so the freelists see the same pattern either way.
+ */
+
+#include <sys/param.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <new>
+
+#include "uslab.hpp"
+#include "rdtscp.h"
+
+#define	BENCH_WINDOW	256
+
+struct bench_obj {
+	uint64_t	v[4];
+
+	explicit bench_obj(uint64_t x)
+	{
+
+		v[0] = x;
+	}
+
+	~bench_obj()
+	{
+
+		/* Something the compiler can't drop. */
+		__asm__ __volatile__("" : : "r" (v[0]) : "memory");
+	}
+};
+
+typedef uslab_pool<bench_obj> bench_pool;
+
+static uint64_t
+bench_raw(bench_pool &pool, uint64_t rounds)
+{
+	struct uslab *a = pool.slab();
+	bench_obj *p[BENCH_WINDOW];
+	uint64_t st, i, r;
+	void *q;
+
+	st = rdtscp();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			q = uslab_alloc(a);
+			if (q == NULL) {
+				abort();
+			}
+			p[i] = new (q) bench_obj(i);
+		}
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			p[i]->~bench_obj();
+			uslab_free(a, p[i]);
+		}
+	}
+
+	return rdtscp() - st;
+}
+
+static uint64_t
+bench_make(bench_pool &pool, uint64_t rounds)
+{
+	bench_pool::handle h[BENCH_WINDOW];
+	uint64_t st, i, r;
+
+	st = rdtscp();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			h[i] = pool.make(i);
+		}
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			h[i].reset();
+		}
+	}
+
+	return rdtscp() - st;
+}
+
+static uint64_t
+bench_raw_bulk(bench_pool &pool, uint64_t rounds)
+{
+	struct uslab *a = pool.slab();
+	void *p[BENCH_WINDOW];
+	uint64_t st, i, r;
+
+	st = rdtscp();
+	for (r = 0; r < rounds; r++) {
+		if (uslab_alloc_bulk(a, p, BENCH_WINDOW) != BENCH_WINDOW) {
+			abort();
+		}
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			new (p[i]) bench_obj(i);
+		}
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			static_cast<bench_obj *>(p[i])->~bench_obj();
+		}
+		uslab_free_bulk(a, p, BENCH_WINDOW);
+	}
+
+	return rdtscp() - st;
+}
+
+static uint64_t
+bench_pool_bulk(bench_pool &pool, uint64_t rounds)
+{
+	bench_obj *p[BENCH_WINDOW];
+	uint64_t st, r;
+
+	st = rdtscp();
+	for (r = 0; r < rounds; r++) {
+		if (pool.create_bulk(p, BENCH_WINDOW, r) != BENCH_WINDOW) {
+			abort();
+		}
+		pool.destroy_bulk(p, BENCH_WINDOW);
+	}
+
+	return rdtscp() - st;
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "Usage: uslab_pool_bench [-n ops] [-r runs]\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		uint64_t	(*fn)(bench_pool &, uint64_t);
+	} benches[] = {
+		{ "raw", bench_raw },
+		{ "pool (make)", bench_make },
+		{ "raw (bulk)", bench_raw_bulk },
+		{ "pool (bulk)", bench_pool_bulk },
+	};
+	uint64_t n_ops, n_runs, rounds, best, t;
+	size_t b;
+	int c;
+
+	n_ops = 10000000;
+	n_runs = 5;
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_ops = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			n_runs = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	/* An op is one construction and allocation, or one destruction and free. */
+	rounds = MAX(n_ops / (2 * BENCH_WINDOW), 1);
+	bench_pool pool(BENCH_WINDOW, 1);
+
+	/*
+	 * Runs alternate between the variants, and each reports its best, so
+	 * that frequency changes and noisy neighbours hit them all alike.
+	 */
+	for (b = 0; b < sizeof (benches) / sizeof (benches[0]); b++) {
+		benches[b].fn(pool, rounds / 10 + 1);
+	}
+
+	for (b = 0; b < sizeof (benches) / sizeof (benches[0]); b++) {
+		best = UINT64_MAX;
+		for (uint64_t i = 0; i < n_runs; i++) {
+			t = benches[b].fn(pool, rounds);
+			best = MIN(best, t);
+		}
+		printf("%-12s cycles/op: %.2f\n", benches[b].name,
+		    (double)best / (2 * rounds * BENCH_WINDOW));
+	}
+
+	return EX_OK;
+}
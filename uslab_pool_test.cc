@@ -0,0 +1,393 @@
+/*
+ * Copyright 2015 Fastly, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Tests for the C++ wrappers in uslab.hpp.
+ */
+
+#include <list>
+#include <map>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "uslab.hpp"
+
+extern "C" {
+#include "tap.h"
+}
+
+static int live;
+
+struct counted {
+	uint64_t	v;
+
+	explicit counted(uint64_t x) : v(x)
+	{
+
+		if (x == 13) {
+			throw std::runtime_error("unlucky");
+		}
+		live++;
+	}
+
+	~counted()
+	{
+
+		live--;
+	}
+};
+
+struct alignas(64) line {
+	char	c[10];
+};
+
+static uint64_t
+used(struct uslab *a)
+{
+	struct uslab_stats st;
+
+	uslab_stats(a, &st, NULL, 0);
+	return st.used;
+}
+
+static uint64_t
+set_used(struct uslab_set *s)
+{
+	uint64_t n;
+
+	n = 0;
+	for (unsigned int i = 0; i < s->nclasses; i++) {
+		n += used(s->classes[i]);
+	}
+
+	return n;
+}
+
+#ifdef USLAB_HAVE_PMR
+/* Counts what the resources under test pass upstream. */
+class counting_resource : public std::pmr::memory_resource {
+public:
+	uint64_t	live = 0;
+	uint64_t	total = 0;
+
+protected:
+	void *
+	do_allocate(size_t bytes, size_t align) override
+	{
+
+		live++;
+		total++;
+		return std::pmr::new_delete_resource()->allocate(bytes, align);
+	}
+
+	void
+	do_deallocate(void *p, size_t bytes, size_t align) override
+	{
+
+		live--;
+		std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+	}
+
+	bool
+	do_is_equal(const std::pmr::memory_resource &other) const noexcept
+	    override
+	{
+
+		return this == &other;
+	}
+};
+#endif
+
+int
+main(void)
+{
+
+	plan_no_plan();
+
+	is(uslab_pool<char>::size_class, sizeof (struct uslab_entry));
+	is(uslab_pool<counted>::size_class, 8);
+	is(uslab_pool<line>::size_class, 64);
+	is(uslab_pool<char[24]>::size_class, 24);
+
+	/* Handles destroy and free their objects. */
+	{
+		uslab_pool<counted> pool(64, 1);
+		uslab_pool<counted>::handle h, g;
+		counted *p;
+
+		h = pool.make(7);
+		is(h->v, 7);
+		is(live, 1);
+		is(used(pool.slab()), 1);
+		g = std::move(h);
+		is(h.get(), nullptr);
+		g.reset();
+		is(live, 0);
+		is(used(pool.slab()), 0);
+
+		p = pool.create(8);
+		is(p->v, 8);
+		is(live, 1);
+		pool.destroy(p);
+		is(live, 0);
+		pool.destroy(nullptr);
+	}
+
+	/* Throwing constructors leave nothing allocated. */
+	{
+		uslab_pool<counted> pool(64, 1);
+		bool threw;
+
+		threw = false;
+		try {
+			pool.make(13);
+		} catch (const std::runtime_error &) {
+			threw = true;
+		}
+		is_true(threw);
+		is(live, 0);
+		is(used(pool.slab()), 0);
+	}
+
+	/* So do empty slabs. */
+	{
+		uslab_pool<counted> pool(2, 1);
+		uslab_pool<counted>::handle h[3];
+		bool threw;
+
+		h[0] = pool.make(1);
+		h[1] = pool.make(2);
+		threw = false;
+		try {
+			h[2] = pool.make(3);
+		} catch (const std::bad_alloc &) {
+			threw = true;
+		}
+		is_true(threw);
+		is(live, 2);
+	}
+	is(live, 0);
+
+	/* Objects are aligned. */
+	{
+		uslab_pool<line> pool(64, 2);
+		uslab_pool<line>::handle h;
+		line *p[10];
+		uint64_t i;
+
+		is(pool.create_bulk(p, 10), 10);
+		for (i = 0; i < 10; i++) {
+			is((uintptr_t)p[i] % 64, 0);
+		}
+		pool.destroy_bulk(p, 10);
+		h = pool.make();
+		is((uintptr_t)h.get() % 64, 0);
+	}
+
+	/* Bulk construction. */
+	{
+		uslab_pool<counted> pool(200, 1);
+		uslab_pool<counted>::handle h[300];
+		counted *p[100];
+		bool threw;
+		uint64_t i;
+
+		is(pool.create_bulk(p, 100, 5), 100);
+		is(live, 100);
+		for (i = 0; i < 100; i++) {
+			if (p[i]->v != 5) {
+				break;
+			}
+		}
+		is(i, 100);
+		pool.destroy_bulk(p, 100);
+		is(live, 0);
+		is(used(pool.slab()), 0);
+
+		threw = false;
+		try {
+			pool.create_bulk(p, 100, 13);
+		} catch (const std::runtime_error &) {
+			threw = true;
+		}
+		is_true(threw);
+		is(live, 0);
+		is(used(pool.slab()), 0);
+
+		is(pool.make_bulk(h, 300, 6), 200);
+		is(live, 200);
+		is(h[199]->v, 6);
+		is(h[200].get(), nullptr);
+		for (i = 0; i < 100; i++) {
+			h[i].reset();
+		}
+		is(live, 100);
+		is(used(pool.slab()), 100);
+	}
+	is(live, 0);
+
+	/* Pools over other slabs. */
+	{
+		struct uslab *a, *b;
+		bool threw;
+
+		a = uslab_create_anonymous_flags(NULL, 64, 64, 1,
+		    USLAB_RELOCATABLE);
+		b = uslab_create_anonymous(NULL, 8, 64, 1);
+		{
+			uslab_pool<line> pool(a);
+			uslab_pool<line>::handle h;
+
+			h = pool.make();
+			is(pool.slab(), a);
+			is(used(a), 1);
+		}
+		is(used(a), 0);
+
+		threw = false;
+		try {
+			uslab_pool<line> pool(b);
+		} catch (const std::invalid_argument &) {
+			threw = true;
+		}
+		is_true(threw);
+		uslab_destroy_map(a);
+		uslab_destroy_map(b);
+	}
+
+	/* Allocators take nodes from the set, and big arrays from the heap. */
+	{
+		struct uslab_set *s;
+		uint64_t i;
+
+		s = uslab_set_create_anonymous(NULL, 16, 256, 64 * 1024, 1, 0);
+		isnt(s, nullptr);
+		{
+			uslab_allocator<int> alloc(s);
+			std::list<int, uslab_allocator<int> > l(alloc);
+			std::map<int, int, std::less<int>,
+			    uslab_allocator<std::pair<const int, int> > > m(alloc);
+			std::vector<int, uslab_allocator<int> > v(alloc);
+
+			for (i = 0; i < 1000; i++) {
+				l.push_back(i);
+				m[i] = i;
+			}
+			is(set_used(s), 2000);
+			is_true(uslab_set_holds(s, &l.front()));
+			is_true(uslab_set_holds(s, &m.begin()->second));
+			is_true(l.get_allocator() == alloc);
+
+			v.resize(10000);
+			is_true(uslab_set_holds(s, v.data()) == false);
+			v.resize(10);
+			v.shrink_to_fit();
+			is_true(uslab_set_holds(s, v.data()));
+
+			for (i = 0; i < 500; i++) {
+				l.pop_front();
+				m.erase(i);
+			}
+			is(set_used(s), 1000 + 1);
+		}
+		is(set_used(s), 0);
+
+		/* A full class sends the rest to the heap. */
+		{
+			std::list<uint64_t, uslab_allocator<uint64_t> > l(
+			    (uslab_allocator<uint64_t>(s)));
+
+			for (i = 0; i < 5000; i++) {
+				l.push_back(i);
+			}
+			is_true(uslab_set_holds(s, &l.front()));
+			is_true(uslab_set_holds(s, &l.back()) == false);
+			is(l.size(), 5000);
+		}
+		is(set_used(s), 0);
+
+		/* Sizes that wrap and odd alignments fail, not alias. */
+		is(uslab_set_alloc_aligned(s, SIZE_MAX, 8), nullptr);
+		is(uslab_set_alloc_aligned(s, SIZE_MAX - 2, 16), nullptr);
+		is(uslab_set_alloc_aligned(s, 8, 3), nullptr);
+		is(uslab_set_alloc_aligned(s, 8, 0), nullptr);
+		is(set_used(s), 0);
+		uslab_set_destroy(s);
+	}
+
+#ifdef USLAB_HAVE_PMR
+	{
+		counting_resource up;
+		uint64_t total;
+		void *p;
+
+		{
+			uslab_resource r(256, 64 * 1024, 1, 0, &up);
+
+			is(r.upstream_resource(), &up);
+
+			p = r.allocate(20, 16);
+			is((uintptr_t)p % 16, 0);
+			is_true(uslab_set_holds(r.set(), p));
+			is(uslab_set_size(r.set(), 20), 24);
+			r.deallocate(p, 20, 16);
+
+			p = r.allocate(100, 8192);
+			is((uintptr_t)p % 8192, 0);
+			is_true(uslab_set_holds(r.set(), p) == false);
+			is(up.live, 1);
+			r.deallocate(p, 100, 8192);
+			is(up.live, 0);
+
+			p = r.allocate(1000);
+			is_true(uslab_set_holds(r.set(), p) == false);
+			r.deallocate(p, 1000);
+			is(up.total, 2);
+			is(set_used(r.set()), 0);
+
+			{
+				std::pmr::list<int> l(&r);
+				std::pmr::unordered_map<int, int> m(&r);
+
+				for (int i = 0; i < 1000; i++) {
+					l.push_back(i);
+					m[i] = i;
+				}
+				is(set_used(r.set()), 2000);
+				is_true(up.live > 0);
+				is_true(r.is_equal(r));
+				is_true(r.is_equal(up) == false);
+			}
+			is(set_used(r.set()), 0);
+			is(up.live, 0);
+
+			/*
+			 * A size that would wrap when rounded goes upstream,
+			 * which may throw, rather than to a small class.
+			 */
+			total = up.total;
+			try {
+				p = r.allocate(SIZE_MAX - 4, 8);
+				r.deallocate(p, SIZE_MAX - 4, 8);
+			} catch (const std::bad_alloc &) {
+			}
+			is(up.total, total + 1);
+			is(set_used(r.set()), 0);
+		}
+	}
+#endif
+
+	return 0;
+}
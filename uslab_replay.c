@@ -0,0 +1,680 @@
+/*
+ * Copyright 2015 Fastly, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Replays a trace written by uslab_trace_start against uslab slabs of other
+ * shapes, and against malloc and jemalloc, at full speed. Reports
+ * throughput, the latency of every allocation and free, and the peak
+ * resident memory each allocator needed.
+ */
+
+#define	_GNU_SOURCE
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ck_pr.h>
+
+#include "jemalloc/jemalloc.h"
+#include "uslab.h"
+#include "hist.h"
+#include "rdtscp.h"
+
+#define	REPLAY_MAX_CONFIGS	16
+
+/* Stands in for an object the allocator under test couldn't give us. */
+#define	REPLAY_OOM		((void *)1)
+
+/*
+ * A call to replay: the record's op and index, and its turn among the calls
+ * on its object.
+ */
+struct replay_call {
+	uint64_t	word;
+	uint64_t	turn;
+};
+
+/* The object of each trace index, and whose turn it is. */
+struct replay_slot {
+	void		*p;
+	uint64_t	turn;
+};
+
+struct replay_td {
+	pthread_t	pt;
+	struct replay	*r;
+	uint64_t	*recs;		/* Numbers of our records, in the trace */
+	struct replay_call *calls;
+	uint64_t	n;
+	uint64_t	ooms;
+	struct hist	hist[2];	/* Allocations, frees */
+};
+
+struct replay {
+	const char	*name;
+	struct uslab	*slab;
+	size_t		size;
+	void		*(*alloc)(struct uslab *, size_t);
+	void		(*free)(struct uslab *, void *);
+	unsigned int	flags;
+
+	struct replay_slot *map;
+	uint64_t	overhead;
+	pthread_barrier_t barrier;
+};
+
+struct replay_trace {
+	struct uslab_trace_hdr hdr;
+	struct uslab_trace_rec *recs;
+	uint64_t	*prelive;	/* Indices live when the trace began */
+	uint64_t	nprelive;
+	uint64_t	peak;		/* Most objects live at once */
+	uint64_t	ooms;
+	uint64_t	skipped;
+	uint64_t	ops;
+	struct replay_td *tds;
+};
+
+static void *
+replay_uslab_alloc(struct uslab *a, size_t size)
+{
+
+	(void)size;
+	return uslab_alloc(a);
+}
+
+static void
+replay_uslab_free(struct uslab *a, void *p)
+{
+
+	uslab_free(a, p);
+}
+
+static void *
+replay_malloc(struct uslab *a, size_t size)
+{
+
+	(void)a;
+	return malloc(size);
+}
+
+static void
+replay_free(struct uslab *a, void *p)
+{
+
+	(void)a;
+	free(p);
+}
+
+static void *
+replay_jemalloc(struct uslab *a, size_t size)
+{
+
+	(void)a;
+	return je_malloc(size);
+}
+
+static void
+replay_jefree(struct uslab *a, void *p)
+{
+
+	(void)a;
+	je_free(p);
+}
+
+static void
+replay_load(struct replay_trace *t, const char *path)
+{
+	struct stat sb;
+	uint64_t n;
+	size_t len;
+	ssize_t got;
+	char *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+		perror(path);
+		exit(EX_NOINPUT);
+	}
+
+	if (read(fd, &t->hdr, sizeof (t->hdr)) != sizeof (t->hdr) ||
+	    t->hdr.magic != USLAB_TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a uslab trace\n", path);
+		exit(EX_DATAERR);
+	}
+
+	/* A trace that was never stopped has records past nrecs. */
+	n = (sb.st_size - sizeof (t->hdr)) / sizeof (t->recs[0]);
+	if (n != t->hdr.nrecs) {
+		fprintf(stderr, "%s: %" PRIu64 " records, header says %"
+		    PRIu64 "\n", path, n, t->hdr.nrecs);
+	}
+
+	t->hdr.nrecs = n;
+	t->recs = malloc(n * sizeof (t->recs[0]));
+	if (t->recs == NULL) {
+		perror("malloc");
+		exit(EX_OSERR);
+	}
+
+	p = (char *)t->recs;
+	len = n * sizeof (t->recs[0]);
+	while (len > 0) {
+		got = read(fd, p, len);
+		if (got == -1 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			perror(path);
+			exit(EX_IOERR);
+		}
+		p += got;
+		len -= got;
+	}
+
+	close(fd);
+}
+
+/* The time of a thread's next call. */
+static inline uint64_t
+replay_ticks(const struct replay_trace *t, const uint64_t *next, uint64_t tid)
+{
+
+	return t->recs[t->tds[tid].recs[next[tid]]].ticks;
+}
+
+/*
+ * Split the trace into a list of calls per thread, and put those lists
+ * together again in time order, which respects each thread's own order.
+ * Following that, we find the objects freed before we saw them allocated,
+ * which were live when the trace began, and drop calls that don't fit the
+ * life of their object, which can only happen around calls that were under
+ * way as the trace was started or stopped. Each call is given its turn among
+ * the calls on its object, in that order too. Replay threads wait for their
+ * turns, and as every thread's calls and every object's turns follow the one
+ * order, they can't deadlock.
+ */
+static void
+replay_prepare(struct replay_trace *t)
+{
+	uint64_t *heap, *next, *end, *turns, i, j, k, nh, tid, index;
+	int64_t live, peak;
+	struct uslab_trace_rec *rec;
+	struct replay_td *td;
+	uint8_t *state;
+	unsigned int op;
+
+	t->tds = calloc(t->hdr.nthreads, sizeof (*t->tds));
+	heap = calloc(t->hdr.nthreads, sizeof (*heap));
+	next = calloc(t->hdr.nthreads, sizeof (*next));
+	end = calloc(t->hdr.nthreads, sizeof (*end));
+	state = calloc(t->hdr.nobjs, 1);
+	turns = calloc(t->hdr.nobjs, sizeof (*turns));
+	t->prelive = calloc(t->hdr.nobjs, sizeof (*t->prelive));
+	if (t->tds == NULL || heap == NULL || next == NULL || end == NULL ||
+	    state == NULL || turns == NULL || t->prelive == NULL) {
+		perror("calloc");
+		exit(EX_OSERR);
+	}
+
+	for (i = 0; i < t->hdr.nrecs; i++) {
+		tid = USLAB_TRACE_TID(t->recs[i].word);
+		if (tid >= t->hdr.nthreads ||
+		    USLAB_TRACE_INDEX(t->recs[i].word) >= t->hdr.nobjs) {
+			fprintf(stderr, "record %" PRIu64 " is corrupt\n", i);
+			exit(EX_DATAERR);
+		}
+		t->tds[tid].n++;
+	}
+
+	for (tid = 0; tid < t->hdr.nthreads; tid++) {
+		t->tds[tid].recs = malloc(t->tds[tid].n * sizeof (uint64_t));
+		t->tds[tid].calls = malloc(t->tds[tid].n *
+		    sizeof (struct replay_call));
+		if (t->tds[tid].n != 0 &&
+		    (t->tds[tid].recs == NULL || t->tds[tid].calls == NULL)) {
+			perror("malloc");
+			exit(EX_OSERR);
+		}
+		t->tds[tid].n = 0;
+	}
+
+	/* Threads are written out a ring at a time, in order. */
+	for (i = 0; i < t->hdr.nrecs; i++) {
+		td = &t->tds[USLAB_TRACE_TID(t->recs[i].word)];
+		td->recs[td->n++] = i;
+	}
+
+	/* A heap of threads, keyed on the time of their next call. */
+	nh = 0;
+	for (tid = 0; tid < t->hdr.nthreads; tid++) {
+		end[tid] = t->tds[tid].n;
+		if (end[tid] == 0) {
+			continue;
+		}
+		for (k = nh++; k > 0; k = j) {
+			j = (k - 1) / 2;
+			if (replay_ticks(t, next, heap[j]) <=
+			    replay_ticks(t, next, tid)) {
+				break;
+			}
+			heap[k] = heap[j];
+		}
+		heap[k] = tid;
+	}
+
+	/*
+	 * Objects live at the start are only found as they're freed, so we
+	 * count what's live less them, and add them in at the end.
+	 */
+	live = peak = 0;
+	while (nh > 0) {
+		tid = heap[0];
+		rec = &t->recs[t->tds[tid].recs[next[tid]]];
+		op = USLAB_TRACE_OP(rec->word);
+		index = USLAB_TRACE_INDEX(rec->word);
+
+		/* state: bit 0 live, bit 1 seen. */
+		if (op == USLAB_TRACE_OOM) {
+			t->ooms++;
+			op = 0;
+		} else if (op == USLAB_TRACE_ALLOC && (state[index] & 1) == 0) {
+			state[index] = 3;
+			peak = MAX(peak, ++live);
+		} else if (op == USLAB_TRACE_FREE && (state[index] & 1) != 0) {
+			state[index] = 2;
+			live--;
+		} else if (op == USLAB_TRACE_FREE && state[index] == 0) {
+			state[index] = 2;
+			t->prelive[t->nprelive++] = index;
+			live--;
+		} else {
+			t->skipped++;
+			op = 0;
+		}
+
+		/* We're done with its time, and keep its turn there instead. */
+		if (op == 0) {
+			rec->word = 0;
+		} else {
+			rec->ticks = turns[index]++;
+		}
+
+		/* Move on to this thread's next call and sift it down. */
+		if (++next[tid] == end[tid]) {
+			tid = heap[--nh];
+		}
+		for (k = 0; (j = 2 * k + 1) < nh; k = j) {
+			if (j + 1 < nh && replay_ticks(t, next, heap[j + 1]) <
+			    replay_ticks(t, next, heap[j])) {
+				j++;
+			}
+			if (replay_ticks(t, next, tid) <=
+			    replay_ticks(t, next, heap[j])) {
+				break;
+			}
+			heap[k] = heap[j];
+		}
+		if (nh > 0) {
+			heap[k] = tid;
+		}
+	}
+
+	t->peak = t->nprelive + peak;
+
+	/* Swap the record numbers for the calls we'll make. */
+	for (tid = 0; tid < t->hdr.nthreads; tid++) {
+		td = &t->tds[tid];
+		for (i = j = 0; i < td->n; i++) {
+			rec = &t->recs[td->recs[i]];
+			if (rec->word != 0) {
+				td->calls[j].word = rec->word;
+				td->calls[j++].turn = rec->ticks;
+			}
+		}
+		td->n = j;
+		t->ops += j;
+		free(td->recs);
+		td->recs = NULL;
+	}
+
+	free(heap);
+	free(next);
+	free(end);
+	free(state);
+	free(turns);
+	free(t->recs);
+	t->recs = NULL;
+}
+
+/*
+ * Make our calls in order, each waiting for its turn at its object: the
+ * calls on an object are made in the order they were traced, by whichever
+ * threads made them.
+ */
+static void *
+replay_td(void *arg)
+{
+	struct replay_call *c;
+	struct replay_slot *slot;
+	struct replay_td *td;
+	struct replay *r;
+	uint64_t i, st, et;
+	void *p;
+
+	td = arg;
+	r = td->r;
+	pthread_barrier_wait(&r->barrier);
+
+	for (i = 0; i < td->n; i++) {
+		c = &td->calls[i];
+		slot = &r->map[USLAB_TRACE_INDEX(c->word)];
+		while (ck_pr_load_64(&slot->turn) != c->turn) {
+			sched_yield();
+		}
+		ck_pr_fence_load();
+
+		if (USLAB_TRACE_OP(c->word) == USLAB_TRACE_ALLOC) {
+			st = rdtscp();
+			p = r->alloc(r->slab, r->size);
+			et = rdtscp();
+			hist_add(&td->hist[0],
+			    et - st - MIN(et - st, r->overhead));
+			if (p == NULL) {
+				p = REPLAY_OOM;
+				td->ooms++;
+			}
+			slot->p = p;
+		} else {
+			if (slot->p != REPLAY_OOM) {
+				st = rdtscp();
+				r->free(r->slab, slot->p);
+				et = rdtscp();
+				hist_add(&td->hist[1],
+				    et - st - MIN(et - st, r->overhead));
+			}
+			slot->p = NULL;
+		}
+
+		ck_pr_fence_store();
+		ck_pr_store_64(&slot->turn, c->turn + 1);
+	}
+
+	if (r->flags & USLAB_MAGAZINE) {
+		uslab_magazine_flush(r->slab);
+	}
+
+	pthread_barrier_wait(&r->barrier);
+	return NULL;
+}
+
+/* A line of /proc/self/status, in KiB, or 0. */
+static uint64_t
+replay_status(const char *field)
+{
+	char line[256];
+	uint64_t kb;
+	size_t len;
+	FILE *f;
+
+	kb = 0;
+	len = strlen(field);
+	if ((f = fopen("/proc/self/status", "r")) == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof (line), f) != NULL) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			kb = strtoull(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+
+	return kb;
+}
+
+/*
+ * Replay the trace once, in a child of our own so that every allocator
+ * starts from the same heap, and its peak resident size is its own. The
+ * high-water mark is reset before we start, and everything resident above
+ * what was then is charged to the allocator: its metadata, and the pages
+ * of the objects it handed out.
+ */
+static void
+replay_run(struct replay_trace *t, struct replay *r, uint64_t npt,
+    uint64_t nelem)
+{
+	struct timespec st, et;
+	struct hist total[2];
+	uint64_t i, base, peak, ooms;
+	double secs;
+	pid_t pid;
+	int fd, status;
+
+	fflush(stdout);
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		exit(EX_OSERR);
+	} else if (pid != 0) {
+		while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+			;
+		return;
+	}
+
+	r->map = calloc(t->hdr.nobjs, sizeof (*r->map));
+	if (r->map == NULL) {
+		perror("calloc");
+		_exit(EX_OSERR);
+	}
+
+	if ((fd = open("/proc/self/clear_refs", O_WRONLY)) != -1) {
+		(void)write(fd, "5", 1);
+		close(fd);
+	}
+	base = replay_status("VmRSS");
+
+	if (r->alloc == replay_uslab_alloc) {
+		r->slab = uslab_create_anonymous_flags(NULL, r->size, nelem,
+		    npt, r->flags);
+		if (r->slab == NULL) {
+			perror("uslab_create_anonymous_flags");
+			_exit(EX_OSERR);
+		}
+	}
+
+	ooms = 0;
+	for (i = 0; i < t->nprelive; i++) {
+		r->map[t->prelive[i]].p = r->alloc(r->slab, r->size);
+		if (r->map[t->prelive[i]].p == NULL) {
+			r->map[t->prelive[i]].p = REPLAY_OOM;
+			ooms++;
+		}
+	}
+
+	r->overhead = rdtscp_overhead();
+	pthread_barrier_init(&r->barrier, NULL, t->hdr.nthreads + 1);
+	for (i = 0; i < t->hdr.nthreads; i++) {
+		t->tds[i].r = r;
+		memset(t->tds[i].hist, 0, sizeof (t->tds[i].hist));
+		t->tds[i].hist[0].min = t->tds[i].hist[1].min = UINT64_MAX;
+		pthread_create(&t->tds[i].pt, NULL, replay_td, &t->tds[i]);
+	}
+
+	pthread_barrier_wait(&r->barrier);
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	pthread_barrier_wait(&r->barrier);
+	clock_gettime(CLOCK_MONOTONIC, &et);
+
+	memset(total, 0, sizeof (total));
+	total[0].min = total[1].min = UINT64_MAX;
+	for (i = 0; i < t->hdr.nthreads; i++) {
+		pthread_join(t->tds[i].pt, NULL);
+		hist_merge(&total[0], &t->tds[i].hist[0]);
+		hist_merge(&total[1], &t->tds[i].hist[1]);
+		ooms += t->tds[i].ooms;
+	}
+
+	peak = replay_status("VmHWM");
+	peak -= MIN(peak, base);
+	secs = (et.tv_sec - st.tv_sec) + (et.tv_nsec - st.tv_nsec) / 1e9;
+	printf("%-24s %6" PRIu64 " %#6x %12.0f %6" PRIu64 " %6" PRIu64
+	    " %6" PRIu64 " %8" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64
+	    " %8" PRIu64 " %10" PRIu64 " %6" PRIu64 "\n",
+	    r->name, npt, r->flags, t->ops / secs,
+	    hist_quantile(&total[0], 0.5), hist_quantile(&total[0], 0.99),
+	    hist_quantile(&total[0], 0.999), total[0].max,
+	    hist_quantile(&total[1], 0.5), hist_quantile(&total[1], 0.99),
+	    hist_quantile(&total[1], 0.999), total[1].max,
+	    peak, ooms);
+	fflush(stdout);
+	_exit(EX_OK);
+}
+
+void
+usage(void)
+{
+
+	fprintf(stderr, "uslab_replay [-a N] [-F F] [-n N] [-s N] trace\n"
+			"\t-a N:\tReplay against slabs of N regions; may be repeated\n"
+			"\t-F F:\tReplay against slabs created with flags F; may be repeated\n"
+			"\t-n N:\tObjects per slab (default: as traced)\n"
+			"\t-s N:\tSize class (default: as traced)\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long npt[REPLAY_MAX_CONFIGS], flags[REPLAY_MAX_CONFIGS];
+	unsigned int n_npt, n_flags, i, j;
+	unsigned long size, nelem;
+	struct replay_trace t;
+	struct replay r;
+	int opt;
+
+	n_npt = n_flags = 0;
+	size = nelem = 0;
+
+	while ((opt = getopt(argc, argv, "a:F:n:s:")) != -1) {
+		switch (opt) {
+		case 'a':
+			errno = 0;
+			if (n_npt == REPLAY_MAX_CONFIGS) {
+				usage();
+			}
+			npt[n_npt] = strtoul(optarg, NULL, 0);
+			if (errno != 0 || npt[n_npt++] == 0) {
+				usage();
+			}
+			break;
+		case 'F':
+			errno = 0;
+			if (n_flags == REPLAY_MAX_CONFIGS) {
+				usage();
+			}
+			flags[n_flags++] = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		case 'n':
+			errno = 0;
+			nelem = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		case 's':
+			errno = 0;
+			size = strtoul(optarg, NULL, 0);
+			if (errno != 0) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+	}
+
+	memset(&t, 0, sizeof (t));
+	replay_load(&t, argv[optind]);
+	replay_prepare(&t);
+
+	if (n_npt == 0) {
+		npt[n_npt++] = t.hdr.pt_slabs;
+	}
+	if (n_flags == 0) {
+		flags[n_flags++] = t.hdr.flags &
+		    (USLAB_MAGAZINE | USLAB_TAGGED | USLAB_REMOTE);
+	}
+	if (size == 0) {
+		size = t.hdr.size_class;
+	}
+	if (nelem == 0) {
+		nelem = t.hdr.nelem;
+	}
+
+	printf("# %" PRIu64 " threads, %" PRIu64 " calls, %" PRIu64
+	    " objects live at most, %" PRIu64 " at the start; %" PRIu64
+	    " failed allocations and %" PRIu64 " stray calls not replayed\n",
+	    t.hdr.nthreads, t.ops, t.peak, t.nprelive, t.ooms, t.skipped);
+	printf("# latencies in cycles, peak in KiB\n");
+	printf("%-24s %6s %6s %12s %6s %6s %6s %8s %6s %6s %6s %8s %10s %6s\n",
+	    "allocator", "pt", "flags", "ops/s", "a.p50", "a.p99", "a.p999",
+	    "a.max", "f.p50", "f.p99", "f.p999", "f.max", "peak", "ooms");
+
+	memset(&r, 0, sizeof (r));
+	r.size = size;
+	r.alloc = replay_uslab_alloc;
+	r.free = replay_uslab_free;
+	r.name = "uslab";
+	for (i = 0; i < n_npt; i++) {
+		for (j = 0; j < n_flags; j++) {
+			r.flags = flags[j];
+			replay_run(&t, &r, npt[i], nelem);
+		}
+	}
+
+	r.flags = 0;
+	r.name = "malloc";
+	r.alloc = replay_malloc;
+	r.free = replay_free;
+	replay_run(&t, &r, 0, 0);
+
+	r.name = "jemalloc";
+	r.alloc = replay_jemalloc;
+	r.free = replay_jefree;
+	replay_run(&t, &r, 0, 0);
+
+	return EX_OK;
+}
@@ -15,20 +15,321 @@
  *
  */
 
+#define	_GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define	HAVE_RSEQ
+#endif
+#endif
+
 #include "uslab.h"
 #include "tap.h"
 
-__thread struct uslab_pt *uslab_pt = NULL;
+static int
+pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof (set), &set);
+}
+
+/* The region headers of a relocatable slab. */
+static struct uslab_pt *
+reloc_pts(struct uslab *a)
+{
+
+	return (struct uslab_pt *)((char *)a + (uintptr_t)a->pt_base);
+}
+
+#ifdef HAVE_RSEQ
+/*
+ * Take the calling thread out of rseq, as if glibc hadn't registered it.
+ * The kernel wants the length it was registered with, which glibc doesn't
+ * export.
+ */
+static bool
+rseq_unregister(void)
+{
+	struct rseq *rs;
+	uint32_t len;
+	char *tp;
+
+	__asm__ ("movq %%fs:0, %0" : "=r" (tp));
+	rs = (struct rseq *)(tp + __rseq_offset);
+	for (len = __rseq_size; len > 0 && len <= 1024; len++) {
+		if (syscall(SYS_rseq, rs, len, RSEQ_FLAG_UNREGISTER,
+		    RSEQ_SIG) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+#endif
+
+/* The pid half of a shared slab region's owner. */
+static pid_t
+owner_pid(uint64_t owner)
+{
+
+	return owner & ((1 << 22) - 1);
+}
+
+/* Whether region i of a slab is marked as having free objects. */
+static bool
+avail_bit(struct uslab *a, uint64_t i)
+{
+	uint64_t *avail = (uint64_t *)(a->pt_base + a->pt_max);
+
+	return (avail[i / 64] >> (i % 64)) & 1;
+}
+
+/* Objects marked 'k' are kept by uslab_shared_recover. */
+static bool
+keep_marked(void *p, void *arg)
+{
+
+	(void)arg;
+	return *(char *)p == 'k';
+}
+
+/* Whether fn(a, p) dies of SIGABRT, run in a child. */
+static bool
+aborts(void (*fn)(struct uslab *, void *), struct uslab *a, void *p)
+{
+	pid_t pid;
+	int st;
+
+	pid = fork();
+	if (pid == 0) {
+		/* Keep the complaint out of the test output. */
+		dup2(open("/dev/null", O_WRONLY), 2);
+		fn(a, p);
+		_exit(0);
+	}
+
+	return pid != -1 && waitpid(pid, &st, 0) == pid && WIFSIGNALED(st) &&
+	    WTERMSIG(st) == SIGABRT;
+}
+
+static void
+free_twice(struct uslab *a, void *p)
+{
+
+	uslab_free(a, p);
+	uslab_free(a, p);
+}
+
+/* The same, from a thread that owns no region, as a remote thread would. */
+static void
+free_twice_remote(struct uslab *a, void *p)
+{
+
+	uslab_pt = NULL;
+	free_twice(a, p);
+}
+
+static void
+free_bulk_one(struct uslab *a, void *p)
+{
+
+	uslab_free_bulk(a, &p, 1);
+}
+
+static void
+write_after_free(struct uslab *a, void *p)
+{
+
+	uslab_free(a, p);
+	((char *)p)[40] = 'x';
+	uslab_alloc(a);
+}
+
+static void
+zero_after_free(struct uslab *a, void *p)
+{
+
+	uslab_free(a, p);
+	memset((char *)p + sizeof (struct uslab_entry), 0,
+	    a->size_class - sizeof (struct uslab_entry));
+	uslab_alloc(a);
+}
+
+struct remote_free {
+	struct uslab	*a;
+	void		**objs;
+	uint64_t	n;
+	int		cpu;
+};
+
+static void *
+remote_free(void *arg)
+{
+	struct remote_free *rf = arg;
+	uint64_t i;
+
+	pin(rf->cpu);
+	for (i = 0; i < rf->n; i++) {
+		uslab_free(rf->a, rf->objs[i]);
+	}
+
+	return NULL;
+}
+
+struct queue_worker {
+	struct uslab	*a;
+	uint64_t	n;
+	uint64_t	sum;
+};
+
+/* Allocate n objects numbered 1..n and pass them through a's queue. */
+static void *
+queue_producer(void *arg)
+{
+	struct queue_worker *w = arg;
+	uint64_t i, *p;
+
+	for (i = 1; i <= w->n; i++) {
+		while ((p = uslab_alloc(w->a)) == NULL) {
+			sched_yield();
+		}
+		*p = i;
+		while (uslab_enqueue(w->a, p) == false) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+/* Take n objects from a's queue in batches, adding up their numbers. */
+static void *
+queue_consumer(void *arg)
+{
+	struct queue_worker *w = arg;
+	void *objs[8];
+	uint64_t i, k;
+
+	while (w->n > 0) {
+		k = uslab_dequeue_bulk(w->a, objs, w->n < 8 ? w->n : 8);
+		if (k == 0) {
+			sched_yield();
+			continue;
+		}
+		for (i = 0; i < k; i++) {
+			w->sum += *(uint64_t *)objs[i];
+			uslab_free(w->a, objs[i]);
+		}
+		w->n -= k;
+	}
+
+	return NULL;
+}
+
+/* Objects for caches, with their links out of the way. */
+struct cached {
+	uint64_t	magic;
+	uint64_t	link;
+	char		pad[48];
+};
+
+#define	CACHED_MAGIC	0xc0ffeeULL
+
+static int ctors, dtors;
+
+/* Fails with *arg if that's set. */
+static int
+cached_ctor(void *p, void *arg)
+{
+	struct cached *o = p;
+
+	if (*(int *)arg != 0) {
+		return *(int *)arg;
+	}
+
+	ctors++;
+	o->magic = CACHED_MAGIC;
+	return 0;
+}
+
+static void
+cached_dtor(void *p, void *arg)
+{
+	struct cached *o = p;
+
+	(void)arg;
+	dtors += (o->magic == CACHED_MAGIC);
+	o->magic = 0;
+}
+
+/*
+ * Check that the link field of an object of the single-region slab arg
+ * holds its freelist link, as freeing objects in address order left it, and
+ * scribble over it.
+ */
+static int bad_links;
+
+static void
+scribble_dtor(void *p, void *arg)
+{
+	struct uslab_pt *pt = &((struct uslab *)arg)->pt_base[0];
+	struct cached *o = p;
+
+	bad_links += o->link != (uintptr_t)(o - 1) &&
+	    o->link != (uintptr_t)(pt->base + pt->size);
+	o->link = ~0ULL;
+}
+
+/* Allocate and free an object of a, then exit. */
+static void *
+alloc_free(void *arg)
+{
+	struct uslab *a = arg;
+
+	uslab_free(a, uslab_alloc(a));
+	return NULL;
+}
+
+/* Objects for free_batch to free, from a thread of its own. */
+struct batch {
+	struct uslab	*a;
+	void		*objs[8];
+};
+
+static void *
+free_batch(void *arg)
+{
+	struct batch *b = arg;
+	unsigned int i;
+
+	for (i = 0; i < 8; i++) {
+		uslab_free(b->a, b->objs[i]);
+	}
+	return NULL;
+}
 
 int
 main(void)
@@ -181,5 +482,1772 @@ main(void)
 		uslab_destroy_heap(a);
 	}
 
+	/*
+	 * Test that magazines hand out every object exactly once, and that
+	 * flushing them returns everything to the slab.
+	 */
+	{
+		void *p[USLAB_MAGAZINE_SIZE * 2];
+		struct uslab *a;
+		uint64_t i, j;
+		int dups;
+
+		uslab_pt = NULL;
+		a = uslab_create_heap_flags(8, USLAB_MAGAZINE_SIZE * 2, 2,
+		    USLAB_MAGAZINE);
+		isnt(a, NULL);
+
+		for (i = 0; i < USLAB_MAGAZINE_SIZE * 2; i++) {
+			p[i] = uslab_alloc(a);
+			if (p[i] == NULL) {
+				break;
+			}
+		}
+		is(i, USLAB_MAGAZINE_SIZE * 2);
+		is(uslab_alloc(a), NULL);
+
+		dups = 0;
+		for (i = 0; i < USLAB_MAGAZINE_SIZE * 2; i++) {
+			for (j = i + 1; j < USLAB_MAGAZINE_SIZE * 2; j++) {
+				dups += (p[i] == p[j]);
+			}
+		}
+		is(dups, 0);
+
+		for (i = 0; i < USLAB_MAGAZINE_SIZE * 2; i++) {
+			uslab_free(a, p[i]);
+		}
+		uslab_magazine_flush(a);
+		is(a->pt_base[0].used, 0);
+		is(a->pt_base[1].used, 0);
+
+		for (i = 0; i < USLAB_MAGAZINE_SIZE * 2; i++) {
+			p[i] = uslab_alloc(a);
+			if (p[i] == NULL) {
+				break;
+			}
+		}
+		is(i, USLAB_MAGAZINE_SIZE * 2);
+
+		uslab_destroy_heap(a);
+	}
+
+	/* Test bulk allocation across regions and grouped bulk frees */
+	{
+		void *p[64];
+		struct uslab *a;
+		uint64_t n;
+
+		uslab_pt = NULL;
+		a = uslab_create_heap(8, 64, 4);
+		isnt(a, NULL);
+
+		n = uslab_alloc_bulk(a, p, 40);
+		is(n, 40);
+		n = uslab_alloc_bulk(a, p + 40, 40);
+		is(n, 24);
+		n = uslab_alloc_bulk(a, p, 1);
+		is(n, 0);
+
+		uslab_free_bulk(a, p, 64);
+		is(a->pt_base[0].used, 0);
+		is(a->pt_base[1].used, 0);
+		is(a->pt_base[2].used, 0);
+		is(a->pt_base[3].used, 0);
+
+		n = uslab_alloc_bulk(a, p, 64);
+		is(n, 64);
+		is(uslab_alloc(a), NULL);
+
+		uslab_destroy_heap(a);
+	}
+
+	/* Test the single-word tagged head format */
+	{
+		struct uslab_pt *pt;
+		struct uslab *a;
+		void *p[64];
+		uint64_t i;
+
+		uslab_pt = NULL;
+		a = uslab_create_heap_flags(8, 64, 4, USLAB_TAGGED);
+		isnt(a, NULL);
+
+		for (i = 0; i < 64; i++) {
+			p[i] = uslab_alloc(a);
+			if (p[i] == NULL || (i > 0 && p[i] == p[i - 1])) {
+				break;
+			}
+		}
+		is(i, 64);
+		is(uslab_alloc(a), NULL);
+
+		pt = uslab_pt;
+		for (i = 0; i < 64; i++) {
+			uslab_free(a, p[i]);
+		}
+		is(pt->used, 0);
+		ok(pt->head >> a->tag_shift == 32, "frees bump generation");
+
+		i = uslab_alloc_bulk(a, p, 64);
+		is(i, 64);
+		uslab_free_bulk(a, p, 64);
+
+		uslab_destroy_heap(a);
+
+		errno = 0;
+		a = uslab_create_heap_flags(8, 1ULL << 46, 1, USLAB_TAGGED);
+		is(a, NULL);
+		is(errno, EINVAL);
+	}
+
+	/* Test that a bulk free spanning many regions pushes to each once */
+	{
+		struct uslab *a;
+		uint64_t gen[16], step, i, bad;
+		void *p[64], *batch[32];
+
+		uslab_pt = NULL;
+		a = uslab_create_heap_flags(64, 64 * 64, 16, USLAB_TAGGED);
+		isnt(a, NULL);
+		is(uslab_alloc_bulk(a, p, 64), 64);
+
+		/* Measure what a single push does to a region's generation */
+		gen[0] = a->pt_base[0].head >> a->tag_shift;
+		uslab_free_bulk(a, (void **)&a->pt_base[0].base, 1);
+		step = (a->pt_base[0].head >> a->tag_shift) - gen[0];
+		ok(step > 0, "a push bumps the generation");
+		is(uslab_alloc(a), a->pt_base[0].base);
+
+		/* Two objects from each of 16 regions, interleaved */
+		for (i = 0; i < 32; i++) {
+			batch[i] = a->pt_base[i % 16].base + (i / 16) * 64;
+		}
+		for (i = 0; i < 16; i++) {
+			gen[i] = a->pt_base[i].head >> a->tag_shift;
+		}
+		uslab_free_bulk(a, batch, 32);
+
+		bad = 0;
+		for (i = 0; i < 16; i++) {
+			bad += (a->pt_base[i].head >> a->tag_shift) !=
+			    gen[i] + step;
+		}
+		is(bad, 0);
+
+		/* Each region's chain keeps batch order */
+		uslab_pt = &a->pt_base[3];
+		is(uslab_alloc(a), batch[3]);
+		is(uslab_alloc(a), batch[19]);
+
+		uslab_destroy_heap(a);
+	}
+
+	/* Test size-class sets */
+	{
+		struct uslab_set *s;
+		char *p, *q;
+
+		uslab_pt = NULL;
+		s = uslab_set_create_anonymous(NULL, 16, 256, 64 * 1024, 2, 0);
+		isnt(s, NULL);
+
+		is(uslab_set_size(s, 1), 16);
+		is(uslab_set_size(s, 17), 24);
+		is(uslab_set_size(s, 32), 32);
+		is(uslab_set_size(s, 33), 48);
+		is(uslab_set_size(s, 100), 128);
+		is(uslab_set_size(s, 256), 256);
+		is(uslab_set_size(s, 257), 0);
+
+		p = uslab_set_alloc(s, 17);
+		isnt(p, NULL);
+		ok(p > (char *)s->classes[1] && p < (char *)s->classes[2],
+		    "24 byte objects come from the second class");
+		q = uslab_set_alloc(s, 200);
+		isnt(q, NULL);
+		ok(q > (char *)s->classes[8], "200 byte objects come from the last class");
+		is(uslab_set_alloc(s, 300), NULL);
+
+		uslab_set_free(s, p);
+		uslab_set_free(s, q);
+		is(s->classes[1]->pt_base[uslab_pt->offset].used, 0);
+		is(s->classes[8]->pt_base[uslab_pt->offset].used, 0);
+		is(uslab_set_alloc(s, 24), p);
+
+		uslab_set_destroy(s);
+	}
+
+	/*
+	 * Test that reclaiming pages from a region keeps its freelist intact,
+	 * both with everything free and with allocated objects scattered
+	 * through it.
+	 */
+	for (int tagged = 0; tagged < 2; tagged++) {
+		static char *p[4096];
+		struct uslab *a;
+		uint64_t i, n;
+		size_t r;
+		int bad;
+
+		uslab_pt = NULL;
+		a = uslab_create_anonymous_flags(NULL, 64, 4096, 1,
+		    tagged ? USLAB_TAGGED : 0);
+		isnt(a, NULL);
+
+		for (i = 0; i < 4096; i++) {
+			p[i] = uslab_alloc(a);
+			memset(p[i], 0xff, 64);
+		}
+		for (i = 4096; i > 0; i--) {
+			uslab_free(a, p[i - 1]);
+		}
+
+		r = uslab_reclaim(a);
+		ok(r >= 62 * PAGE_SIZE, "reclaimed %zu bytes", r);
+		is(a->pt_base[0].used, 0);
+
+		bad = 0;
+		for (i = 0; i < 4096; i++) {
+			p[i] = uslab_alloc(a);
+			bad += (p[i] == NULL || (i > 0 && p[i] <= p[i - 1]));
+		}
+		is(bad, 0);
+		is(uslab_alloc(a), NULL);
+
+		/* Keep every even object in the first half allocated. */
+		for (i = 0; i < 4096; i++) {
+			if (i >= 2048 || (i & 1) != 0) {
+				uslab_free(a, p[i]);
+			}
+		}
+
+		r = uslab_reclaim(a);
+		ok(r >= 30 * PAGE_SIZE, "reclaimed %zu bytes", r);
+		is(a->pt_base[0].used, 1024 * 64);
+
+		bad = 0;
+		for (n = 0; (p[0] = uslab_alloc(a)) != NULL; n++) {
+			i = (p[0] - a->slab0_base) / 64;
+			bad += (i < 2048 && (i & 1) == 0);
+		}
+		is(n, 3072);
+		is(bad, 0);
+
+		uslab_destroy_map(a);
+	}
+
+	/*
+	 * Test that NUMA slabs tag every region with an allowed node and can
+	 * still steal everything.
+	 */
+	{
+		struct uslab *a;
+		uint64_t i, n;
+		int bad;
+
+		uslab_pt = NULL;
+		a = uslab_create_anonymous_flags(NULL, 64, 1024, 4, USLAB_NUMA);
+		isnt(a, NULL);
+		ok(a->numa_nnodes >= 1, "found %u nodes", a->numa_nnodes);
+
+		bad = 0;
+		for (i = 0; i < 4; i++) {
+			for (n = 0; n < a->numa_nnodes; n++) {
+				if (a->pt_base[i].node == a->numa_nodes[n]) {
+					break;
+				}
+			}
+			bad += (n == a->numa_nnodes);
+		}
+		is(bad, 0);
+
+		for (n = 0; uslab_alloc(a) != NULL; n++)
+			;
+		is(n, 1024);
+		is(uslab_pt->node, a->numa_nodes[uslab_pt->offset % a->numa_nnodes]);
+
+		uslab_destroy_map(a);
+	}
+
+	/*
+	 * Test that per-CPU slabs serve a pinned thread from its CPU's region,
+	 * and that objects freed from another CPU find their way back.
+	 */
+	{
+		struct remote_free rf;
+		cpu_set_t saved;
+		struct uslab *a;
+		uint64_t i, n, ncpu, per, used;
+		void **objs;
+		pthread_t td;
+		int cpu, bad;
+
+		ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		per = 64;
+
+		if (ncpu > 1) {
+			a = uslab_create_heap_flags(64, per * ncpu, ncpu - 1,
+			    USLAB_PERCPU);
+			is(a, NULL);
+			is(errno, EINVAL);
+		}
+
+		a = uslab_create_heap_flags(64, per * ncpu, ncpu,
+		    USLAB_PERCPU | USLAB_NUMA);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_heap_flags(64, per * ncpu, ncpu, USLAB_PERCPU);
+		isnt(a, NULL);
+
+		objs = calloc(per * ncpu, sizeof (*objs));
+		sched_getaffinity(0, sizeof (saved), &saved);
+		cpu = sched_getcpu();
+		pin(cpu);
+
+		bad = 0;
+		for (n = 0; n < per; n++) {
+			objs[n] = uslab_alloc(a);
+			bad += (objs[n] == NULL || ((char *)objs[n] -
+			    a->slab0_base) / a->pt_size != (uint64_t)cpu);
+		}
+		is(bad, 0);
+
+		if (a->percpu_rseq) {
+			is(uslab_alloc(a), NULL);
+		}
+
+		used = 0;
+		for (i = 0; i < ncpu; i++) {
+			used += a->pt_base[i].used;
+		}
+		is(used, per * 64);
+
+		/* Free half from the next CPU over, half from our own. */
+		rf.a = a;
+		rf.objs = objs;
+		rf.n = per / 2;
+		rf.cpu = (cpu + 1) % ncpu;
+		pthread_create(&td, NULL, remote_free, &rf);
+		pthread_join(td, NULL);
+		for (n = per / 2; n < per; n++) {
+			uslab_free(a, objs[n]);
+		}
+
+		used = 0;
+		for (i = 0; i < ncpu; i++) {
+			used += a->pt_base[i].used;
+		}
+		is(used, 0);
+
+		for (n = 0; n < per; n++) {
+			objs[n] = uslab_alloc(a);
+			if (objs[n] == NULL) {
+				break;
+			}
+		}
+		is(n, per);
+
+		for (n = 0; n < per; n++) {
+			uslab_free(a, objs[n]);
+		}
+
+		sched_setaffinity(0, sizeof (saved), &saved);
+		free(objs);
+		uslab_destroy_heap(a);
+	}
+
+	/*
+	 * Test that huge page slabs align their objects and regions to the huge
+	 * page size, and that they refuse what they can't support.
+	 */
+	{
+		struct uslab *a;
+		uint64_t i, n;
+		size_t r;
+		void **objs;
+		char *p;
+		int bad;
+
+		a = uslab_create_heap_flags(64, 1024, 1, USLAB_THP);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_anonymous_flags(NULL, 64, 1024, 1,
+		    USLAB_THP | USLAB_HUGE_2MB);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		uslab_pt = NULL;
+		a = uslab_create_anonymous_flags(NULL, 64, 100000, 3,
+		    USLAB_THP);
+		isnt(a, NULL);
+		is(a->page_size, 1 << 21);
+		is((uintptr_t)a->slab0_base % (1 << 21), 0);
+		is(a->pt_stride, 2 << 21);
+
+		bad = 0;
+		for (i = 0; i < 3; i++) {
+			bad += ((uintptr_t)a->pt_base[i].base % (1 << 21)) != 0;
+		}
+		is(bad, 0);
+
+		objs = calloc(100000, sizeof (*objs));
+		bad = 0;
+		for (n = 0; (p = uslab_alloc(a)) != NULL; n++) {
+			struct uslab_pt *pt;
+
+			pt = &a->pt_base[(p - a->slab0_base) / a->pt_stride];
+			bad += (p < pt->base || p >= pt->base + pt->size);
+			objs[n] = p;
+		}
+		is(n, 3 * (a->pt_size / 64));
+		is(bad, 0);
+
+		for (i = 0; i < n; i++) {
+			uslab_free(a, objs[i]);
+		}
+
+		r = uslab_reclaim(a);
+		ok(r >= 3 << 21, "reclaimed %zu bytes", r);
+
+		free(objs);
+		uslab_destroy_map(a);
+
+		/* Hugetlb pages must be reserved up front, so may not exist. */
+		a = uslab_create_anonymous_flags(NULL, 64, 1024, 1,
+		    USLAB_HUGE_2MB);
+		if (a != NULL) {
+			is((uintptr_t)a->slab0_base % (1 << 21), 0);
+			for (n = 0; uslab_alloc(a) != NULL; n++)
+				;
+			is(n, 1024);
+			uslab_destroy_map(a);
+		}
+	}
+
+	/*
+	 * Test that reopening a ramdisk slab rebuilds usage counts, refuses a
+	 * different layout, and rejects or repairs corrupt freelists.
+	 */
+	{
+		char *base = (char *)0x6f000000;
+		struct uslab *a;
+		char *p[10];
+		uint64_t i, n;
+
+		unlink("tmp/recover");
+
+		uslab_pt = NULL;
+		a = uslab_create_ramdisk("tmp/recover", base, 64, 1024, 1);
+		isnt(a, NULL);
+		for (i = 0; i < 10; i++) {
+			p[i] = uslab_alloc(a);
+		}
+		for (i = 0; i < 10; i++) {
+			uslab_free(a, p[i]);
+		}
+		uslab_alloc(a);
+		a->pt_base[0].used = 12345;
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk("tmp/recover", base, 32, 2048, 1);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_ramdisk("tmp/recover", base, 64, 1024, 1);
+		isnt(a, NULL);
+		is(a->pt_base[0].used, 64);
+
+		/* p[9] is allocated; p[8] -> p[7] -> p[6] -> p[5] -> p[7]. */
+		((struct uslab_entry *)p[5])->next_free = p[7];
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk("tmp/recover", base, 64, 1024, 1);
+		is(a, NULL);
+		is(errno, EUCLEAN);
+
+		a = uslab_create_ramdisk_flags("tmp/recover", base, 64, 1024, 1,
+		    USLAB_REPAIR);
+		isnt(a, NULL);
+		is(a->pt_base[0].used, (1024 - 4) * 64);
+		for (n = 0; uslab_alloc(a) != NULL; n++)
+			;
+		is(n, 4);
+		uslab_destroy_map(a);
+
+		/* A link out of the region. */
+		a = uslab_create_ramdisk("tmp/recover", base, 64, 1024, 1);
+		isnt(a, NULL);
+		uslab_free(a, p[1]);
+		uslab_free(a, p[0]);
+		((struct uslab_entry *)p[1])->next_free = (char *)0x1;
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk("tmp/recover", base, 64, 1024, 1);
+		is(a, NULL);
+		is(errno, EUCLEAN);
+
+		a = uslab_create_ramdisk_flags("tmp/recover", base, 64, 1024, 1,
+		    USLAB_REPAIR);
+		isnt(a, NULL);
+		is(a->pt_base[0].used, (1024 - 2) * 64);
+		is(uslab_alloc(a), p[0]);
+		is(uslab_alloc(a), p[1]);
+		is(uslab_alloc(a), NULL);
+		uslab_destroy_map(a);
+
+		unlink("tmp/recover");
+	}
+
+	/*
+	 * Test that a relocatable slab can be reopened anywhere, and used
+	 * through two mappings at different addresses at once, while other
+	 * slabs must be reopened where they were created.
+	 */
+	{
+		struct uslab *a, *b;
+		char *p[4], *q;
+		uint64_t i;
+
+		unlink("tmp/reloc");
+		unlink("tmp/fixed");
+
+		uslab_pt = NULL;
+		a = uslab_create_ramdisk_flags("tmp/reloc", NULL, 64, 1024, 1,
+		    USLAB_RELOCATABLE);
+		isnt(a, NULL);
+		for (i = 0; i < 4; i++) {
+			p[i] = uslab_alloc(a);
+		}
+		strcpy(p[1], "persist");
+		uslab_free(a, p[0]);
+		uslab_free(a, p[2]);
+
+		b = uslab_create_ramdisk_flags("tmp/reloc", NULL, 64, 1024, 1,
+		    USLAB_RELOCATABLE);
+		isnt(b, NULL);
+		isnt(a, b);
+		is(a->slab0_base, b->slab0_base);
+		is(strcmp((char *)b + (p[1] - (char *)a), "persist"), 0);
+
+		q = uslab_alloc(b);
+		is(q, (char *)b + (p[2] - (char *)a));
+		uslab_free(b, q);
+		is(uslab_alloc(a), p[2]);
+		is(uslab_alloc(a), p[0]);
+		is(uslab_alloc(a), p[3] + 64);
+		uslab_destroy_map(b);
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk("tmp/reloc", NULL, 64, 1024, 1);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_ramdisk("tmp/fixed", (void *)0x6f000000, 64,
+		    1024, 1);
+		isnt(a, NULL);
+		uslab_destroy_map(a);
+		a = uslab_create_ramdisk("tmp/fixed", (void *)0x6e000000, 64,
+		    1024, 1);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		unlink("tmp/reloc");
+		unlink("tmp/fixed");
+	}
+
+	/*
+	 * Test shared slabs: attaching by fd at another address, region
+	 * ownership, and recovering the objects of a process that died.
+	 */
+	{
+		struct uslab *a, *b;
+		uint64_t i, n, owned;
+		char *p, *q;
+		pid_t pid;
+		int fd, st;
+
+		uslab_pt = NULL;
+		a = uslab_create_shared(NULL, 64, 1024, 4, 0, &fd);
+		isnt(a, NULL);
+		is_true((a->flags & USLAB_RELOCATABLE) != 0);
+
+		p = uslab_alloc(a);
+		isnt(p, NULL);
+		is(owner_pid(uslab_pt->owner), getpid());
+
+		b = uslab_attach_shared(fd);
+		isnt(b, NULL);
+		isnt(a, b);
+		q = (char *)b + (p - (char *)a);
+		strcpy(q, "shared");
+		is(strcmp(p, "shared"), 0);
+		uslab_free(b, q);
+		is(uslab_alloc(a), p);
+		uslab_free(a, p);
+		uslab_destroy_map(b);
+
+		/* The child allocates ten objects and keeps five of them. */
+		pid = fork();
+		if (pid == 0) {
+			b = uslab_attach_shared(fd);
+			for (i = 0; i < 10; i++) {
+				p = uslab_alloc(b);
+				*p = (i < 5) ? 'k' : 'x';
+			}
+			_exit(b == NULL);
+		}
+		isnt(pid, -1);
+		is(waitpid(pid, &st, 0), pid);
+		is(st, 0);
+
+		for (i = owned = 0; i < 4; i++) {
+			if (owner_pid(reloc_pts(a)[i].owner) == pid) {
+				owned++;
+				is(reloc_pts(a)[i].used, 10 * 64);
+			}
+		}
+		is(owned, 1);
+
+		is(uslab_shared_recover(a, keep_marked, NULL), 5);
+		is(uslab_shared_recover(a, keep_marked, NULL), 0);
+		for (i = owned = 0; i < 4; i++) {
+			owned += reloc_pts(a)[i].owner != 0 &&
+			    owner_pid(reloc_pts(a)[i].owner) != getpid();
+		}
+		is(owned, 0);
+
+		for (n = 0; uslab_alloc(a) != NULL; n++)
+			;
+		is(n, 1024 - 5);
+		uslab_destroy_map(a);
+
+		b = uslab_attach_shared(0);
+		is(b, NULL);
+
+		close(fd);
+
+		/* A named object, attached through a descriptor of its own. */
+		shm_unlink("/uslab_test");
+		a = uslab_create_shared("/uslab_test", 64, 1024, 4, 0, &fd);
+		isnt(a, NULL);
+		close(fd);
+		fd = shm_open("/uslab_test", O_RDWR, 0);
+		isnt(fd, -1);
+		b = uslab_attach_shared(fd);
+		isnt(b, NULL);
+		is(b->size_class, 64);
+		uslab_destroy_map(b);
+		uslab_destroy_map(a);
+		close(fd);
+		shm_unlink("/uslab_test");
+	}
+
+#ifdef HAVE_RSEQ
+	/*
+	 * Test that a process without rseq can use a per-CPU slab created by
+	 * one with it, keeping to the remote lists.
+	 */
+	{
+		struct uslab_stats stats;
+		struct uslab *a, *b;
+		uint64_t i, n, ncpu;
+		cpu_set_t saved;
+		void *objs[8];
+		bool rseq;
+		pid_t pid;
+		int fd, st;
+
+		ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		a = uslab_create_shared(NULL, 64, 64 * ncpu, ncpu,
+		    USLAB_PERCPU, &fd);
+		isnt(a, NULL);
+
+		sched_getaffinity(0, sizeof (saved), &saved);
+		pin(sched_getcpu());
+		for (i = 0; i < 8; i++) {
+			objs[i] = uslab_alloc(a);
+		}
+
+		/* Its frees go remote, and its allocations take them back. */
+		pid = (a->percpu_rseq) ? fork() : -1;
+		if (pid == 0) {
+			alarm(10);
+			b = uslab_attach_shared(fd);
+			if (b == NULL || rseq_unregister() == false) {
+				_exit(1);
+			}
+			for (i = 0; i < 8; i++) {
+				uslab_free(b, (char *)b +
+				    ((char *)objs[i] - (char *)a));
+			}
+			for (n = 0; uslab_alloc(b) != NULL; n++)
+				;
+			_exit(n != 8);
+		}
+		if (pid != -1) {
+			is(waitpid(pid, &st, 0), pid);
+			is(st, 0);
+
+			uslab_stats(a, &stats, NULL, 0);
+			is(stats.used, 8);
+			for (n = 0; uslab_alloc(a) != NULL; n++)
+				;
+			is(n, 64 - 8);
+		}
+		sched_setaffinity(0, sizeof (saved), &saved);
+		uslab_destroy_map(a);
+		close(fd);
+
+		/* Reopened without rseq, remote lists join the local ones. */
+		unlink("tmp/percpu");
+		a = uslab_create_ramdisk_flags("tmp/percpu", NULL, 64,
+		    64 * ncpu, ncpu, USLAB_PERCPU | USLAB_RELOCATABLE);
+		isnt(a, NULL);
+		for (i = 0; i < 8; i++) {
+			objs[i] = uslab_alloc(a);
+		}
+
+		rseq = a->percpu_rseq;
+		pid = (rseq == true) ? fork() : -1;
+		if (pid == 0) {
+			alarm(10);
+			if (rseq_unregister() == false) {
+				_exit(1);
+			}
+			for (i = 0; i < 8; i++) {
+				uslab_free(a, objs[i]);
+			}
+			_exit(0);
+		}
+		if (pid != -1) {
+			is(waitpid(pid, &st, 0), pid);
+			is(st, 0);
+		}
+		uslab_destroy_map(a);
+
+		pid = (rseq == true) ? fork() : -1;
+		if (pid == 0) {
+			alarm(10);
+			if (rseq_unregister() == false) {
+				_exit(1);
+			}
+			a = uslab_create_ramdisk_flags("tmp/percpu", NULL, 64,
+			    64 * ncpu, ncpu, USLAB_PERCPU | USLAB_RELOCATABLE);
+			if (a == NULL || a->percpu_rseq) {
+				_exit(1);
+			}
+			for (n = 0; uslab_alloc(a) != NULL; n++)
+				;
+			_exit(n != 64 * ncpu);
+		}
+		if (pid != -1) {
+			is(waitpid(pid, &st, 0), pid);
+			is(st, 0);
+		}
+		unlink("tmp/percpu");
+	}
+#endif
+
+	/*
+	 * Test that growable slabs commit regions up to their reservation as
+	 * allocations run out, without moving anything.
+	 */
+	{
+		static char *p[1024];
+		struct uslab *a;
+		uint64_t i, n;
+
+		a = uslab_create_growable(NULL, 64, 256, 2, 100, 0);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_growable(NULL, 64, 256, 2, 1024, USLAB_PERCPU);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		uslab_pt = NULL;
+		a = uslab_create_growable(NULL, 64, 256, 2, 1024, 0);
+		isnt(a, NULL);
+		is(a->pt_slabs, 2);
+		is(a->pt_max, 8);
+
+		for (n = 0; n < 1024 && (p[n] = uslab_alloc(a)) != NULL; n++) {
+			memset(p[n], 0xa5, 64);
+		}
+		is(n, 1024);
+		is(uslab_alloc(a), NULL);
+		is(a->pt_slabs, 8);
+		is(p[1023], a->slab0_base + 1023 * 64);
+
+		for (i = 0; i < n; i++) {
+			uslab_free(a, p[i]);
+		}
+		for (i = 0; i < 8; i++) {
+			is(a->pt_base[i].used, 0);
+		}
+
+		n = uslab_alloc_bulk(a, (void **)p, 1024);
+		is(n, 1024);
+		uslab_free_bulk(a, (void **)p, n);
+		uslab_destroy_map(a);
+
+		/* Bulk allocations grow too, and so do tagged slabs. */
+		a = uslab_create_growable(NULL, 64, 256, 2, 1024,
+		    USLAB_TAGGED);
+		isnt(a, NULL);
+		n = uslab_alloc_bulk(a, (void **)p, 1000);
+		is(n, 1000);
+		is(a->pt_slabs, 8);
+		uslab_destroy_map(a);
+
+		/* Regions needn't be a whole number of pages. */
+		a = uslab_create_growable(NULL, 48, 300, 3, 1000, 0);
+		isnt(a, NULL);
+		n = uslab_alloc_bulk(a, (void **)p, 1000);
+		is(n, 1000);
+		is(a->pt_slabs, 10);
+		uslab_destroy_map(a);
+	}
+
+	/*
+	 * Test that a full slab forgets its empty regions, and that a single
+	 * free object anywhere brings its region back.
+	 */
+	{
+		static char *p[100 * 16];
+		struct uslab *a;
+		uint64_t i, n;
+
+		uslab_pt = NULL;
+		a = uslab_create_heap(16, 100 * 16, 100);
+		isnt(a, NULL);
+		is(a->pt_size, 16 * 16);
+		for (i = 0; i < 100; i++) {
+			is_true(avail_bit(a, i));
+		}
+
+		for (n = 0; n < 100 * 16 && (p[n] = uslab_alloc(a)) != NULL;
+		    n++)
+			;
+		is(n, 100 * 16);
+		is(uslab_alloc(a), NULL);
+		for (i = 0; i < 100; i++) {
+			is_true(!avail_bit(a, i));
+		}
+
+		/* Region 83 is far from where this thread starts looking. */
+		i = (p[1337] - a->slab0_base) / (16 * 16);
+		is(i, 83);
+		uslab_free(a, p[1337]);
+		is_true(avail_bit(a, 83));
+		is(uslab_alloc(a), p[1337]);
+		is(uslab_alloc(a), NULL);
+		is_true(!avail_bit(a, 83));
+
+		uslab_free_bulk(a, (void **)p, n);
+		for (i = 0; i < 100; i++) {
+			is_true(avail_bit(a, i));
+		}
+		is(uslab_alloc_bulk(a, (void **)p, n), n);
+		uslab_free_bulk(a, (void **)p, n);
+		uslab_destroy_heap(a);
+	}
+
+	/*
+	 * Test that USLAB_REMOTE slabs put objects freed by other threads on
+	 * their region's remote list, and that the region adopts them once its
+	 * freelist runs dry.
+	 */
+	{
+		struct remote_free rf;
+		struct uslab_pt *pt;
+		struct uslab *a;
+		void *objs[64], *p;
+		uint64_t i, bad;
+		pthread_t td;
+
+		a = uslab_create_heap_flags(64, 4 * 64, 4,
+		    USLAB_PERCPU | USLAB_REMOTE);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		uslab_pt = NULL;
+		a = uslab_create_heap_flags(64, 4 * 64, 4, USLAB_REMOTE);
+		isnt(a, NULL);
+		for (i = 0; i < 64; i++) {
+			objs[i] = uslab_alloc(a);
+		}
+		pt = uslab_pt;
+		is(pt->used, 64 * 64);
+
+		rf.a = a;
+		rf.objs = objs;
+		rf.n = 32;
+		rf.cpu = sched_getcpu();
+		pthread_create(&td, NULL, remote_free, &rf);
+		pthread_join(td, NULL);
+		isnt(pt->remote, pt->base + pt->size);
+		if (a->flags & USLAB_TAGGED) {
+			is_true((pt->head & a->tag_mask) >= pt->size);
+		} else {
+			is_true(pt->first_free >= pt->base + pt->size);
+		}
+		is(pt->used, 64 * 64);
+
+		/* Our own frees still go straight to the freelist. */
+		uslab_free(a, objs[32]);
+		is(pt->used, 63 * 64);
+		is(uslab_alloc(a), objs[32]);
+
+		bad = 0;
+		for (i = 0; i < 32; i++) {
+			p = uslab_alloc(a);
+			bad += (p == NULL || (char *)p < pt->base ||
+			    (char *)p >= pt->base + pt->size);
+		}
+		is(bad, 0);
+		is(pt->remote, pt->base + pt->size);
+		is(pt->used, 64 * 64);
+
+		/* Stealers adopt the remote lists of other regions too. */
+		rf.n = 64;
+		pthread_create(&td, NULL, remote_free, &rf);
+		pthread_join(td, NULL);
+		uslab_pt = &a->pt_base[(pt->offset + 1) % 4];
+		for (i = 0; i < 4 * 64 && uslab_alloc(a) != NULL; i++)
+			;
+		is(i, 4 * 64);
+		is(pt->used, 64 * 64);
+		uslab_destroy_heap(a);
+	}
+
+
+	/*
+	 * Test that queue slabs pass objects first in, first out, singly and
+	 * in batches, that their queues hold every object of the slab, and that
+	 * other slabs have no queue.
+	 */
+	{
+		unsigned int flags[] = { USLAB_QUEUE, USLAB_QUEUE_SPSC };
+		void *objs[256], *out[256];
+		struct uslab *a;
+		uint64_t i, f;
+
+		a = uslab_create_heap_flags(64, 256, 1,
+		    USLAB_QUEUE | USLAB_QUEUE_SPSC);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_heap(64, 256, 1);
+		isnt(a, NULL);
+		objs[0] = uslab_alloc(a);
+		is(uslab_enqueue(a, objs[0]), false);
+		is(uslab_dequeue(a), NULL);
+		is(uslab_queued(a), 0);
+		uslab_destroy_heap(a);
+
+		for (f = 0; f < 2; f++) {
+			uslab_pt = NULL;
+			a = uslab_create_heap_flags(64, 256, 1, flags[f]);
+			isnt(a, NULL);
+			is(uslab_dequeue(a), NULL);
+			for (i = 0; i < 256; i++) {
+				objs[i] = uslab_alloc(a);
+			}
+			is(uslab_alloc(a), NULL);
+
+			is(uslab_enqueue(a, objs[0]), true);
+			is(uslab_enqueue(a, objs[1]), true);
+			is(uslab_queued(a), 2);
+			is(uslab_dequeue(a), objs[0]);
+			is(uslab_dequeue(a), objs[1]);
+			is(uslab_dequeue(a), NULL);
+
+			is(uslab_enqueue_bulk(a, objs, 256), 256);
+			is(uslab_queued(a), 256);
+			is(uslab_dequeue_bulk(a, out, 100), 100);
+			is(memcmp(out, objs, 100 * sizeof (void *)), 0);
+			is(uslab_enqueue_bulk(a, objs, 256), 100);
+			is(uslab_dequeue_bulk(a, out, 256), 256);
+			is(memcmp(out, objs + 100, 156 * sizeof (void *)), 0);
+			is(memcmp(out + 156, objs, 100 * sizeof (void *)), 0);
+			is(uslab_dequeue(a), NULL);
+			is(uslab_queued(a), 0);
+			uslab_destroy_heap(a);
+		}
+	}
+
+	/* Test queues with concurrent producers and consumers. */
+	{
+		struct queue_worker pw[2], cw[2];
+		pthread_t ptd[2], ctd[2];
+		struct uslab *a;
+		uint64_t i, n, sum;
+
+		n = 50000;
+		for (i = 0; i < 2; i++) {
+			a = uslab_create_heap_flags(64, 1024, 4,
+			    i == 0 ? USLAB_QUEUE : USLAB_QUEUE_SPSC);
+			isnt(a, NULL);
+			memset(pw, 0, sizeof (pw));
+			memset(cw, 0, sizeof (cw));
+			pw[0].a = pw[1].a = cw[0].a = cw[1].a = a;
+			pw[0].n = cw[0].n = n;
+			if (i == 0) {
+				pw[1].n = cw[1].n = n;
+			}
+
+			pthread_create(&ptd[0], NULL, queue_producer, &pw[0]);
+			pthread_create(&ptd[1], NULL, queue_producer, &pw[1]);
+			pthread_create(&ctd[0], NULL, queue_consumer, &cw[0]);
+			pthread_create(&ctd[1], NULL, queue_consumer, &cw[1]);
+			pthread_join(ptd[0], NULL);
+			pthread_join(ptd[1], NULL);
+			pthread_join(ctd[0], NULL);
+			pthread_join(ctd[1], NULL);
+
+			sum = (pw[0].n + pw[1].n) * (n + 1) / 2;
+			is(cw[0].sum + cw[1].sum, sum);
+			is(uslab_queued(a), 0);
+			uslab_destroy_heap(a);
+		}
+	}
+
+	/*
+	 * Test that queues persist in ramdisk slabs, across mappings of a
+	 * relocatable slab, and that reopening a slab frees slots a producer
+	 * claimed but never filled.
+	 */
+	{
+		struct uslab *a, *b;
+		char *p[4];
+		uint64_t i;
+
+		unlink("tmp/queue");
+		uslab_pt = NULL;
+		a = uslab_create_ramdisk_flags("tmp/queue", NULL, 64, 1024, 1,
+		    USLAB_QUEUE | USLAB_RELOCATABLE);
+		isnt(a, NULL);
+		for (i = 0; i < 4; i++) {
+			p[i] = uslab_alloc(a);
+			p[i][0] = 'a' + i;
+		}
+		is(uslab_enqueue(a, p[0]), true);
+		is(uslab_enqueue(a, p[1]), true);
+
+		b = uslab_create_ramdisk_flags("tmp/queue", NULL, 64, 1024, 1,
+		    USLAB_QUEUE | USLAB_RELOCATABLE);
+		isnt(b, NULL);
+		is(uslab_queued(b), 2);
+		is(uslab_dequeue(b), (char *)b + (p[0] - (char *)a));
+		uslab_destroy_map(b);
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk_flags("tmp/queue", NULL, 64, 1024, 1,
+		    USLAB_QUEUE);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_ramdisk_flags("tmp/queue", NULL, 64, 1024, 1,
+		    USLAB_QUEUE | USLAB_RELOCATABLE);
+		isnt(a, NULL);
+		is(uslab_queued(a), 1);
+		p[1] = uslab_dequeue(a);
+		is(p[1][0], 'b');
+		p[2] = p[1] + 64;
+		p[3] = p[1] + 128;
+
+		/* Claim a slot as a producer would, and die before filling it. */
+		is(uslab_enqueue(a, p[2]), true);
+		(*(uint64_t *)((char *)a + (uintptr_t)a->queue))++;
+		is(uslab_enqueue(a, p[3]), true);
+		is(uslab_queued(a), 3);
+		is(uslab_dequeue(a), p[2]);
+		is(uslab_dequeue(a), NULL);
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk_flags("tmp/queue", NULL, 64, 1024, 1,
+		    USLAB_QUEUE | USLAB_RELOCATABLE);
+		isnt(a, NULL);
+		is(uslab_queued(a), 1);
+		p[3] = uslab_dequeue(a);
+		is(p[3][0], 'd');
+		is(uslab_dequeue(a), NULL);
+		uslab_destroy_map(a);
+	}
+
+
+	/*
+	 * Test that uslab_stats reports region usage for any slab, and marks
+	 * and the operation counts of every thread for slabs that keep them.
+	 */
+	{
+		struct uslab_stats_pt pt[4];
+		struct uslab_stats st;
+		struct batch b;
+		struct uslab *a;
+		void *objs[64];
+		pthread_t td;
+		uint64_t i, j, own;
+
+		uslab_pt = NULL;
+		a = uslab_create_heap_flags(64, 4 * 16, 4, USLAB_STATS);
+		isnt(a, NULL);
+		is(uslab_stats(a, &st, NULL, 0), 4);
+		is(st.size_class, 64);
+		is(st.used, 0);
+		is(st.free, 64);
+		is(st.allocs, 0);
+
+		for (i = 0; i < 20; i++) {
+			objs[i] = uslab_alloc(a);
+		}
+		own = uslab_pt->offset;
+		is(uslab_stats(a, &st, pt, 4), 4);
+		is(st.used, 20);
+		is(st.free, 44);
+		is(st.allocs, 20);
+		is(st.steals, 4);
+		is(st.ooms, 0);
+		is(pt[own].used, 16);
+		is(pt[own].free, 0);
+		is(pt[own].hwm, 16);
+
+		for (i = 0; i < 10; i++) {
+			uslab_free(a, objs[i]);
+		}
+		uslab_stats(a, &st, pt, 4);
+		is(st.frees, 10);
+		is(pt[own].used, 6);
+		is(pt[own].hwm, 16);
+
+		pthread_create(&td, NULL, alloc_free, a);
+		pthread_join(td, NULL);
+		uslab_stats(a, &st, NULL, 0);
+		is(st.allocs, 21);
+		is(st.frees, 11);
+
+		is(uslab_alloc_bulk(a, objs, 64), 54);
+		is(uslab_alloc(a), NULL);
+		uslab_stats(a, &st, pt, 4);
+		is(st.used, 64);
+		is(st.allocs, 75);
+		is(st.ooms, 2);
+		for (i = 0; i < 4; i++) {
+			is(pt[i].hwm, 16);
+		}
+		uslab_free_bulk(a, objs, 54);
+		uslab_stats(a, &st, NULL, 0);
+		is(st.frees, 65);
+		is(st.used, 10);
+		uslab_destroy_heap(a);
+
+		/*
+		 * Marks follow the region, not the threads: a producer that
+		 * hands everything it allocates to a consumer doesn't push
+		 * them past what was ever allocated at once.
+		 */
+		a = uslab_create_heap_flags(64, 4 * 16, 4, USLAB_STATS);
+		isnt(a, NULL);
+		b.a = a;
+		for (i = 0; i < 50; i++) {
+			for (j = 0; j < 8; j++) {
+				b.objs[j] = uslab_alloc(a);
+			}
+			pthread_create(&td, NULL, free_batch, &b);
+			pthread_join(td, NULL);
+		}
+		own = uslab_pt->offset;
+		uslab_stats(a, &st, pt, 4);
+		is(st.allocs, 400);
+		is(st.frees, 400);
+		is(st.used, 0);
+		is(pt[own].hwm, 8);
+		uslab_destroy_heap(a);
+
+		/* A new slab starts from zero, in a recycled block. */
+		a = uslab_create_heap_flags(64, 4 * 16, 4, USLAB_STATS);
+		isnt(a, NULL);
+		uslab_free(a, uslab_alloc(a));
+		uslab_stats(a, &st, NULL, 0);
+		is(st.allocs, 1);
+		is(st.frees, 1);
+		uslab_destroy_heap(a);
+
+		a = uslab_create_heap(64, 4 * 16, 4);
+		isnt(a, NULL);
+		objs[0] = uslab_alloc(a);
+		uslab_stats(a, &st, pt, 4);
+		is(st.used, 1);
+		is(st.allocs, 0);
+		is(pt[uslab_pt->offset].hwm, 0);
+		uslab_destroy_heap(a);
+	}
+
+	/*
+	 * Tracing records every object allocated and freed, by index, and
+	 * failed allocations, per thread and in order, including the records
+	 * of threads that have exited and of rings that filled up.
+	 */
+	{
+		struct uslab_trace_hdr hdr;
+		struct uslab_trace_rec *recs;
+		struct uslab *a, *b;
+		void *p0, *p1, *objs[64];
+		uint64_t i, n[2][4], idx0, idx1;
+		pthread_t td;
+		struct stat tsb;
+		int fd;
+
+		uslab_pt = NULL;
+		a = uslab_create_heap(64, 4 * 16, 4);
+		b = uslab_create_heap(64, 4 * 16, 4);
+		isnt(a, NULL);
+		isnt(b, NULL);
+		fd = open("tmp/trace", O_RDWR | O_CREAT | O_TRUNC, 0644);
+		isnt(fd, -1);
+
+		is_true(uslab_trace_start(a, fd));
+		is(uslab_trace_start(b, fd), false);
+		is(errno, EBUSY);
+		is(uslab_trace_stop(b), false);
+		is(errno, EINVAL);
+
+		p0 = uslab_alloc(a);
+		p1 = uslab_alloc(a);
+		uslab_free(b, uslab_alloc(b));
+		uslab_free(a, p0);
+		pthread_create(&td, NULL, alloc_free, a);
+		pthread_join(td, NULL);
+		uslab_free(a, p1);
+		is(uslab_alloc_bulk(a, objs, 64), 64);
+		is(uslab_alloc(a), NULL);
+		uslab_free_bulk(a, objs, 64);
+		for (i = 0; i < 3000; i++) {
+			uslab_free(a, uslab_alloc(a));
+		}
+		is_true(uslab_trace_stop(a));
+		is(uslab_trace_stop(a), false);
+		uslab_free(a, uslab_alloc(a));
+
+		is(pread(fd, &hdr, sizeof (hdr), 0), sizeof (hdr));
+		is(hdr.magic, USLAB_TRACE_MAGIC);
+		is(hdr.size_class, 64);
+		is(hdr.nelem, 64);
+		is(hdr.pt_slabs, 4);
+		is(hdr.nobjs, 64);
+		is(hdr.nthreads, 2);
+		is(hdr.nrecs, 6135);
+		is(hdr.dropped, 0);
+		is_true(hdr.stop_ns >= hdr.start_ns);
+		fstat(fd, &tsb);
+		is(tsb.st_size, sizeof (hdr) + hdr.nrecs * sizeof (*recs));
+
+		recs = malloc(hdr.nrecs * sizeof (*recs));
+		is(pread(fd, recs, hdr.nrecs * sizeof (*recs), sizeof (hdr)),
+		    hdr.nrecs * sizeof (*recs));
+		memset(n, 0, sizeof (n));
+		for (i = 0; i < hdr.nrecs; i++) {
+			n[USLAB_TRACE_TID(recs[i].word) & 1]
+			    [USLAB_TRACE_OP(recs[i].word)]++;
+		}
+		is(n[0][USLAB_TRACE_ALLOC], 3066);
+		is(n[0][USLAB_TRACE_FREE], 3066);
+		is(n[0][USLAB_TRACE_OOM], 1);
+		is(n[1][USLAB_TRACE_ALLOC], 1);
+		is(n[1][USLAB_TRACE_FREE], 1);
+
+		/*
+		 * The thread that exited wrote its records out first. Ours
+		 * follow, in order.
+		 */
+		idx0 = ((char *)p0 - a->slab0_base) / 64;
+		idx1 = ((char *)p1 - a->slab0_base) / 64;
+		is(USLAB_TRACE_TID(recs[0].word), 1);
+		is(USLAB_TRACE_TID(recs[2].word), 0);
+		is(recs[2].word, USLAB_TRACE_WORD(USLAB_TRACE_ALLOC, 0, idx0));
+		is(recs[3].word, USLAB_TRACE_WORD(USLAB_TRACE_ALLOC, 0, idx1));
+		is(recs[4].word, USLAB_TRACE_WORD(USLAB_TRACE_FREE, 0, idx0));
+		is(recs[5].word, USLAB_TRACE_WORD(USLAB_TRACE_FREE, 0, idx1));
+		is_true(recs[3].ticks >= recs[2].ticks);
+		is_true(recs[0].ticks >= recs[4].ticks);
+		is_true(recs[5].ticks >= recs[1].ticks);
+		for (i = 0; i < hdr.nrecs; i++) {
+			if (USLAB_TRACE_INDEX(recs[i].word) >= hdr.nobjs) {
+				break;
+			}
+		}
+		is(i, hdr.nrecs);
+		free(recs);
+
+		/* Destroying the traced slab stops the trace. */
+		is_true(uslab_trace_start(a, fd));
+		uslab_destroy_heap(a);
+		is_true(uslab_trace_start(b, fd));
+		is_true(uslab_trace_stop(b));
+		uslab_destroy_heap(b);
+		close(fd);
+		unlink("tmp/trace");
+	}
+
+	/* Debug slabs. */
+	{
+		char *base = (char *)0x6f000000;
+		struct uslab_set *s;
+		struct uslab *a;
+		void *objs[100];
+		char *p, *q, c;
+		uint64_t i;
+
+		a = uslab_create_heap_flags(64, 256, 4, USLAB_POISON);
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		a = uslab_create_heap_flags(64, 256, 4,
+		    USLAB_DEBUG | USLAB_POISON);
+		isnt(a, NULL);
+		p = uslab_alloc(a);
+		q = uslab_alloc(a);
+		isnt(p, NULL);
+		isnt(q, NULL);
+
+		/* Frees of allocated objects are fine, and reuse them. */
+		uslab_free(a, p);
+		for (i = sizeof (struct uslab_entry); i < 64; i++) {
+			if ((unsigned char)p[i] != 0xa5) {
+				break;
+			}
+		}
+		is(i, 64);
+		is(uslab_alloc(a), p);
+		memset(p, 0, 64);
+
+		is_true(aborts(free_twice, a, q));
+		is_true(aborts(free_twice_remote, a, q));
+		is_true(aborts(uslab_free, a, &c));
+		is_true(aborts(uslab_free, a, q + 8));
+		is_true(aborts(uslab_free, a, a->slab0_base + 4 * a->pt_size));
+		is_true(aborts(write_after_free, a, q));
+		is(aborts(zero_after_free, a, q), false);
+		is(aborts(uslab_free, a, q), false);
+
+		/* Bulk calls check every object. */
+		is(uslab_alloc_bulk(a, objs, 100), 100);
+		uslab_free_bulk(a, objs, 100);
+		is_true(aborts(free_bulk_one, a, objs[50]));
+		is(uslab_alloc_bulk(a, objs, 100), 100);
+		is(aborts(free_bulk_one, a, objs[50]), false);
+		uslab_free_bulk(a, objs, 100);
+		uslab_free(a, p);
+		uslab_free(a, q);
+		uslab_destroy_heap(a);
+
+		/* So do magazines, which hold objects the caller freed. */
+		a = uslab_create_heap_flags(64, 256, 4,
+		    USLAB_DEBUG | USLAB_MAGAZINE);
+		isnt(a, NULL);
+		p = uslab_alloc(a);
+		is_true(aborts(free_twice, a, p));
+		uslab_free(a, p);
+		uslab_magazine_flush(a);
+		uslab_destroy_heap(a);
+
+		/* Set classes make room for their maps. */
+		s = uslab_set_create_anonymous(NULL, 16, 256, 64 * 1024, 2,
+		    USLAB_DEBUG);
+		isnt(s, NULL);
+		p = uslab_set_alloc(s, 100);
+		isnt(p, NULL);
+		is(uslab_set_size(s, 100), 128);
+		is_true(aborts(uslab_free, s->classes[6], p + 16));
+		uslab_set_free(s, p);
+		uslab_set_destroy(s);
+
+		/* Reopened slabs rebuild the map from their freelists. */
+		unlink("tmp/debug");
+		a = uslab_create_ramdisk_flags("tmp/debug", base, 64, 1024, 2,
+		    USLAB_DEBUG);
+		isnt(a, NULL);
+		p = uslab_alloc(a);
+		q = uslab_alloc(a);
+		uslab_free(a, p);
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk_flags("tmp/debug", base, 64, 1024, 2,
+		    USLAB_DEBUG);
+		isnt(a, NULL);
+		is_true(aborts(uslab_free, a, p));
+		uslab_free(a, q);
+		is_true(aborts(uslab_free, a, q));
+		uslab_destroy_map(a);
+		unlink("tmp/debug");
+	}
+
+	/* Test that free objects keep their links where USLAB_LINK says. */
+	{
+		static const unsigned int flags[] = {
+			0, USLAB_TAGGED, USLAB_MAGAZINE, USLAB_RELOCATABLE,
+			USLAB_REMOTE, USLAB_PERCPU,
+		};
+		static struct cached *p[1024];
+		static void *q[1024];
+		struct uslab_stats st;
+		struct uslab *a;
+		char *base = (char *)0x7e000000;
+		uint64_t i, k, n, ncpu;
+		int bad;
+
+		a = uslab_create_heap_flags(16, 64, 1, USLAB_LINK(16));
+		is(a, NULL);
+		is(errno, EINVAL);
+		a = uslab_create_heap_flags(16, 64, 1, USLAB_LINK(8));
+		isnt(a, NULL);
+		is(a->link_offset, 8);
+		uslab_destroy_heap(a);
+
+		ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		for (k = 0; k < sizeof (flags) / sizeof (flags[0]); k++) {
+			a = uslab_create_anonymous_flags(NULL,
+			    sizeof (struct cached), 1024 * ncpu, ncpu,
+			    flags[k] |
+			    USLAB_LINK(offsetof(struct cached, link)));
+			isnt(a, NULL);
+
+			for (i = 0; i < 1024; i++) {
+				p[i] = uslab_alloc(a);
+				p[i]->magic = i;
+			}
+			for (i = 0; i < 1024; i += 2) {
+				uslab_free(a, p[i]);
+				q[i / 2] = p[i + 1];
+			}
+			uslab_free_bulk(a, q, 512);
+
+			bad = 0;
+			for (i = 0; i < 1024; i++) {
+				bad += (p[i]->magic != i);
+			}
+			is(bad, 0);
+
+			/* Every object comes back once, as it was. */
+			uslab_magazine_flush(a);
+			is(uslab_alloc_bulk(a, q, 1024), 1024);
+			bad = 0;
+			for (i = 0; i < 1024; i++) {
+				n = ((struct cached *)q[i])->magic;
+				bad += (n >= 1024 || p[n] != q[i]);
+				((struct cached *)q[i])->magic = UINT64_MAX;
+			}
+			is(bad, 0);
+			uslab_destroy_map(a);
+		}
+
+		/* Reopened slabs find their links. */
+		unlink("tmp/link");
+		a = uslab_create_ramdisk_flags("tmp/link", base,
+		    sizeof (struct cached), 1024, 1,
+		    USLAB_LINK(offsetof(struct cached, link)));
+		isnt(a, NULL);
+		for (i = 0; i < 10; i++) {
+			p[i] = uslab_alloc(a);
+			p[i]->magic = i;
+		}
+		for (i = 0; i < 10; i += 2) {
+			uslab_free(a, p[i]);
+		}
+		uslab_destroy_map(a);
+
+		a = uslab_create_ramdisk_flags("tmp/link", base,
+		    sizeof (struct cached), 1024, 1,
+		    USLAB_LINK(offsetof(struct cached, link)));
+		isnt(a, NULL);
+		uslab_stats(a, &st, NULL, 0);
+		is(st.used, 5);
+		is(p[4]->magic, 4);
+		is(uslab_alloc_bulk(a, q, 1024), 1024 - 5);
+		uslab_destroy_map(a);
+		unlink("tmp/link");
+	}
+
+	/*
+	 * Test that object caches construct objects once, and destroy them
+	 * when their memory goes.
+	 */
+	{
+		static struct cached *p[4096];
+		struct uslab_cache *c;
+		struct uslab *a;
+		struct cached *o;
+		uint64_t i;
+		size_t r;
+		int fail;
+
+		a = uslab_create_anonymous_flags(NULL, sizeof (struct cached),
+		    4096, 1, USLAB_LINK(offsetof(struct cached, link)));
+		isnt(a, NULL);
+		fail = 0;
+		c = uslab_cache_create(a, cached_ctor, cached_dtor, &fail);
+		isnt(c, NULL);
+
+		o = uslab_cache_alloc(c);
+		isnt(o, NULL);
+		is(ctors, 1);
+		is(o->magic, CACHED_MAGIC);
+		o->pad[0] = 'x';
+		uslab_cache_free(c, o);
+		is(uslab_cache_alloc(c), o);
+		is(ctors, 1);
+		is(o->magic, CACHED_MAGIC);
+		is(o->pad[0], 'x');
+
+		/* Failed constructors fail the allocation, and free the object. */
+		fail = ENOMEM;
+		is(uslab_cache_alloc(c), NULL);
+		is(errno, ENOMEM);
+		fail = 0;
+		p[0] = o;
+		for (i = 1; i < 4096; i++) {
+			p[i] = uslab_cache_alloc(c);
+		}
+		isnt(p[4095], NULL);
+		is(uslab_cache_alloc(c), NULL);
+		is(ctors, 4096);
+		is(dtors, 0);
+
+		/* Reclaimed objects are destroyed, and constructed again. */
+		for (i = 0; i < 4096; i++) {
+			uslab_cache_free(c, p[i]);
+		}
+		r = uslab_cache_reclaim(c);
+		ok(r >= 62 * PAGE_SIZE, "reclaimed %zu bytes", r);
+		ok(dtors >= 62 * PAGE_SIZE / 64, "destroyed %d", dtors);
+		for (i = 0; i < 4096; i++) {
+			p[i] = uslab_cache_alloc(c);
+			if (p[i] == NULL || p[i]->magic != CACHED_MAGIC) {
+				break;
+			}
+		}
+		is(i, 4096);
+		is(ctors, 4096 + dtors);
+
+		for (i = 0; i < 4096; i++) {
+			uslab_cache_free(c, p[i]);
+		}
+		uslab_cache_destroy(c);
+		is(dtors, ctors);
+		uslab_destroy_map(a);
+
+		/*
+		 * Destructors find freelist links in the link field, and
+		 * what they write there doesn't break the freelist.
+		 */
+		a = uslab_create_anonymous_flags(NULL, sizeof (struct cached),
+		    4096, 1, USLAB_LINK(offsetof(struct cached, link)));
+		isnt(a, NULL);
+		c = uslab_cache_create(a, NULL, scribble_dtor, a);
+		isnt(c, NULL);
+		for (i = 0; i < 4096; i++) {
+			p[i] = uslab_cache_alloc(c);
+		}
+		for (i = 0; i < 4096; i++) {
+			uslab_cache_free(c, p[i]);
+		}
+		ok(uslab_cache_reclaim(c) > 0, "reclaimed");
+		is(bad_links, 0);
+		for (i = 0; i < 4096; i++) {
+			if ((p[i] = uslab_cache_alloc(c)) == NULL) {
+				break;
+			}
+		}
+		is(i, 4096);
+		for (i = 0; i < 4096; i++) {
+			uslab_cache_free(c, p[i]);
+		}
+		uslab_cache_destroy(c);
+		for (i = 0; i < 4096; i++) {
+			if (uslab_alloc(a) == NULL) {
+				break;
+			}
+		}
+		is(i, 4096);
+		is(uslab_alloc(a), NULL);
+		uslab_destroy_map(a);
+
+		/* Poisoning would undo constructors. */
+		a = uslab_create_heap_flags(64, 64, 1,
+		    USLAB_DEBUG | USLAB_POISON);
+		isnt(a, NULL);
+		is(uslab_cache_create(a, NULL, NULL, NULL), NULL);
+		is(errno, EINVAL);
+		uslab_destroy_heap(a);
+	}
+
+	/*
+	 * Test that aligned slabs round their objects up, and that colored
+	 * slabs start each region at a different cacheline of a page.
+	 */
+	{
+		static const unsigned int flags[] = {
+			0, USLAB_TAGGED, USLAB_RELOCATABLE, USLAB_DEBUG,
+		};
+		static char *p[1024];
+		struct uslab_set *s;
+		struct uslab_pt *pts;
+		struct uslab *a;
+		char *base = (char *)0x7d000000;
+		uint64_t i, k, n;
+		int bad;
+
+		a = uslab_create_heap_flags(48, 64, 1, USLAB_ALIGN(64));
+		isnt(a, NULL);
+		is(a->size_class, 64);
+		is(a->pt_color, 0);
+		bad = 0;
+		for (n = 0; (p[n] = uslab_alloc(a)) != NULL; n++) {
+			bad += ((uintptr_t)p[n] % 64 != 0);
+		}
+		is(n, 64);
+		is(bad, 0);
+		uslab_destroy_heap(a);
+
+		/* Heap slabs align and color like mapped ones. */
+		a = uslab_create_heap_flags(100, 64, 4,
+		    USLAB_ALIGN(4096) | USLAB_COLOR);
+		isnt(a, NULL);
+		bad = 0;
+		for (n = 0; (p[n] = uslab_alloc(a)) != NULL; n++) {
+			bad += ((uintptr_t)p[n] % 4096 != 0);
+		}
+		is(n, 64);
+		is(bad, 0);
+		uslab_destroy_heap(a);
+
+		a = uslab_create_heap_flags(48, 1024, 16,
+		    USLAB_ALIGN(64) | USLAB_COLOR);
+		isnt(a, NULL);
+		bad = 0;
+		for (i = 0; i < 16; i++) {
+			bad += ((uintptr_t)a->pt_base[i].base % 4096 != i * 64);
+		}
+		is(bad, 0);
+		uslab_destroy_heap(a);
+
+		a = uslab_create_heap_flags(48, 64, 1, USLAB_ALIGN(8192));
+		is(a, NULL);
+		is(errno, EINVAL);
+
+		for (k = 0; k < sizeof (flags) / sizeof (flags[0]); k++) {
+			a = uslab_create_anonymous_flags(NULL, 48, 1024, 16,
+			    flags[k] | USLAB_ALIGN(64) | USLAB_COLOR);
+			isnt(a, NULL);
+			is(a->pt_color, 64);
+
+			/* Headers are page aligned, so offsets will do. */
+			pts = (flags[k] & USLAB_RELOCATABLE) ? reloc_pts(a) :
+			    a->pt_base;
+			bad = 0;
+			for (i = 0; i < 16; i++) {
+				bad += ((uintptr_t)pts[i].base % 4096 != i * 64);
+			}
+			is(bad, 0);
+
+			/* Every object is usable, and goes back where it was. */
+			bad = 0;
+			for (n = 0; n < 1024 && (p[n] = uslab_alloc(a)) != NULL;
+			    n++) {
+				bad += ((uintptr_t)p[n] % 64 != 0);
+			}
+			is(n, 1024);
+			is(bad, 0);
+			is(uslab_alloc(a), NULL);
+			for (i = 0; i < n; i++) {
+				uslab_free(a, p[i]);
+			}
+			is(uslab_alloc_bulk(a, (void **)p, 1024), 1024);
+			uslab_free_bulk(a, (void **)p, 1024);
+			uslab_destroy_map(a);
+		}
+
+		a = uslab_create_anonymous_flags(NULL, 64, 1024, 4,
+		    USLAB_ALIGN(256) | USLAB_COLOR);
+		isnt(a, NULL);
+		is(a->size_class, 256);
+		is(a->pt_color, 256);
+		is((uintptr_t)a->pt_base[3].base % 4096, 768);
+		uslab_destroy_map(a);
+
+		/* Growable slabs color the regions they add. */
+		a = uslab_create_growable(NULL, 64, 256, 2, 1024, USLAB_COLOR);
+		isnt(a, NULL);
+		for (n = 0; uslab_alloc(a) != NULL; n++)
+			;
+		is(n, 1024);
+		is(a->pt_slabs, 8);
+		is((uintptr_t)a->pt_base[7].base % 4096, 7 * 64);
+		uslab_destroy_map(a);
+
+		/* Reopening needs the same layout. */
+		unlink("tmp/color");
+		a = uslab_create_ramdisk_flags("tmp/color", base, 64, 1024, 4,
+		    USLAB_COLOR);
+		isnt(a, NULL);
+		p[0] = uslab_alloc(a);
+		uslab_destroy_map(a);
+		a = uslab_create_ramdisk("tmp/color", base, 64, 1024, 4);
+		is(a, NULL);
+		a = uslab_create_ramdisk_flags("tmp/color", base, 64, 1024, 4,
+		    USLAB_COLOR);
+		isnt(a, NULL);
+		for (n = 0; uslab_alloc(a) != NULL; n++)
+			;
+		is(n, 1023);
+		uslab_destroy_map(a);
+		unlink("tmp/color");
+
+		s = uslab_set_create_anonymous(NULL, 16, 256, 64 * 1024, 2,
+		    USLAB_COLOR);
+		is(s, NULL);
+		is(errno, EINVAL);
+	}
+
+	/* Test that prepared divisors give exact quotients. */
+	{
+		static const uint64_t big[] = {
+			641, 4160, 1000000007, 12345678901234567ULL,
+			1ULL << 63, (1ULL << 63) + 1, UINT64_MAX - 1, UINT64_MAX,
+		};
+		struct uslab_div v;
+		uint64_t edge[6], d, n, x, i, k;
+		int bad;
+
+		bad = 0;
+		x = 88172645463325252ULL;
+		for (i = 0; i < 4096 + sizeof (big) / sizeof (big[0]); i++) {
+			d = (i < 4096) ? i + 1 : big[i - 4096];
+			uslab_div_init(&v, d);
+			edge[0] = 0;
+			edge[1] = d - 1;
+			edge[2] = d;
+			edge[3] = UINT64_MAX;
+			edge[4] = UINT64_MAX / d * d;
+			edge[5] = edge[4] - 1;
+			for (k = 0; k < 64; k++) {
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				if (k < 6) {
+					n = edge[k];
+				} else {
+					n = (k & 1) ? x : x % (d * 1024 + 1);
+				}
+				bad += (uslab_div(&v, n) != n / d);
+			}
+		}
+		is(bad, 0);
+	}
+
 	return 0;
 }